@@ -16,6 +16,7 @@
 
 #include <linux/device.h>
 #include <linux/file.h>
+#include <linux/ktime.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
 #include <linux/ion.h>
@@ -33,6 +34,9 @@
 #include "ion_priv.h"
 #define DEBUG
 
+#define CREATE_TRACE_POINTS
+#include "ion_trace.h"
+
 /**
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
@@ -63,6 +67,10 @@ struct ion_device {
  * @heap_mask:		mask of all supported heaps
  * @name:		used for debugging
  * @task:		used for debugging
+ * @held:		bytes of buffers this client currently holds a handle to
+ * @peak:		high watermark of @held
+ * @allocs:		number of successful ion_alloc calls
+ * @fails:		number of failed ion_alloc calls
  *
  * A client represents a list of buffers this client may access.
  * The mutex stored here is used to protect both handles tree
@@ -79,6 +87,10 @@ struct ion_client {
 	struct task_struct *task;
 	pid_t pid;
 	struct dentry *debug_root;
+	size_t held;
+	size_t peak;
+	unsigned long allocs;
+	unsigned long fails;
 };
 
 /**
@@ -130,6 +142,55 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
+static void ion_heap_stats_alloc(struct ion_heap *heap, size_t len, s64 us)
+{
+	struct ion_heap_stats *stats = &heap->stats;
+	int bucket = 0;
+	unsigned long flags;
+
+	while (bucket < ION_LAT_BUCKETS - 1 && us >= (1LL << bucket))
+		bucket++;
+
+	spin_lock_irqsave(&heap->stats_lock, flags);
+	stats->cur += len;
+	if (stats->cur > stats->peak)
+		stats->peak = stats->cur;
+	stats->allocs++;
+	stats->lat[bucket]++;
+	spin_unlock_irqrestore(&heap->stats_lock, flags);
+}
+
+static void ion_heap_stats_fail(struct ion_heap *heap)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&heap->stats_lock, flags);
+	heap->stats.fails++;
+	spin_unlock_irqrestore(&heap->stats_lock, flags);
+}
+
+static void ion_heap_stats_free(struct ion_heap *heap, size_t len)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&heap->stats_lock, flags);
+	heap->stats.cur -= len;
+	heap->stats.frees++;
+	spin_unlock_irqrestore(&heap->stats_lock, flags);
+}
+
+static void ion_heap_stats_map(struct ion_buffer *buffer,
+			       enum ion_map_type type)
+{
+	struct ion_heap *heap = buffer->heap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&heap->stats_lock, flags);
+	heap->stats.maps[type]++;
+	spin_unlock_irqrestore(&heap->stats_lock, flags);
+	trace_ion_map_buffer(buffer, type);
+}
+
 /* this function should only be called while dev->lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
@@ -138,6 +199,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     unsigned long flags)
 {
 	struct ion_buffer *buffer;
+	ktime_t start;
 	int ret;
 
 	buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
@@ -147,13 +209,17 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->heap = heap;
 	kref_init(&buffer->ref);
 
+	start = ktime_get();
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
 	if (ret) {
+		ion_heap_stats_fail(heap);
 		kfree(buffer);
 		return ERR_PTR(ret);
 	}
 	buffer->dev = dev;
 	buffer->size = len;
+	buffer->alloc_us = ktime_us_delta(ktime_get(), start);
+	ion_heap_stats_alloc(heap, len, buffer->alloc_us);
 	mutex_init(&buffer->lock);
 	ion_buffer_add(dev, buffer);
 	return buffer;
@@ -164,6 +230,8 @@ static void ion_buffer_destroy(struct kref *kref)
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
 
+	trace_ion_free_buffer(buffer);
+	ion_heap_stats_free(buffer->heap, buffer->size);
 	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
@@ -201,14 +269,19 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 static void ion_handle_destroy(struct kref *kref)
 {
 	struct ion_handle *handle = container_of(kref, struct ion_handle, ref);
+	struct ion_client *client = handle->client;
+	size_t size = handle->buffer->size;
+
 	/* XXX Can a handle be destroyed while it's map count is non-zero?:
 	   if (handle->map_cnt) unmap
 	 */
 	ion_buffer_put(handle->buffer);
-	mutex_lock(&handle->client->lock);
-	if (!RB_EMPTY_NODE(&handle->node))
-		rb_erase(&handle->node, &handle->client->handles);
-	mutex_unlock(&handle->client->lock);
+	mutex_lock(&client->lock);
+	if (!RB_EMPTY_NODE(&handle->node)) {
+		rb_erase(&handle->node, &client->handles);
+		client->held -= size;
+	}
+	mutex_unlock(&client->lock);
 	kfree(handle);
 }
 
@@ -278,6 +351,9 @@ static void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 
 	rb_link_node(&handle->node, parent, p);
 	rb_insert_color(&handle->node, &client->handles);
+	client->held += handle->buffer->size;
+	if (client->held > client->peak)
+		client->peak = client->held;
 }
 
 struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
@@ -309,14 +385,21 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	}
 	mutex_unlock(&dev->lock);
 
-	if (IS_ERR_OR_NULL(buffer))
+	if (IS_ERR_OR_NULL(buffer)) {
+		mutex_lock(&client->lock);
+		client->fails++;
+		mutex_unlock(&client->lock);
+		trace_ion_alloc_buffer_fail(client, len, flags, PTR_ERR(buffer));
 		return ERR_PTR(PTR_ERR(buffer));
+	}
 
 	handle = ion_handle_create(client, buffer);
 
 	if (IS_ERR_OR_NULL(handle))
 		goto end;
 
+	trace_ion_alloc_buffer(client, buffer, flags, buffer->alloc_us);
+
 	/*
 	 * ion_buffer_create will create a buffer with a ref_cnt of 1,
 	 * and ion_handle_create will take a second reference, drop one here
@@ -325,11 +408,16 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 
 	mutex_lock(&client->lock);
 	ion_handle_add(client, handle);
+	client->allocs++;
 	mutex_unlock(&client->lock);
 	return handle;
 
 end:
 	ion_buffer_put(buffer);
+	mutex_lock(&client->lock);
+	client->fails++;
+	mutex_unlock(&client->lock);
+	trace_ion_alloc_buffer_fail(client, len, flags, PTR_ERR(handle));
 	return handle;
 }
 
@@ -435,6 +523,8 @@ void *ion_map_kernel(struct ion_client *client, struct ion_handle *handle)
 		vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
 		if (IS_ERR_OR_NULL(vaddr))
 			_ion_unmap(&buffer->kmap_cnt, &handle->kmap_cnt);
+		else
+			ion_heap_stats_map(buffer, ION_MAP_KERNEL);
 		buffer->vaddr = vaddr;
 	} else {
 		vaddr = buffer->vaddr;
@@ -471,6 +561,8 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
 		sglist = buffer->heap->ops->map_dma(buffer->heap, buffer);
 		if (IS_ERR_OR_NULL(sglist))
 			_ion_unmap(&buffer->dmap_cnt, &handle->dmap_cnt);
+		else
+			ion_heap_stats_map(buffer, ION_MAP_DMA);
 		buffer->sglist = sglist;
 	} else {
 		sglist = buffer->sglist;
@@ -582,9 +674,15 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 	struct rb_node *n;
 	size_t sizes[ION_NUM_HEAPS] = {0};
 	const char *names[ION_NUM_HEAPS] = {0};
+	size_t held, peak;
+	unsigned long allocs, fails;
 	int i;
 
 	mutex_lock(&client->lock);
+	held = client->held;
+	peak = client->peak;
+	allocs = client->allocs;
+	fails = client->fails;
 	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
 		struct ion_handle *handle = rb_entry(n, struct ion_handle,
 						     node);
@@ -603,6 +701,8 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.16s: %16u %d\n", names[i], sizes[i],
 			   atomic_read(&client->ref.refcount));
 	}
+	seq_printf(s, "held= %u peak= %u allocs= %lu fails= %lu\n",
+		   held, peak, allocs, fails);
 	return 0;
 }
 
@@ -884,6 +984,7 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 		       __func__);
 		goto err1;
 	}
+	ion_heap_stats_map(buffer, ION_MAP_USER);
 
 	vma->vm_ops = &ion_vm_ops;
 	/* move the handle into the vm_private_data so we can access it from
@@ -905,6 +1006,22 @@ err:
 	return ret;
 }
 
+/*
+ * Whether vma is an mmap() of buffer through its share fd, as opposed to
+ * any other mapping the caller has at that address. Called with mmap_sem
+ * held.
+ */
+bool ion_vma_maps_buffer(struct vm_area_struct *vma, struct ion_buffer *buffer)
+{
+	struct ion_handle *handle = vma->vm_private_data;
+
+	if (!vma->vm_file || vma->vm_file->f_op != &ion_share_fops)
+		return false;
+	if (vma->vm_file->private_data != buffer)
+		return false;
+	return handle && handle->buffer == buffer;
+}
+
 static const struct file_operations ion_share_fops = {
 	.owner		= THIS_MODULE,
 	.release	= ion_share_release,
@@ -1083,6 +1200,36 @@ flag= 0x%8x phy= 0x%8x vaddr= 0x%8x\n",
 	return size;
 }
 
+static void ion_debug_heap_stats(struct seq_file *s, struct ion_heap *heap)
+{
+	struct ion_heap_stats stats;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&heap->stats_lock, flags);
+	stats = heap->stats;
+	spin_unlock_irqrestore(&heap->stats_lock, flags);
+
+	seq_printf(s, "cur= %u peak= %u allocs= %lu frees= %lu fails= %lu\n",
+		   stats.cur, stats.peak, stats.allocs, stats.frees,
+		   stats.fails);
+	seq_printf(s, "kmaps= %lu dmaps= %lu umaps= %lu\n",
+		   stats.maps[ION_MAP_KERNEL], stats.maps[ION_MAP_DMA],
+		   stats.maps[ION_MAP_USER]);
+	seq_printf(s, "alloc latency:\n");
+	for (i = 0; i < ION_LAT_BUCKETS; i++) {
+		if (!stats.lat[i])
+			continue;
+		if (i < ION_LAT_BUCKETS - 1)
+			seq_printf(s, "  < %8luus: %lu\n", 1UL << i,
+				   stats.lat[i]);
+		else
+			seq_printf(s, " >= %8luus: %lu\n", 1UL << (i - 1),
+				   stats.lat[i]);
+	}
+	seq_printf(s, "----------------------------------------------------\n");
+}
+
 static int ion_debug_heap_show(struct seq_file *s, void *unused)
 {
 	struct ion_heap *heap = s->private;
@@ -1135,6 +1282,11 @@ flag= 0x%8x phy= 0x%8x vaddr= 0x%8x\n",
 	}
 	mutex_unlock(&dev->lock);
 	seq_printf(s, "----------------------------------------------------\n");
+
+	ion_debug_heap_stats(s, heap);
+
+	if (heap->ops->debug_show)
+		heap->ops->debug_show(heap, s);
 	return 0;
 }
 
@@ -1157,6 +1309,8 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	struct ion_heap *entry;
 
 	heap->dev = dev;
+	memset(&heap->stats, 0, sizeof(heap->stats));
+	spin_lock_init(&heap->stats_lock);
 	mutex_lock(&dev->lock);
 	while (*p) {
 		parent = *p;
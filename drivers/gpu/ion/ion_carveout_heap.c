@@ -16,35 +16,337 @@
 #include <linux/spinlock.h>
 
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <video/ion_sprd.h>
 #include "ion_priv.h"
 
 #include <asm/mach/map.h>
 
+#define ION_CARVEOUT_CACHE_MAX		16	/* recently freed regions kept */
+#define ION_CARVEOUT_CACHE_SHIFT	2	/* cache at most 1/4 of the heap */
+
+/**
+ * struct ion_carveout_extent - a free or freed region of the carveout
+ * @size_node:		node in free_by_size, ordered by size then base
+ * @addr_node:		node in free_by_addr, ordered by base
+ * @list:		entry in the deferred or cache list instead of the trees
+ * @base:		physical start of the region
+ * @size:		size of the region
+ */
+struct ion_carveout_extent {
+	struct rb_node size_node;
+	struct rb_node addr_node;
+	struct list_head list;
+	ion_phys_addr_t base;
+	unsigned long size;
+};
+
+/**
+ * struct ion_carveout_heap - a heap backed by a reserved physical range
+ * @heap:		the heap itself
+ * @base:		start of the carveout
+ * @size:		size of the carveout
+ * @lock:		protects everything below
+ * @free_by_size:	free extents, for best-fit allocation
+ * @free_by_addr:	the same extents, for merging with neighbours
+ * @deferred:		freed regions waiting for free_work to put them back
+ * @cache:		recently freed regions, most recent first, that are
+ *			handed out again as they are to allocations of the
+ *			same size
+ * @free_work:		moves deferred regions to the cache or the trees
+ *
+ * The counters below are for debugfs.
+ */
 struct ion_carveout_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
 	ion_phys_addr_t base;
+	unsigned long size;
+	struct mutex lock;
+	struct rb_root free_by_size;
+	struct rb_root free_by_addr;
+	struct list_head deferred;
+	struct list_head cache;
+	struct work_struct free_work;
+	unsigned long free_bytes;
+	unsigned long free_extents;
+	unsigned long deferred_bytes;
+	unsigned long cache_bytes;
+	unsigned long cache_count;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long alloc_fails;
 };
 
+static void ion_carveout_insert_free(struct ion_carveout_heap *carveout_heap,
+				     struct ion_carveout_extent *extent)
+{
+	struct rb_node **p = &carveout_heap->free_by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct ion_carveout_extent *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_extent, size_node);
+		if (extent->size < entry->size ||
+		    (extent->size == entry->size && extent->base < entry->base))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&extent->size_node, parent, p);
+	rb_insert_color(&extent->size_node, &carveout_heap->free_by_size);
+
+	p = &carveout_heap->free_by_addr.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_extent, addr_node);
+		if (extent->base < entry->base)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&extent->addr_node, parent, p);
+	rb_insert_color(&extent->addr_node, &carveout_heap->free_by_addr);
+
+	carveout_heap->free_bytes += extent->size;
+	carveout_heap->free_extents++;
+}
+
+static void ion_carveout_erase_free(struct ion_carveout_heap *carveout_heap,
+				    struct ion_carveout_extent *extent)
+{
+	rb_erase(&extent->size_node, &carveout_heap->free_by_size);
+	rb_erase(&extent->addr_node, &carveout_heap->free_by_addr);
+	carveout_heap->free_bytes -= extent->size;
+	carveout_heap->free_extents--;
+}
+
+/*
+ * Gives 'extent' back to the free trees, merged with the free extents right
+ * before and after it. Caller needs to hold carveout_heap->lock.
+ */
+static void ion_carveout_release(struct ion_carveout_heap *carveout_heap,
+				 struct ion_carveout_extent *extent)
+{
+	struct rb_node *n = carveout_heap->free_by_addr.rb_node;
+	struct ion_carveout_extent *prev = NULL, *next = NULL, *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct ion_carveout_extent, addr_node);
+		if (extent->base < entry->base) {
+			next = entry;
+			n = n->rb_left;
+		} else {
+			prev = entry;
+			n = n->rb_right;
+		}
+	}
+
+	if (prev && prev->base + prev->size == extent->base) {
+		ion_carveout_erase_free(carveout_heap, prev);
+		extent->base = prev->base;
+		extent->size += prev->size;
+		kfree(prev);
+	}
+	if (next && extent->base + extent->size == next->base) {
+		ion_carveout_erase_free(carveout_heap, next);
+		extent->size += next->size;
+		kfree(next);
+	}
+	ion_carveout_insert_free(carveout_heap, extent);
+}
+
+/*
+ * Carves 'size' bytes aligned to 'align' out of the smallest free extent
+ * that can hold them. Caller needs to hold carveout_heap->lock.
+ */
+static ion_phys_addr_t ion_carveout_best_fit(
+		struct ion_carveout_heap *carveout_heap,
+		unsigned long size, unsigned long align)
+{
+	struct rb_node *n = carveout_heap->free_by_size.rb_node;
+	struct ion_carveout_extent *extent = NULL, *entry, *head, *tail;
+	ion_phys_addr_t base;
+
+	/* find the smallest extent that is large enough... */
+	while (n) {
+		entry = rb_entry(n, struct ion_carveout_extent, size_node);
+		if (entry->size >= size) {
+			extent = entry;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	/* ...and still is once aligned */
+	for (; extent; extent = n ? rb_entry(n, struct ion_carveout_extent,
+					      size_node) : NULL) {
+		base = ALIGN(extent->base, align);
+		if (base + size <= extent->base + extent->size)
+			break;
+		n = rb_next(&extent->size_node);
+	}
+	if (!extent)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+
+	ion_carveout_erase_free(carveout_heap, extent);
+
+	/* give back what is left over on either side */
+	if (base + size < extent->base + extent->size) {
+		tail = kmalloc(sizeof(*tail), GFP_KERNEL);
+		if (!tail)
+			goto err;
+		tail->base = base + size;
+		tail->size = extent->base + extent->size - tail->base;
+		ion_carveout_insert_free(carveout_heap, tail);
+	}
+	if (base > extent->base) {
+		head = extent;
+		head->size = base - head->base;
+		ion_carveout_insert_free(carveout_heap, head);
+	} else {
+		kfree(extent);
+	}
+	return base;
+
+err:
+	ion_carveout_insert_free(carveout_heap, extent);
+	return ION_CARVEOUT_ALLOCATE_FAIL;
+}
+
+/* Caller needs to hold carveout_heap->lock. */
+static void ion_carveout_evict(struct ion_carveout_heap *carveout_heap,
+			       struct ion_carveout_extent *extent)
+{
+	list_del(&extent->list);
+	carveout_heap->cache_bytes -= extent->size;
+	carveout_heap->cache_count--;
+	ion_carveout_release(carveout_heap, extent);
+}
+
+/*
+ * Puts the deferred regions back, keeping the most recent ones in the cache
+ * as long as it stays small. Caller needs to hold carveout_heap->lock.
+ */
+static void ion_carveout_drain_deferred(struct ion_carveout_heap *carveout_heap,
+					bool cache)
+{
+	struct ion_carveout_extent *extent, *tmp;
+	unsigned long cache_limit = carveout_heap->size >>
+				    ION_CARVEOUT_CACHE_SHIFT;
+
+	list_for_each_entry_safe(extent, tmp, &carveout_heap->deferred, list) {
+		list_del(&extent->list);
+		carveout_heap->deferred_bytes -= extent->size;
+
+		if (!cache || extent->size > cache_limit) {
+			ion_carveout_release(carveout_heap, extent);
+			continue;
+		}
+
+		list_add(&extent->list, &carveout_heap->cache);
+		carveout_heap->cache_bytes += extent->size;
+		carveout_heap->cache_count++;
+		while (carveout_heap->cache_count > ION_CARVEOUT_CACHE_MAX ||
+		       carveout_heap->cache_bytes > cache_limit)
+			ion_carveout_evict(carveout_heap,
+					   list_entry(carveout_heap->cache.prev,
+						      struct ion_carveout_extent,
+						      list));
+	}
+}
+
+static void ion_carveout_free_work(struct work_struct *work)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(work, struct ion_carveout_heap, free_work);
+
+	mutex_lock(&carveout_heap->lock);
+	ion_carveout_drain_deferred(carveout_heap, true);
+	mutex_unlock(&carveout_heap->lock);
+}
+
+/*
+ * Looks for a freed region of exactly 'size' bytes, in the cache and among
+ * the ones the worker did not get to yet. Caller needs to hold
+ * carveout_heap->lock.
+ */
+static ion_phys_addr_t ion_carveout_reuse(
+		struct ion_carveout_heap *carveout_heap,
+		unsigned long size, unsigned long align)
+{
+	struct ion_carveout_extent *extent;
+	ion_phys_addr_t base;
+
+	list_for_each_entry(extent, &carveout_heap->cache, list) {
+		if (extent->size == size && IS_ALIGNED(extent->base, align)) {
+			carveout_heap->cache_bytes -= size;
+			carveout_heap->cache_count--;
+			goto found;
+		}
+	}
+	list_for_each_entry(extent, &carveout_heap->deferred, list) {
+		if (extent->size == size && IS_ALIGNED(extent->base, align)) {
+			carveout_heap->deferred_bytes -= size;
+			goto found;
+		}
+	}
+	return ION_CARVEOUT_ALLOCATE_FAIL;
+
+found:
+	list_del(&extent->list);
+	base = extent->base;
+	kfree(extent);
+	return base;
+}
+
 ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 				      unsigned long size,
 				      unsigned long align)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
+	unsigned long offset;
 
-	printk("ion: malloc: size=%08x, pool=%08x, offset=%08x \n", size, carveout_heap->pool, offset);
+	size = PAGE_ALIGN(size);
+	if (align < PAGE_SIZE)
+		align = PAGE_SIZE;
 
-	if (!offset)
-		return ION_CARVEOUT_ALLOCATE_FAIL;
+	mutex_lock(&carveout_heap->lock);
+	offset = ion_carveout_reuse(carveout_heap, size, align);
+	if (offset != ION_CARVEOUT_ALLOCATE_FAIL) {
+		carveout_heap->cache_hits++;
+		goto out;
+	}
+	carveout_heap->cache_misses++;
+
+	offset = ion_carveout_best_fit(carveout_heap, size, align);
+	if (offset == ION_CARVEOUT_ALLOCATE_FAIL &&
+	    (carveout_heap->deferred_bytes || carveout_heap->cache_bytes)) {
+		/* merge everything that was held back, then try again */
+		ion_carveout_drain_deferred(carveout_heap, false);
+		while (!list_empty(&carveout_heap->cache))
+			ion_carveout_evict(carveout_heap,
+					   list_first_entry(&carveout_heap->cache,
+							    struct ion_carveout_extent,
+							    list));
+		offset = ion_carveout_best_fit(carveout_heap, size, align);
+	}
+	if (offset == ION_CARVEOUT_ALLOCATE_FAIL)
+		carveout_heap->alloc_fails++;
+out:
+	mutex_unlock(&carveout_heap->lock);
 
 	return offset;
 }
@@ -54,13 +356,22 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_extent *extent;
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
 
-	printk("ion: free  : size=%08x, pool=%08x, offset=%08x \n", size, carveout_heap->pool, addr);
-	
-	gen_pool_free(carveout_heap->pool, addr, size);
+	/* losing track of the region would leak it for good */
+	extent = kmalloc(sizeof(*extent), GFP_KERNEL | __GFP_NOFAIL);
+	extent->base = addr;
+	extent->size = PAGE_ALIGN(size);
+
+	mutex_lock(&carveout_heap->lock);
+	list_add_tail(&extent->list, &carveout_heap->deferred);
+	carveout_heap->deferred_bytes += extent->size;
+	mutex_unlock(&carveout_heap->lock);
+
+	schedule_work(&carveout_heap->free_work);
 }
 
 static int ion_carveout_heap_phys(struct ion_heap *heap,
@@ -79,10 +390,10 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 {
 	buffer->priv_phys = ion_carveout_allocate(heap, size, align);
 	printk(KERN_INFO "pgprot_noncached flags 0x%x\n",flags);
-	if(flags&(1<<31))
-		buffer->flags |= (1<<31); 
+	if(flags&ION_SPRD_FLAG_CACHED)
+		buffer->flags |= ION_SPRD_FLAG_CACHED; 
 	else 
-		buffer->flags &= (~(1<<31));
+		buffer->flags &= (~ION_SPRD_FLAG_CACHED);
 	buffer->flags |= (flags & 0x7FFF0000);/*for debug*/
 	return buffer->priv_phys == ION_CARVEOUT_ALLOCATE_FAIL ? -ENOMEM : 0;
 }
@@ -125,7 +436,7 @@ void ion_carveout_heap_unmap_kernel(struct ion_heap *heap,
 int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			       struct vm_area_struct *vma)
 {
-	if((buffer->flags & (1<<31)) )
+	if((buffer->flags & ION_SPRD_FLAG_CACHED) )
 	{	
 		printk(KERN_INFO "pgprot_cached buffer->flags 0x%x\n",buffer->flags);
 		return remap_pfn_range(vma, vma->vm_start,
@@ -145,6 +456,36 @@ int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	}
 }
 
+static int ion_carveout_heap_debug_show(struct ion_heap *heap,
+					struct seq_file *s)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	unsigned long largest = 0;
+	struct rb_node *n;
+
+	mutex_lock(&carveout_heap->lock);
+	n = rb_last(&carveout_heap->free_by_size);
+	if (n)
+		largest = rb_entry(n, struct ion_carveout_extent,
+				   size_node)->size;
+
+	seq_printf(s, "carveout: size %lu free %lu in %lu extents, largest %lu\n",
+		   carveout_heap->size, carveout_heap->free_bytes,
+		   carveout_heap->free_extents, largest);
+	seq_printf(s, "fragmentation: %lu%%\n", carveout_heap->free_bytes ?
+		   100 - largest * 100 / carveout_heap->free_bytes : 0);
+	seq_printf(s, "cached: %lu bytes in %lu regions, deferred: %lu bytes\n",
+		   carveout_heap->cache_bytes, carveout_heap->cache_count,
+		   carveout_heap->deferred_bytes);
+	seq_printf(s, "cache hits: %lu misses: %lu, failed allocations: %lu\n",
+		   carveout_heap->cache_hits, carveout_heap->cache_misses,
+		   carveout_heap->alloc_fails);
+	mutex_unlock(&carveout_heap->lock);
+
+	return 0;
+}
+
 static struct ion_heap_ops carveout_heap_ops = {
 	.allocate = ion_carveout_heap_allocate,
 	.free = ion_carveout_heap_free,
@@ -152,24 +493,36 @@ static struct ion_heap_ops carveout_heap_ops = {
 	.map_user = ion_carveout_heap_map_user,
 	.map_kernel = ion_carveout_heap_map_kernel,
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
+	.debug_show = ion_carveout_heap_debug_show,
 };
 
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 {
 	struct ion_carveout_heap *carveout_heap;
+	struct ion_carveout_extent *extent;
 
 	carveout_heap = kzalloc(sizeof(struct ion_carveout_heap), GFP_KERNEL);
 	if (!carveout_heap)
 		return ERR_PTR(-ENOMEM);
 
-	carveout_heap->pool = gen_pool_create(12, -1);
-	if (!carveout_heap->pool) {
+	extent = kmalloc(sizeof(*extent), GFP_KERNEL);
+	if (!extent) {
 		kfree(carveout_heap);
 		return ERR_PTR(-ENOMEM);
 	}
 	carveout_heap->base = heap_data->base;
-	gen_pool_add(carveout_heap->pool, carveout_heap->base, heap_data->size,
-		     -1);
+	carveout_heap->size = heap_data->size;
+	mutex_init(&carveout_heap->lock);
+	carveout_heap->free_by_size = RB_ROOT;
+	carveout_heap->free_by_addr = RB_ROOT;
+	INIT_LIST_HEAD(&carveout_heap->deferred);
+	INIT_LIST_HEAD(&carveout_heap->cache);
+	INIT_WORK(&carveout_heap->free_work, ion_carveout_free_work);
+
+	extent->base = heap_data->base;
+	extent->size = heap_data->size;
+	ion_carveout_insert_free(carveout_heap, extent);
+
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
 
@@ -180,8 +533,19 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 {
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
+	struct ion_carveout_extent *extent, *tmp;
+	struct rb_node *n;
 
-	gen_pool_destroy(carveout_heap->pool);
+	cancel_work_sync(&carveout_heap->free_work);
+	list_for_each_entry_safe(extent, tmp, &carveout_heap->deferred, list)
+		kfree(extent);
+	list_for_each_entry_safe(extent, tmp, &carveout_heap->cache, list)
+		kfree(extent);
+	while ((n = rb_first(&carveout_heap->free_by_addr))) {
+		extent = rb_entry(n, struct ion_carveout_extent, addr_node);
+		rb_erase(n, &carveout_heap->free_by_addr);
+		kfree(extent);
+	}
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
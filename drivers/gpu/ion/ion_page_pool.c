@@ -0,0 +1,188 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+struct ion_page_pool_item {
+	struct page *page;
+	struct list_head list;
+};
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(nth_page(page, i));
+}
+
+static void ion_page_pool_add(struct ion_page_pool *pool,
+			      struct ion_page_pool_item *item, bool dirty)
+{
+	mutex_lock(&pool->mutex);
+	if (dirty) {
+		list_add_tail(&item->list, &pool->dirty_items);
+		pool->dirty_count++;
+	} else {
+		list_add_tail(&item->list, &pool->items);
+		pool->count++;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+/* caller needs to hold pool->mutex */
+static struct ion_page_pool_item *ion_page_pool_remove(
+		struct ion_page_pool *pool, bool dirty)
+{
+	struct ion_page_pool_item *item;
+
+	if (dirty) {
+		if (list_empty(&pool->dirty_items))
+			return NULL;
+		item = list_first_entry(&pool->dirty_items,
+					struct ion_page_pool_item, list);
+		pool->dirty_count--;
+	} else {
+		if (list_empty(&pool->items))
+			return NULL;
+		item = list_first_entry(&pool->items,
+					struct ion_page_pool_item, list);
+		pool->count--;
+	}
+	list_del(&item->list);
+	return item;
+}
+
+/*
+ * Zeroes the pages given back to the pool, so that the allocation path
+ * usually finds them ready.
+ */
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  work);
+	struct ion_page_pool_item *item;
+
+	for (;;) {
+		mutex_lock(&pool->mutex);
+		item = ion_page_pool_remove(pool, true);
+		mutex_unlock(&pool->mutex);
+		if (!item)
+			break;
+
+		ion_page_pool_zero(pool, item->page);
+		ion_page_pool_add(pool, item, false);
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_item *item;
+	struct page *page;
+	bool dirty = false;
+
+	mutex_lock(&pool->mutex);
+	item = ion_page_pool_remove(pool, false);
+	if (!item) {
+		item = ion_page_pool_remove(pool, true);
+		dirty = true;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!item)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+
+	page = item->page;
+	kfree(item);
+	if (dirty)
+		ion_page_pool_zero(pool, page);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	struct ion_page_pool_item *item;
+
+	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
+	if (!item) {
+		__free_pages(page, pool->order);
+		return;
+	}
+	item->page = page;
+	ion_page_pool_add(pool, item, true);
+	schedule_work(&pool->work);
+}
+
+/* returns the number of pages, of any order, held by the pool */
+int ion_page_pool_total(struct ion_page_pool *pool)
+{
+	return (pool->count + pool->dirty_count) << pool->order;
+}
+
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct ion_page_pool_item *item;
+	int freed = 0;
+
+	while (freed < nr_to_scan) {
+		mutex_lock(&pool->mutex);
+		/* give back the pages that still need zeroing first */
+		item = ion_page_pool_remove(pool, true);
+		if (!item)
+			item = ion_page_pool_remove(pool, false);
+		mutex_unlock(&pool->mutex);
+		if (!item)
+			break;
+
+		__free_pages(item->page, pool->order);
+		kfree(item);
+		freed += (1 << pool->order);
+	}
+
+	return freed;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool;
+
+	pool = kmalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	pool->count = 0;
+	pool->dirty_count = 0;
+	INIT_LIST_HEAD(&pool->items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	mutex_init(&pool->mutex);
+	INIT_WORK(&pool->work, ion_page_pool_zero_work);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->work);
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
@@ -21,9 +21,12 @@
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 
 struct ion_mapping;
+struct seq_file;
 
 struct ion_dma_mapping {
 	struct kref ref;
@@ -36,6 +39,7 @@ struct ion_kernel_mapping {
 };
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
+bool ion_vma_maps_buffer(struct vm_area_struct *vma, struct ion_buffer *buffer);
 
 /**
  * struct ion_buffer - metadata for a particular buffer
@@ -54,6 +58,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @alloc_us:		time the heap took to allocate the buffer
 */
 struct ion_buffer {
 	struct kref ref;
@@ -71,6 +76,7 @@ struct ion_buffer {
 	void *vaddr;
 	int dmap_cnt;
 	struct scatterlist *sglist;
+	s64 alloc_us;
 };
 
 /**
@@ -84,6 +90,8 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ * @debug_show		optional, prints heap specific state to the heap's
+ *			debugfs file
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -99,6 +107,39 @@ struct ion_heap_ops {
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
+	int (*debug_show) (struct ion_heap *heap, struct seq_file *s);
+};
+
+enum ion_map_type {
+	ION_MAP_KERNEL,
+	ION_MAP_DMA,
+	ION_MAP_USER,
+	ION_NUM_MAP_TYPES,
+};
+
+/* bucket i counts allocations that took less than 2^i us, the last one
+   everything slower */
+#define ION_LAT_BUCKETS		16
+
+/**
+ * struct ion_heap_stats - usage accounting for a heap, protected by the
+ * heap's stats_lock
+ * @cur:		bytes currently allocated from the heap
+ * @peak:		high watermark of @cur
+ * @allocs:		number of successful allocations
+ * @frees:		number of buffers given back
+ * @fails:		number of allocations the heap could not satisfy
+ * @maps:		number of mappings made, indexed by ion_map_type
+ * @lat:		allocation latency histogram
+ */
+struct ion_heap_stats {
+	size_t cur;
+	size_t peak;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long fails;
+	unsigned long maps[ION_NUM_MAP_TYPES];
+	unsigned long lat[ION_LAT_BUCKETS];
 };
 
 /**
@@ -111,6 +152,8 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @stats_lock:		protects @stats
+ * @stats:		usage accounting, shown in the heap's debugfs file
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -124,6 +167,8 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	spinlock_t stats_lock;
+	struct ion_heap_stats stats;
 };
 
 /**
@@ -181,4 +226,39 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of zeroed items in the pool
+ * @dirty_count:	number of items waiting to be zeroed
+ * @items:		list of zeroed items
+ * @dirty_items:	list of items freed back to the pool, not zeroed yet
+ * @mutex:		lock protecting this struct and especially the counts
+ *			and item lists
+ * @work:		zeroes the dirty items in the background
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ *
+ * Allows you to keep a pool of pre-zeroed pages around.  Pages come back
+ * to the pool dirty and get zeroed by a worker, so that allocating rarely
+ * has to wait for zeroing.  Use ion_page_pool_shrink() to give pages back
+ * to the system, for instance from a shrinker.
+ */
+struct ion_page_pool {
+	int count;
+	int dirty_count;
+	struct list_head items;
+	struct list_head dirty_items;
+	struct mutex mutex;
+	struct work_struct work;
+	gfp_t gfp_mask;
+	unsigned int order;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_total(struct ion_page_pool *);
+int ion_page_pool_shrink(struct ion_page_pool *, int nr_to_scan);
+
 #endif /* _ION_PRIV_H */
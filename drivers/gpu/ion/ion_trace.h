@@ -0,0 +1,116 @@
+/*
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ion
+
+#if !defined(_ION_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ION_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct ion_buffer;
+struct ion_client;
+struct ion_heap;
+
+TRACE_EVENT(ion_alloc_buffer,
+	TP_PROTO(struct ion_client *client, struct ion_buffer *buffer,
+		 unsigned int flags, s64 latency_us),
+	TP_ARGS(client, buffer, flags, latency_us),
+	TP_STRUCT__entry(
+		__field(void *, buffer)
+		__field(int, pid)
+		__field(int, heap)
+		__field(size_t, len)
+		__field(unsigned int, flags)
+		__field(s64, latency_us)
+	),
+	TP_fast_assign(
+		__entry->buffer = buffer;
+		__entry->pid = client->pid;
+		__entry->heap = buffer->heap->id;
+		__entry->len = buffer->size;
+		__entry->flags = flags;
+		__entry->latency_us = latency_us;
+	),
+	TP_printk("buffer=%p client_pid=%d heap=%d len=%zu flags=0x%x latency_us=%lld",
+		  __entry->buffer, __entry->pid, __entry->heap, __entry->len,
+		  __entry->flags, __entry->latency_us)
+);
+
+TRACE_EVENT(ion_alloc_buffer_fail,
+	TP_PROTO(struct ion_client *client, size_t len, unsigned int flags,
+		 long error),
+	TP_ARGS(client, len, flags, error),
+	TP_STRUCT__entry(
+		__field(int, pid)
+		__field(size_t, len)
+		__field(unsigned int, flags)
+		__field(long, error)
+	),
+	TP_fast_assign(
+		__entry->pid = client->pid;
+		__entry->len = len;
+		__entry->flags = flags;
+		__entry->error = error;
+	),
+	TP_printk("client_pid=%d len=%zu flags=0x%x error=%ld",
+		  __entry->pid, __entry->len, __entry->flags, __entry->error)
+);
+
+TRACE_EVENT(ion_free_buffer,
+	TP_PROTO(struct ion_buffer *buffer),
+	TP_ARGS(buffer),
+	TP_STRUCT__entry(
+		__field(void *, buffer)
+		__field(int, heap)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->buffer = buffer;
+		__entry->heap = buffer->heap->id;
+		__entry->len = buffer->size;
+	),
+	TP_printk("buffer=%p heap=%d len=%zu",
+		  __entry->buffer, __entry->heap, __entry->len)
+);
+
+TRACE_EVENT(ion_map_buffer,
+	TP_PROTO(struct ion_buffer *buffer, int type),
+	TP_ARGS(buffer, type),
+	TP_STRUCT__entry(
+		__field(void *, buffer)
+		__field(int, heap)
+		__field(size_t, len)
+		__field(int, type)
+	),
+	TP_fast_assign(
+		__entry->buffer = buffer;
+		__entry->heap = buffer->heap->id;
+		__entry->len = buffer->size;
+		__entry->type = type;
+	),
+	TP_printk("buffer=%p heap=%d len=%zu type=%s",
+		  __entry->buffer, __entry->heap, __entry->len,
+		  __print_symbolic(__entry->type,
+				   { ION_MAP_KERNEL, "kernel" },
+				   { ION_MAP_DMA, "dma" },
+				   { ION_MAP_USER, "user" }))
+);
+
+#endif /* _ION_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE ion_trace
+#include <trace/define_trace.h>
@@ -11,9 +11,13 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/ion.h>
+#include <linux/mm.h>
 #include <linux/platform_device.h>
+#include <linux/sched.h>
+#include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <video/ion_sprd.h>
@@ -25,6 +29,169 @@ struct ion_device *idev;
 int num_heaps;
 struct ion_heap **heaps;
 
+/*
+ * Above this size, flushing the whole caches is cheaper than maintaining
+ * the range line by line.
+ */
+#define SPRD_ION_SYNC_ALL_SIZE	(512 * 1024)
+
+static void sprd_ion_flush_inner_all(void *unused)
+{
+	__cpuc_flush_kern_all();
+}
+
+static void sprd_ion_sync_inner(void *vaddr, size_t size, int direction)
+{
+	switch (direction) {
+	case ION_SYNC_TO_DEVICE:
+		dmac_map_area(vaddr, size, DMA_TO_DEVICE);	/* clean */
+		break;
+	case ION_SYNC_FROM_DEVICE:
+		dmac_unmap_area(vaddr, size, DMA_FROM_DEVICE);	/* invalidate */
+		break;
+	default:
+		dmac_flush_range(vaddr, vaddr + size);
+	}
+}
+
+static void sprd_ion_sync_outer(unsigned long paddr, size_t size,
+				int direction)
+{
+	switch (direction) {
+	case ION_SYNC_TO_DEVICE:
+		outer_clean_range(paddr, paddr + size);
+		break;
+	case ION_SYNC_FROM_DEVICE:
+		outer_inv_range(paddr, paddr + size);
+		break;
+	default:
+		outer_flush_range(paddr, paddr + size);
+	}
+}
+
+static void sprd_ion_sync_outer_sg(struct scatterlist *sg, size_t offset,
+				   size_t size, int direction)
+{
+	for (; sg && size; sg = sg_next(sg)) {
+		size_t len;
+
+		if (offset >= sg->length) {
+			offset -= sg->length;
+			continue;
+		}
+		len = min_t(size_t, size, sg->length - offset);
+		sprd_ion_sync_outer(sg_phys(sg) + offset, len, direction);
+		offset = 0;
+		size -= len;
+	}
+}
+
+/*
+ * Syncs the range of the caller's mapping at 'vaddr', which maps 'paddr' or
+ * the part of 'sg' at 'offset'. Devices see memory in this order: the l1
+ * has to be cleaned before the l2, and the l2 invalidated before the l1.
+ */
+static void sprd_ion_sync_range(void *vaddr, unsigned long paddr,
+				struct scatterlist *sg, size_t offset,
+				size_t size, int direction)
+{
+	/*
+	 * Flushing everything also writes back lines of the range that the
+	 * device is about to overwrite, so it is not done for FROM_DEVICE.
+	 */
+	if (size >= SPRD_ION_SYNC_ALL_SIZE &&
+	    direction != ION_SYNC_FROM_DEVICE) {
+		on_each_cpu(sprd_ion_flush_inner_all, NULL, 1);
+		outer_flush_all();
+		return;
+	}
+
+	if (direction != ION_SYNC_FROM_DEVICE)
+		sprd_ion_sync_inner(vaddr, size, direction);
+	if (sg)
+		sprd_ion_sync_outer_sg(sg, offset, size, direction);
+	else
+		sprd_ion_sync_outer(paddr, size, direction);
+	if (direction == ION_SYNC_FROM_DEVICE)
+		sprd_ion_sync_inner(vaddr, size, direction);
+}
+
+/*
+ * Carveout buffers are mapped uncached unless they were allocated with
+ * ION_SPRD_FLAG_CACHED, so the caches never hold anything of theirs.
+ */
+static bool sprd_ion_buffer_cached(struct ion_buffer *buffer)
+{
+	if (buffer->heap->type == ION_HEAP_TYPE_CARVEOUT)
+		return buffer->flags & ION_SPRD_FLAG_CACHED;
+	return true;
+}
+
+static int sprd_ion_sync(struct ion_client *client, struct ion_sync_data *data)
+{
+	struct ion_handle *handle;
+	struct ion_buffer *buffer;
+	struct vm_area_struct *vma;
+	unsigned long start = (unsigned long)data->vaddr;
+	ion_phys_addr_t paddr;
+	struct scatterlist *sg = NULL;
+	size_t len;
+	int ret = 0;
+
+	if (data->direction != ION_SYNC_TO_DEVICE &&
+	    data->direction != ION_SYNC_FROM_DEVICE &&
+	    data->direction != ION_SYNC_BIDIRECTIONAL)
+		return -EINVAL;
+
+	handle = ion_import_fd(client, data->fd_buffer);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	buffer = ion_handle_buffer(handle);
+
+	if (data->offset > buffer->size ||
+	    data->size > buffer->size - data->offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!data->size || !sprd_ion_buffer_cached(buffer))
+		goto out;
+
+	if (!ion_phys(client, handle, &paddr, &len)) {
+		paddr += data->offset;
+	} else {
+		sg = ion_map_dma(client, handle);
+		if (IS_ERR_OR_NULL(sg)) {
+			ret = sg ? PTR_ERR(sg) : -EINVAL;
+			goto out;
+		}
+	}
+
+	/*
+	 * The range must stay mapped while we maintain it by address, and be
+	 * this buffer's own mapping at 'offset': the cache operations have no
+	 * fault fixup, so any other user address could oops.
+	 */
+	down_read(&current->mm->mmap_sem);
+	vma = find_vma(current->mm, start);
+	if (!vma || vma->vm_start > start ||
+	    vma->vm_end - start < data->size ||
+	    !ion_vma_maps_buffer(vma, buffer) ||
+	    start - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT) !=
+	    data->offset) {
+		ret = -EFAULT;
+	} else {
+		sprd_ion_sync_range(data->vaddr, paddr, sg, data->offset,
+				    data->size, data->direction);
+	}
+	up_read(&current->mm->mmap_sem);
+
+	if (sg)
+		ion_unmap_dma(client, handle);
+out:
+	ion_free(client, handle);
+	return ret;
+}
+
 
 static long sprd_heap_ioctl(struct ion_client *client, unsigned int cmd,
 				unsigned long arg)
@@ -62,33 +229,27 @@ static long sprd_heap_ioctl(struct ion_client *client, unsigned int cmd,
 	case ION_SPRD_CUSTOM_MSYNC:
 	{
 		struct ion_msync_data data;
-		void *flush_start, *flush_end;
-		void *kaddr;
-		void *paddr;
-		size_t size;
+
 		if (copy_from_user(&data, (void __user *)arg,
 				sizeof(data))) {
 			return -EFAULT;
 		}
-		flush_start = data.vaddr;
-		flush_end = data.vaddr + data.size;
-        kaddr = data.vaddr;
-		paddr = data.paddr;	
-		size = data.size;
-		//printk(KERN_INFO "ion flush_start %x, %x,size %x",data.vaddr,data.paddr,data.size);
-#if 0		
-		dmac_flush_range(flush_start, flush_end);
-#else	
-		{
-			//BUG_ON(!virt_addr_valid(kaddr) || !virt_addr_valid(kaddr + size - 1));
-
-			dmac_flush_range(kaddr, kaddr + size);
- 	
-			outer_clean_range(paddr, paddr + size);
-
-			/* FIXME: non-speculating: flush on bidirectional mappings? */
+
+		/* the old interface: no direction, flush both ways */
+		sprd_ion_sync_range(data.vaddr, (unsigned long)data.paddr, NULL,
+				    0, data.size, ION_SYNC_BIDIRECTIONAL);
+		break;
+	}
+	case ION_SPRD_CUSTOM_SYNC:
+	{
+		struct ion_sync_data data;
+
+		if (copy_from_user(&data, (void __user *)arg,
+				sizeof(data))) {
+			return -EFAULT;
 		}
-#endif
+
+		ret = sprd_ion_sync(client, &data);
 		break;
 	}
 	default:
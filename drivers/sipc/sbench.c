@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2012 Spreadtrum Communications Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SIPC round-trip benchmark against a peer that echoes, such as the
+ * loopback peer. Write "<smsg|sbuf|sblock> [size] [count] [threads]" to
+ * debugfs sipc/bench to run it, and read the file for the result.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+
+#define SBENCH_SMSG		0
+#define SBENCH_SBUF		1
+#define SBENCH_SBLOCK		2
+#define SBENCH_TYPE_NR		3
+
+#define SBENCH_THREADS_MAX	4
+#define SBENCH_COUNT_MAX	100000
+#define SBENCH_TIMEOUT		2000	/* ms */
+
+#define SBENCH_SBUF_SIZE	(16 * 1024)
+#define SBENCH_SBLOCK_NUM	64
+#define SBENCH_SBLOCK_SIZE	2048
+
+static uint dst = SIPC_ID_WCN;
+module_param(dst, uint, 0644);
+MODULE_PARM_DESC(dst, "processor ID of the echo peer");
+
+static uint smsg_channel = SMSG_CH_COMM;
+module_param(smsg_channel, uint, 0644);
+
+static uint sbuf_channel = SMSG_CH_PIPE;
+module_param(sbuf_channel, uint, 0644);
+
+static uint sblock_channel = SMSG_CH_DATA;
+module_param(sblock_channel, uint, 0644);
+
+static const char *sbench_names[SBENCH_TYPE_NR] = {
+	"smsg", "sbuf", "sblock",
+};
+
+struct sbench_worker {
+	int			id;
+	uint32_t		*lat;	/* round trip of each op, us */
+	uint32_t		done;
+	int			rval;
+	void			*txbuf;
+	void			*rxbuf;
+};
+
+struct sbench_result {
+	int			type;
+	uint32_t		size;
+	uint32_t		threads;
+	uint32_t		ops;
+	int			rval;
+	uint64_t		elapsed;	/* us */
+	uint32_t		p50;
+	uint32_t		p99;
+	uint32_t		max;
+};
+
+struct sbench {
+	struct mutex		lock;
+
+	/* the channels set up so far, one bit for each type */
+	uint32_t		ready;
+
+	int			type;
+	uint32_t		size;
+	uint32_t		count;
+	atomic_t		running;
+	struct completion	start;
+	struct completion	finish;
+	struct sbench_worker	workers[SBENCH_THREADS_MAX];
+
+	struct sbench_result	result;
+};
+
+static struct sbench sbench;
+
+static int sbench_smsg(struct sbench_worker *w, uint32_t seq)
+{
+	struct smsg msg;
+	int rval;
+
+	smsg_set(&msg, smsg_channel, SMSG_TYPE_EVENT, w->id, seq);
+	rval = smsg_send(dst, &msg, SBENCH_TIMEOUT);
+	if (rval) {
+		return rval;
+	}
+
+	smsg_set(&msg, smsg_channel, 0, 0, 0);
+	return smsg_recv(dst, &msg, SBENCH_TIMEOUT);
+}
+
+static int sbench_sbuf(struct sbench_worker *w, uint32_t size)
+{
+	uint32_t len;
+	int rval;
+
+	for (len = 0; len < size; len += rval) {
+		rval = sbuf_write(dst, sbuf_channel, w->id, w->txbuf + len,
+				size - len, SBENCH_TIMEOUT);
+		if (rval < 0) {
+			return rval;
+		}
+	}
+	for (len = 0; len < size; len += rval) {
+		rval = sbuf_read(dst, sbuf_channel, w->id, w->rxbuf + len,
+				size - len, SBENCH_TIMEOUT);
+		if (rval < 0) {
+			return rval;
+		}
+	}
+
+	return memcmp(w->txbuf, w->rxbuf, size) ? -EIO : 0;
+}
+
+static int sbench_sblock(struct sbench_worker *w, uint32_t size)
+{
+	struct sblock blk;
+	int rval;
+
+	rval = sblock_get(dst, sblock_channel, &blk, SBENCH_TIMEOUT);
+	if (rval) {
+		return rval;
+	}
+	memcpy(blk.addr, w->txbuf, size);
+	blk.length = size;
+	rval = sblock_send(dst, sblock_channel, &blk);
+	if (rval) {
+		return rval;
+	}
+
+	/* other threads may get this echo, any block will do */
+	rval = sblock_receive(dst, sblock_channel, &blk, SBENCH_TIMEOUT);
+	if (rval) {
+		return rval;
+	}
+	rval = (blk.length == size) ? 0 : -EIO;
+	sblock_release(dst, sblock_channel, &blk);
+
+	return rval;
+}
+
+static int sbench_thread(void *data)
+{
+	struct sbench_worker *w = data;
+	ktime_t stamp;
+	uint32_t i;
+
+	wait_for_completion(&sbench.start);
+
+	for (i = 0; i < sbench.count; i++) {
+		stamp = ktime_get();
+		switch (sbench.type) {
+		case SBENCH_SMSG:
+			w->rval = sbench_smsg(w, i);
+			break;
+		case SBENCH_SBUF:
+			w->rval = sbench_sbuf(w, sbench.size);
+			break;
+		default:
+			w->rval = sbench_sblock(w, sbench.size);
+			break;
+		}
+		if (w->rval) {
+			break;
+		}
+		w->lat[i] = sipc_us_since(stamp);
+	}
+	w->done = i;
+
+	if (atomic_dec_and_test(&sbench.running)) {
+		complete(&sbench.finish);
+	}
+
+	return 0;
+}
+
+/* wait for the peer to finish the ring handshake */
+static int sbench_wait_ready(int (*status)(uint8_t dst, uint8_t channel),
+		uint8_t channel)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(SBENCH_TIMEOUT);
+
+	while (status(dst, channel)) {
+		if (time_after(jiffies, timeout)) {
+			return -ETIME;
+		}
+		msleep(10);
+	}
+
+	return 0;
+}
+
+/* open the channel of a bench type on first use */
+static int sbench_setup(int type)
+{
+	int rval;
+
+	if (sbench.ready & (1 << type)) {
+		/* a late handshake may be done by now */
+		if (type == SBENCH_SBUF) {
+			return sbuf_status(dst, sbuf_channel);
+		} else if (type == SBENCH_SBLOCK) {
+			return sblock_status(dst, sblock_channel);
+		}
+		return 0;
+	}
+
+	switch (type) {
+	case SBENCH_SMSG:
+		rval = smsg_ch_open(dst, smsg_channel, SBENCH_TIMEOUT);
+		break;
+	case SBENCH_SBUF:
+		rval = sbuf_create(dst, sbuf_channel, SBENCH_THREADS_MAX,
+				SBENCH_SBUF_SIZE, SBENCH_SBUF_SIZE);
+		if (!rval) {
+			/* created once, even if the peer is slow to answer */
+			sbench.ready |= 1 << type;
+			rval = sbench_wait_ready(sbuf_status, sbuf_channel);
+		}
+		break;
+	default:
+		rval = sblock_create(dst, sblock_channel,
+				SBENCH_SBLOCK_NUM, SBENCH_SBLOCK_SIZE,
+				SBENCH_SBLOCK_NUM, SBENCH_SBLOCK_SIZE);
+		if (!rval) {
+			sbench.ready |= 1 << type;
+			rval = sbench_wait_ready(sblock_status, sblock_channel);
+		}
+		break;
+	}
+
+	if (rval) {
+		printk(KERN_ERR "sbench: failed to set up %s on %d-%d: %d\n",
+				sbench_names[type], dst,
+				type == SBENCH_SMSG ? smsg_channel :
+				type == SBENCH_SBUF ? sbuf_channel : sblock_channel,
+				rval);
+		return rval;
+	}
+
+	sbench.ready |= 1 << type;
+	return 0;
+}
+
+static int sbench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int sbench_run(int type, uint32_t size, uint32_t count, uint32_t threads)
+{
+	struct sbench_result *res = &sbench.result;
+	struct sbench_worker *w;
+	struct task_struct *task;
+	uint32_t *lat, ops;
+	ktime_t stamp;
+	int i, rval;
+
+	rval = sbench_setup(type);
+	if (rval) {
+		return rval;
+	}
+
+	lat = vmalloc(sizeof(uint32_t) * count * threads);
+	if (!lat) {
+		return -ENOMEM;
+	}
+
+	sbench.type = type;
+	sbench.size = size;
+	sbench.count = count;
+	atomic_set(&sbench.running, threads);
+	init_completion(&sbench.start);
+	init_completion(&sbench.finish);
+
+	memset(sbench.workers, 0, sizeof(sbench.workers));
+	for (i = 0; i < threads; i++) {
+		w = &sbench.workers[i];
+		w->id = i;
+		w->lat = lat + i * count;
+		w->txbuf = kmalloc(size, GFP_KERNEL);
+		w->rxbuf = kmalloc(size, GFP_KERNEL);
+		if (!w->txbuf || !w->rxbuf) {
+			rval = -ENOMEM;
+			break;
+		}
+		memset(w->txbuf, 0x5a ^ i, size);
+
+		task = kthread_run(sbench_thread, w, "sbench-%d", i);
+		if (IS_ERR(task)) {
+			rval = PTR_ERR(task);
+			break;
+		}
+	}
+
+	if (i < threads) {
+		/* let the started threads run nothing */
+		sbench.count = 0;
+		if (atomic_sub_and_test(threads - i, &sbench.running)) {
+			complete(&sbench.finish);
+		}
+	}
+
+	stamp = ktime_get();
+	complete_all(&sbench.start);
+	wait_for_completion(&sbench.finish);
+
+	memset(res, 0, sizeof(*res));
+	res->type = type;
+	res->size = size;
+	res->threads = threads;
+	res->rval = rval;
+	res->elapsed = ktime_us_delta(ktime_get(), stamp);
+
+	/* pack the latencies of all the threads and sort them */
+	ops = 0;
+	for (i = 0; i < threads; i++) {
+		w = &sbench.workers[i];
+		if (w->done) {
+			memmove(lat + ops, w->lat, sizeof(uint32_t) * w->done);
+			ops += w->done;
+		}
+		if (w->rval && !res->rval) {
+			res->rval = w->rval;
+		}
+		kfree(w->txbuf);
+		kfree(w->rxbuf);
+	}
+	res->ops = ops;
+	if (ops) {
+		sort(lat, ops, sizeof(uint32_t), sbench_cmp, NULL);
+		res->p50 = lat[ops / 2];
+		res->p99 = lat[ops * 99 / 100];
+		res->max = lat[ops - 1];
+	}
+
+	vfree(lat);
+
+	return res->rval;
+}
+
+static int sbench_show(struct seq_file *m, void *private)
+{
+	struct sbench_result *res = &sbench.result;
+	uint64_t bps = 0, opss = 0;
+
+	mutex_lock(&sbench.lock);
+	if (!res->threads) {
+		seq_printf(m, "usage: echo \"<smsg|sbuf|sblock> [size] [count] "
+				"[threads]\" > bench\n");
+		mutex_unlock(&sbench.lock);
+		return 0;
+	}
+
+	if (res->elapsed) {
+		opss = div64_u64((uint64_t)res->ops * USEC_PER_SEC, res->elapsed);
+		bps = div64_u64((uint64_t)res->ops * res->size * USEC_PER_SEC,
+				res->elapsed);
+	}
+
+	seq_printf(m, "%s: dst %u, size %u, threads %u, rval %d\n",
+			sbench_names[res->type], dst, res->size, res->threads,
+			res->rval);
+	seq_printf(m, "  %u round trips in %llu us, %llu ops/s, "
+			"%llu.%02llu MB/s each way\n",
+			res->ops, res->elapsed, opss, bps >> 20,
+			((bps & ((1 << 20) - 1)) * 100) >> 20);
+	seq_printf(m, "  latency us: p50 %u, p99 %u, max %u\n",
+			res->p50, res->p99, res->max);
+	mutex_unlock(&sbench.lock);
+
+	return 0;
+}
+
+static int sbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sbench_show, inode->i_private);
+}
+
+static ssize_t sbench_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	char buf[64], name[8];
+	uint32_t size = 64, num = 1000, threads = 1, max;
+	int type, rval;
+
+	if (count >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(buf, ubuf, count)) {
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%7s %u %u %u", name, &size, &num, &threads) < 1) {
+		return -EINVAL;
+	}
+	for (type = 0; type < SBENCH_TYPE_NR; type++) {
+		if (!strcmp(name, sbench_names[type])) {
+			break;
+		}
+	}
+
+	if (type == SBENCH_SMSG) {
+		/* a smsg carries its own 8 bytes */
+		size = sizeof(struct smsg);
+	}
+	max = (type == SBENCH_SBUF) ? SBENCH_SBUF_SIZE : SBENCH_SBLOCK_SIZE;
+	if (type == SBENCH_TYPE_NR || size == 0 || size > max ||
+			num == 0 || num > SBENCH_COUNT_MAX ||
+			threads == 0 || threads > SBENCH_THREADS_MAX) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&sbench.lock);
+	rval = sbench_run(type, size, num, threads);
+	mutex_unlock(&sbench.lock);
+
+	return rval ? rval : count;
+}
+
+static const struct file_operations sbench_fops = {
+	.open = sbench_open,
+	.read = seq_read,
+	.write = sbench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init sbench_init(void)
+{
+	mutex_init(&sbench.lock);
+	debugfs_create_file("bench", S_IRUGO | S_IWUSR, sipc_debugfs_root(),
+			NULL, &sbench_fops);
+
+	return 0;
+}
+
+late_initcall(sbench_init);
+
+MODULE_AUTHOR("Chen Gaopeng");
+MODULE_DESCRIPTION("SIPC benchmark");
+MODULE_LICENSE("GPL");
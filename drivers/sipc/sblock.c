@@ -22,22 +22,228 @@
 #include <linux/io.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/timer.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/uaccess.h>
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
 
 #include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+#include <trace/events/sipc.h>
 #include "sblock.h"
 
 static struct sblock_mgr *sblocks[SIPC_ID_NR][SMSG_CH_NR];
+/* keeps sblock_destroy from freeing a sblock while debugfs shows it */
+static DEFINE_MUTEX(sblocks_lock);
 
+/* called with plock held */
 static void __sblock_put(struct sblock_mgr *sblock, uint32_t addr)
 {
 	void* virt_addr;
 	uint32_t index;
-	spin_lock(&sblock->ring->plock);
+
 	virt_addr = addr - sblock->smem_addr + sblock->smem_virt;
-	index = (virt_addr - sblock->smem_virt) / sblock->ring->header->txblk_size;
+	index = (virt_addr - sblock->ring->txblk_virt) / sblock->ring->header->txblk_size;
 	list_add(&sblock->ring->txunits[index].list, &sblock->ring->txpool);
-	spin_unlock(&sblock->ring->plock);
+	sblock->stat.txinflight--;
+}
+
+/* take back the tx blocks released by peer, value is a legacy single block */
+static void sblock_put_released(struct sblock_mgr *sblock, uint32_t value)
+{
+	struct sblock_ring *ring = sblock->ring;
+	volatile struct sblock_ring_header *ringhd = ring->header;
+	volatile struct sblock_rel_header *relhd = ring->relhd;
+	unsigned long flags;
+	int relpos;
+
+	spin_lock_irqsave(&ring->plock, flags);
+	if (value) {
+		__sblock_put(sblock, value);
+	}
+	while ((sblock->caps & SBLOCK_CAP_RELRING) &&
+			relhd->txrel_rdptr != relhd->txrel_wrptr) {
+		rmb();
+		relpos = relhd->txrel_rdptr % ringhd->txblk_count;
+		__sblock_put(sblock, ring->txrelblks[relpos].addr);
+		relhd->txrel_rdptr = relhd->txrel_rdptr + 1;
+	}
+	spin_unlock_irqrestore(&ring->plock, flags);
+}
+
+/*
+ * raise one event for all the pending blocks, if it can't be sent the
+ * blocks stay pending for a retry
+ */
+static int sblock_event(struct sblock_mgr *sblock, atomic_t *pending,
+		uint16_t flag, int timeout)
+{
+	struct smsg mevt;
+	int rval;
+
+	if (!atomic_xchg(pending, 0)) {
+		return 0;
+	}
+
+	smsg_set(&mevt, sblock->channel, SMSG_TYPE_EVENT, flag, 0);
+	rval = smsg_send(sblock->dst, &mevt, timeout);
+	if (rval) {
+		atomic_inc(pending);
+	} else {
+		sblock->stat.events++;
+	}
+
+	return rval;
+}
+
+static void sblock_send_work(struct work_struct *work)
+{
+	struct sblock_mgr *sblock = container_of(work, struct sblock_mgr, sendwork);
+
+	/* one event for all the blocks put in the tx ring so far */
+	sblock_event(sblock, &sblock->txpending, SMSG_EVENT_SBLOCK_SEND, -1);
+}
+
+/*
+ * legacy release, one event per block with its address, sent right away
+ * without waiting; the release ring only queues the blocks here, what is
+ * left when the smsg ring is full is sent by the release work
+ */
+static int sblock_release_legacy(struct sblock_mgr *sblock)
+{
+	struct sblock_ring *ring = sblock->ring;
+	volatile struct sblock_ring_header *ringhd = ring->header;
+	volatile struct sblock_rel_header *relhd = ring->relhd;
+	struct smsg mevt;
+	unsigned long flags;
+	int relpos, rval = 0;
+
+	spin_lock_irqsave(&ring->rellock, flags);
+	while (relhd->rxrel_rdptr != relhd->rxrel_wrptr) {
+		rmb();
+		relpos = relhd->rxrel_rdptr % ringhd->rxblk_count;
+		smsg_set(&mevt, sblock->channel, SMSG_TYPE_EVENT,
+				SMSG_EVENT_SBLOCK_RELEASE, ring->rxrelblks[relpos].addr);
+		rval = smsg_send(sblock->dst, &mevt, 0);
+		if (rval) {
+			break;
+		}
+		sblock->stat.events++;
+		relhd->rxrel_rdptr = relhd->rxrel_rdptr + 1;
+	}
+	spin_unlock_irqrestore(&ring->rellock, flags);
+
+	return rval;
+}
+
+static void sblock_release_work(struct work_struct *work)
+{
+	struct sblock_mgr *sblock = container_of(work, struct sblock_mgr, relwork);
+
+	if (!(sblock->caps & SBLOCK_CAP_RELRING)) {
+		/* wait for room in the smsg ring, as a blocking send does */
+		while (sblock_release_legacy(sblock) == -EBUSY &&
+				sblock->state == SBLOCK_STATE_READY) {
+			msleep(10);
+		}
+		return;
+	}
+
+	/* one event for all the blocks put in the release ring so far */
+	sblock_event(sblock, &sblock->relpending, SMSG_EVENT_SBLOCK_RELEASE, -1);
+}
+
+static void sblock_flush_timer(unsigned long data)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)data;
+
+	if (atomic_read(&sblock->txpending)) {
+		schedule_work(&sblock->sendwork);
+	}
+	if (atomic_read(&sblock->relpending)) {
+		schedule_work(&sblock->relwork);
+	}
+}
+
+/*
+ * account n published blocks, the event is raised when the flush
+ * threshold is reached, otherwise by the flush timer, it's sent right
+ * away unless the smsg ring is full
+ */
+static void sblock_kick(struct sblock_mgr *sblock, atomic_t *pending,
+		struct work_struct *work, uint16_t flag, int n)
+{
+	if (atomic_add_return(n, pending) >= sblock->flush_thresh) {
+		if (sblock_event(sblock, pending, flag, 0)) {
+			schedule_work(work);
+		}
+	} else if (!timer_pending(&sblock->flushtimer)) {
+		mod_timer(&sblock->flushtimer, jiffies + sblock->flush_delay);
+	}
+}
+
+/* the client handler runs in softirq, never with hard irqs off */
+static void sblock_notify_tasklet(unsigned long data)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)data;
+
+	if (!sblock->handler) {
+		return;
+	}
+	if (test_and_clear_bit(SBLOCK_NOTIFY_RECV, &sblock->notify)) {
+		sblock->handler(SBLOCK_NOTIFY_RECV, sblock->data);
+	}
+	if (test_and_clear_bit(SBLOCK_NOTIFY_GET, &sblock->notify)) {
+		sblock->handler(SBLOCK_NOTIFY_GET, sblock->data);
+	}
+}
+
+static void sblock_notify(struct sblock_mgr *sblock, int event)
+{
+	if (sblock->handler) {
+		set_bit(event, &sblock->notify);
+		tasklet_schedule(&sblock->notifytask);
+	}
+}
+
+/* handle sblock send/release events, returns 0 if handled */
+static int sblock_handle_event(struct sblock_mgr *sblock, struct smsg *msg)
+{
+	switch (msg->flag) {
+	case SMSG_EVENT_SBLOCK_SEND:
+		wake_up_interruptible_all(&sblock->ring->recvwait);
+		sblock_notify(sblock, SBLOCK_NOTIFY_RECV);
+		break;
+	case SMSG_EVENT_SBLOCK_RELEASE:
+		/* non-zero value is a single released block */
+		sblock_put_released(sblock, msg->value);
+		wake_up_interruptible_all(&(sblock->ring->getwait));
+		sblock_notify(sblock, SBLOCK_NOTIFY_GET);
+		break;
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+/* smsg callback in irq context, events don't go through the thread */
+static int sblock_smsg_handler(struct smsg *msg, void *data)
+{
+	struct sblock_mgr *sblock = data;
+
+	if (msg->type != SMSG_TYPE_EVENT ||
+			sblock->state != SBLOCK_STATE_READY) {
+		return 1;
+	}
+
+	return sblock_handle_event(sblock, msg);
 }
 
 static int sblock_thread(void *data)
@@ -57,6 +263,10 @@ static int sblock_thread(void *data)
 		return rval;
 	}
 
+	/* data events are handled in the smsg irq, only ctrl msgs wake us */
+	smsg_register_handler(sblock->dst, sblock->channel,
+			sblock_smsg_handler, sblock);
+
 	/* handle the sblock events */
 	while (!kthread_should_stop()) {
 		/* monitor sblock recv smsg */
@@ -76,34 +286,27 @@ static int sblock_thread(void *data)
 		case SMSG_TYPE_CMD:
 			/* respond cmd done for sblock init */
 			WARN_ON(mrecv.flag != SMSG_CMD_SBLOCK_INIT);
+			/* only a peer that asks for them gets the release rings */
+			if ((mrecv.value & SBLOCK_CAP_MAGIC_MASK) == SBLOCK_CAP_MAGIC) {
+				sblock->caps = mrecv.value & SBLOCK_CAPS;
+			} else {
+				sblock->caps = 0;
+			}
+			sblock->ring->relhd->magic =
+				(sblock->caps & SBLOCK_CAP_RELRING) ? SBLOCK_REL_MAGIC : 0;
+			wmb();
 			smsg_set(&mcmd, sblock->channel, SMSG_TYPE_DONE,
 					SMSG_DONE_SBLOCK_INIT, sblock->smem_addr);
 			smsg_send(sblock->dst, &mcmd, -1);
+			/* ready before the notifier, it may get blocks at once */
+			sblock->state = SBLOCK_STATE_READY;
 			if (sblock->handler) {
 				sblock->handler(SBLOCK_NOTIFY_STATUS, sblock->data);
 			}
-			sblock->state = SBLOCK_STATE_READY;
 			break;
 		case SMSG_TYPE_EVENT:
-			/* handle sblock send/release events */
-			switch (mrecv.flag) {
-			case SMSG_EVENT_SBLOCK_SEND:
-				wake_up_interruptible_all(&sblock->ring->recvwait);
-				if (sblock->handler) {
-					sblock->handler(SBLOCK_NOTIFY_RECV, sblock->data);
-				}
-				break;
-			case SMSG_EVENT_SBLOCK_RELEASE:
-				__sblock_put(sblock, mrecv.value);
-				wake_up_interruptible_all(&(sblock->ring->getwait));
-				if (sblock->handler) {
-					sblock->handler(SBLOCK_NOTIFY_GET, sblock->data);
-				}
-				break;
-			default:
-				rval = 1;
-				break;
-			}
+			/* events before the smsg callback was registered */
+			rval = sblock_handle_event(sblock, &mrecv);
 			break;
 		default:
 			rval = 1;
@@ -126,7 +329,8 @@ int sblock_create(uint8_t dst, uint8_t channel,
 {
 	struct sblock_mgr *sblock;
 	volatile struct sblock_ring_header *ringhd;
-	uint32_t hsize;
+	volatile struct sblock_rel_header *relhd;
+	uint32_t hsize, txoffset, rxoffset;
 	int i;
 
 	sblock = kzalloc(sizeof(struct sblock_mgr) , GFP_KERNEL);
@@ -140,11 +344,17 @@ int sblock_create(uint8_t dst, uint8_t channel,
 	sblock->txblksz = txblocksize;
 	sblock->rxblksz = rxblocksize;
 
-	/* allocate smem */
+	/*
+	 * allocate smem, the ring header, block descriptors, release header
+	 * and release rings come first, then the tx and rx blocks are
+	 * page-aligned, so that a rx block of PAGE_SIZE can be lent to the
+	 * network stack
+	 */
 	hsize = sizeof(struct sblock_ring_header);
-	sblock->smem_size = hsize +
-		txblocknum * txblocksize + rxblocknum * rxblocksize +
-		(txblocknum + rxblocknum) * sizeof(struct sblock_blks);
+	txoffset = PAGE_ALIGN(hsize + sizeof(struct sblock_rel_header) +
+		2 * (txblocknum + rxblocknum) * sizeof(struct sblock_blks));
+	rxoffset = txoffset + PAGE_ALIGN(txblocknum * txblocksize);
+	sblock->smem_size = rxoffset + rxblocknum * rxblocksize;
 	sblock->smem_addr = smem_alloc(sblock->smem_size);
 	if (!sblock->smem_addr) {
 		printk(KERN_ERR "Failed to allocate smem for sblock\n");
@@ -169,21 +379,32 @@ int sblock_create(uint8_t dst, uint8_t channel,
 		return -ENOMEM;
 	}
 	ringhd = (volatile struct sblock_ring_header *)(sblock->smem_virt);
-	ringhd->txblk_addr = sblock->smem_addr + hsize;
+	ringhd->txblk_addr = sblock->smem_addr + txoffset;
 	ringhd->txblk_count = txblocknum;
 	ringhd->txblk_size = txblocksize;
 	ringhd->txblk_rdptr = 0;
 	ringhd->txblk_wrptr = 0;
-	ringhd->txblk_blks = sblock->smem_addr + hsize +
-		txblocknum * txblocksize + rxblocknum * rxblocksize;
-	ringhd->rxblk_addr = ringhd->txblk_addr + txblocknum * txblocksize;
+	ringhd->txblk_blks = sblock->smem_addr + hsize;
+	ringhd->rxblk_addr = sblock->smem_addr + rxoffset;
 	ringhd->rxblk_count = rxblocknum;
 	ringhd->rxblk_size = rxblocksize;
 	ringhd->rxblk_rdptr = 0;
 	ringhd->rxblk_wrptr = 0;
 	ringhd->rxblk_blks = ringhd->txblk_blks + txblocknum * sizeof(struct sblock_blks);
 
+	relhd = sblock->smem_virt +
+		(sblock_rel_header_addr(ringhd) - sblock->smem_addr);
+	relhd->magic = 0;
+	relhd->txrel_blks = sblock_rel_header_addr(ringhd) +
+		sizeof(struct sblock_rel_header);
+	relhd->txrel_rdptr = 0;
+	relhd->txrel_wrptr = 0;
+	relhd->rxrel_blks = relhd->txrel_blks + txblocknum * sizeof(struct sblock_blks);
+	relhd->rxrel_rdptr = 0;
+	relhd->rxrel_wrptr = 0;
+
 	sblock->ring->header = sblock->smem_virt;
+	sblock->ring->relhd = (struct sblock_rel_header *)relhd;
 	sblock->ring->txblk_virt = sblock->smem_virt +
 		(ringhd->txblk_addr - sblock->smem_addr);
 	sblock->ring->txblks = sblock->smem_virt +
@@ -192,6 +413,10 @@ int sblock_create(uint8_t dst, uint8_t channel,
 		(ringhd->rxblk_addr - sblock->smem_addr);
 	sblock->ring->rxblks = sblock->smem_virt +
 		(ringhd->rxblk_blks - sblock->smem_addr);
+	sblock->ring->txrelblks = sblock->smem_virt +
+		(relhd->txrel_blks - sblock->smem_addr);
+	sblock->ring->rxrelblks = sblock->smem_virt +
+		(relhd->rxrel_blks - sblock->smem_addr);
 
 	sblock->ring->txunits = kzalloc(sizeof(struct sblock_txunit) * txblocknum, GFP_KERNEL);
 	if (!sblock->ring->txunits) {
@@ -210,10 +435,21 @@ int sblock_create(uint8_t dst, uint8_t channel,
 
 	init_waitqueue_head(&sblock->ring->getwait);
 	init_waitqueue_head(&sblock->ring->recvwait);
-	mutex_init(&sblock->ring->txlock);
-	mutex_init(&sblock->ring->rxlock);
+	spin_lock_init(&sblock->ring->txlock);
+	spin_lock_init(&sblock->ring->rxlock);
+	spin_lock_init(&sblock->ring->rellock);
 	spin_lock_init(&sblock->ring->plock);
 
+	sblock->flush_thresh = SBLOCK_FLUSH_THRESH;
+	sblock->flush_delay = SBLOCK_FLUSH_DELAY;
+	atomic_set(&sblock->txpending, 0);
+	atomic_set(&sblock->relpending, 0);
+	INIT_WORK(&sblock->sendwork, sblock_send_work);
+	INIT_WORK(&sblock->relwork, sblock_release_work);
+	setup_timer(&sblock->flushtimer, sblock_flush_timer, (unsigned long)sblock);
+	tasklet_init(&sblock->notifytask, sblock_notify_tasklet,
+			(unsigned long)sblock);
+
 	sblock->thread = kthread_create(sblock_thread, sblock,
 			"sblock-%d-%d", dst, channel);
 	if (IS_ERR(sblock->thread)) {
@@ -226,7 +462,9 @@ int sblock_create(uint8_t dst, uint8_t channel,
 		return PTR_ERR(sblock->thread);
 	}
 
+	mutex_lock(&sblocks_lock);
 	sblocks[dst][channel]=sblock;
+	mutex_unlock(&sblocks_lock);
 	wake_up_process(sblock->thread);
 
 	return 0;
@@ -238,14 +476,22 @@ void sblock_destroy(uint8_t dst, uint8_t channel)
 
 	sblock->state = SBLOCK_STATE_IDLE;
 	kthread_stop(sblock->thread);
+	/* the handler queues our works, so it goes before they are flushed */
+	smsg_unregister_handler(dst, channel);
+	tasklet_kill(&sblock->notifytask);
+	del_timer_sync(&sblock->flushtimer);
+	cancel_work_sync(&sblock->sendwork);
+	cancel_work_sync(&sblock->relwork);
+
+	mutex_lock(&sblocks_lock);
+	sblocks[dst][channel]=NULL;
+	mutex_unlock(&sblocks_lock);
 
 	kfree(sblock->ring->txunits);
 	kfree(sblock->ring);
 	iounmap(sblock->smem_virt);
 	smem_free(sblock->smem_addr, sblock->smem_size);
 	kfree(sblock);
-
-	sblocks[dst][channel]=NULL;
 }
 
 int sblock_register_notifier(uint8_t dst, uint8_t channel,
@@ -276,6 +522,8 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	volatile struct sblock_ring_header *ringhd;
 	struct list_head *head;
 	struct sblock_txunit *txunit;
+	unsigned long flags;
+	ktime_t stamp;
 	int rval = 0;
 
 	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
@@ -288,10 +536,9 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	head = &sblock->ring->txpool;
 
 	if (list_empty(head)) {
+		stamp = ktime_get();
 		if (timeout == 0) {
-			/* no wait */
-			printk(KERN_WARNING "sblock_get %d-%d is empty!\n",
-				dst, channel);
+			/* no wait, an empty pool is not an error for xmit */
 			rval = -ENODATA;
 		} else if (timeout < 0) {
 			/* wait forever */
@@ -308,8 +555,13 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 			} else if (rval == 0) {
 				printk(KERN_WARNING "sblock_get wait timeout!\n");
 				rval = -ETIME;
+			} else {
+				rval = 0;
 			}
 		}
+		if (timeout != 0) {
+			sipc_hist_add(&sblock->stat.getwait, sipc_us_since(stamp));
+		}
 	}
 
 	if (rval) {
@@ -317,55 +569,91 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	}
 
 	/* multi-gotter may cause got failure */
-	spin_lock(&ring->plock);
+	spin_lock_irqsave(&ring->plock, flags);
 	if (!list_empty(head)) {
 		txunit = list_entry(head->next, struct sblock_txunit, list);
 		blk->addr = txunit->addr;
 		blk->length = sblock->txblksz;
 		list_del(head->next);
+		if (++sblock->stat.txinflight > sblock->stat.txinflight_max) {
+			sblock->stat.txinflight_max = sblock->stat.txinflight;
+		}
 	} else {
 		rval = -EAGAIN;
 	}
-	spin_unlock(&ring->plock);
+	spin_unlock_irqrestore(&ring->plock, flags);
 
 	return rval;
 }
 
-int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk)
+int sblock_put(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+	struct sblock_ring *ring;
+	unsigned long flags;
+
+	if (!sblock) {
+		return -ENODEV;
+	}
+
+	ring = sblock->ring;
+	spin_lock_irqsave(&ring->plock, flags);
+	__sblock_put(sblock, blk->addr - sblock->smem_virt + sblock->smem_addr);
+	spin_unlock_irqrestore(&ring->plock, flags);
+
+	wake_up_interruptible_all(&ring->getwait);
+
+	return 0;
+}
+
+int sblock_send_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count)
 {
 	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
 	struct sblock_ring *ring;
 	volatile struct sblock_ring_header *ringhd;
-	struct smsg mevt;
-	int txpos;
+	int txpos, i;
 
 	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
 		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
 		return -ENODEV;
 	}
 
-	pr_debug("sblock_send: dst=%d, channel=%d, addr=%p, len=%d\n",
-			dst, channel, blk->addr, blk->length);
+	pr_debug("sblock_send_multi: dst=%d, channel=%d, count=%d\n",
+			dst, channel, count);
 
 	ring = sblock->ring;
 	ringhd = ring->header;
 
-	mutex_lock(&ring->txlock);
+	spin_lock_bh(&ring->txlock);
+
+	for (i = 0; i < count; i++) {
+		txpos = (ringhd->txblk_wrptr + i) % ringhd->txblk_count;
+		ring->txblks[txpos].addr = blks[i].addr - sblock->smem_virt + sblock->smem_addr;
+		ring->txblks[txpos].length = blks[i].length;
+		pr_debug("sblock_send: wrptr=%d, txpos=%d, addr=%x, len=%d\n",
+				ringhd->txblk_wrptr + i, txpos,
+				ring->txblks[txpos].addr, blks[i].length);
+	}
+	/* publish all the blocks at once */
+	wmb();
+	ringhd->txblk_wrptr = ringhd->txblk_wrptr + count;
+	sblock->stat.sent += count;
+
+	spin_unlock_bh(&ring->txlock);
 
-	txpos = ringhd->txblk_wrptr % ringhd->txblk_count;
-	ring->txblks[txpos].addr = blk->addr - sblock->smem_virt + sblock->smem_addr;
-	ring->txblks[txpos].length = blk->length;
-	pr_debug("sblock_send: wrptr=%d, txpos=%d, addr=%x\n",
-			ringhd->txblk_wrptr, txpos, ring->txblks[txpos].addr);
-	ringhd->txblk_wrptr = ringhd->txblk_wrptr + 1;
-	smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBLOCK_SEND, 0);
-	smsg_send(dst, &mevt, -1);
+	trace_sipc_sblock_send(dst, channel, count);
 
-	mutex_unlock(&ring->txlock);
+	sblock_kick(sblock, &sblock->txpending, &sblock->sendwork,
+			SMSG_EVENT_SBLOCK_SEND, count);
 
 	return 0;
 }
 
+int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	return sblock_send_multi(dst, channel, blk, 1);
+}
+
 int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 {
 	struct sblock_mgr *sblock = sblocks[dst][channel];
@@ -408,6 +696,8 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 			} else if (rval == 0) {
 				printk(KERN_WARNING "sblock_receive wait timeout!\n");
 				rval = -ETIME;
+			} else {
+				rval = 0;
 			}
 		}
 	}
@@ -417,58 +707,283 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 	}
 
 	/* multi-receiver may cause recv failure */
-	mutex_lock(&ring->rxlock);
+	spin_lock_bh(&ring->rxlock);
 	if (ringhd->rxblk_wrptr != ringhd->rxblk_rdptr){
+		sipc_hist_add(&sblock->stat.rxoccupancy,
+			ringhd->rxblk_wrptr - ringhd->rxblk_rdptr);
 		rxpos = ringhd->rxblk_rdptr % ringhd->rxblk_count;
 		blk->addr = ring->rxblks[rxpos].addr - sblock->smem_addr + sblock->smem_virt;
 		blk->length = ring->rxblks[rxpos].length;
 		ringhd->rxblk_rdptr = ringhd->rxblk_rdptr + 1;
+		sblock->stat.received++;
 		pr_debug("sblock_receive: rxpos=%d, addr=%p, len=%d\n",
 			rxpos, blk->addr, blk->length);
 	} else {
 		rval = -EAGAIN;
 	}
-	mutex_unlock(&ring->rxlock);
+	spin_unlock_bh(&ring->rxlock);
+
+	if (!rval) {
+		trace_sipc_sblock_receive(dst, channel, 1);
+	}
 
 	return rval;
 }
 
-int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk)
+int sblock_receive_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count)
+{
+	struct sblock_mgr *sblock = sblocks[dst][channel];
+	struct sblock_ring *ring;
+	volatile struct sblock_ring_header *ringhd;
+	int rxpos, n = 0;
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	ring = sblock->ring;
+	ringhd = ring->header;
+
+	spin_lock_bh(&ring->rxlock);
+	if (ringhd->rxblk_wrptr != ringhd->rxblk_rdptr) {
+		sipc_hist_add(&sblock->stat.rxoccupancy,
+			ringhd->rxblk_wrptr - ringhd->rxblk_rdptr);
+	}
+	while (n < count && ringhd->rxblk_wrptr != ringhd->rxblk_rdptr) {
+		rmb();
+		rxpos = ringhd->rxblk_rdptr % ringhd->rxblk_count;
+		blks[n].addr = ring->rxblks[rxpos].addr - sblock->smem_addr + sblock->smem_virt;
+		blks[n].length = ring->rxblks[rxpos].length;
+		ringhd->rxblk_rdptr = ringhd->rxblk_rdptr + 1;
+		n++;
+	}
+	sblock->stat.received += n;
+	spin_unlock_bh(&ring->rxlock);
+
+	if (n) {
+		trace_sipc_sblock_receive(dst, channel, n);
+	}
+
+	pr_debug("sblock_receive_multi: dst=%d, channel=%d, count=%d, got=%d\n",
+			dst, channel, count, n);
+
+	return n;
+}
+
+int sblock_rx_pending(uint8_t dst, uint8_t channel)
+{
+	struct sblock_mgr *sblock = sblocks[dst][channel];
+	volatile struct sblock_ring_header *ringhd;
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		return 0;
+	}
+
+	ringhd = sblock->ring->header;
+	return (int)(ringhd->rxblk_wrptr - ringhd->rxblk_rdptr);
+}
+
+int sblock_release_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count)
 {
 	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
 	struct sblock_ring *ring;
 	volatile struct sblock_ring_header *ringhd;
-	struct smsg mevt;
-	uint32_t addr;
+	volatile struct sblock_rel_header *relhd;
+	unsigned long flags;
+	int relpos, i;
 
 	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
 		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
 		return -ENODEV;
 	}
 
-	pr_debug("sblock_release: dst=%d, channel=%d, addr=%p, len=%d\n",
-			dst, channel, blk->addr, blk->length);
+	pr_debug("sblock_release_multi: dst=%d, channel=%d, count=%d\n",
+			dst, channel, count);
 
 	ring = sblock->ring;
 	ringhd = ring->header;
+	relhd = ring->relhd;
+
+	/* put released rx blocks in the release ring */
+	spin_lock_irqsave(&ring->rellock, flags);
+	for (i = 0; i < count; i++) {
+		relpos = (relhd->rxrel_wrptr + i) % ringhd->rxblk_count;
+		ring->rxrelblks[relpos].addr = blks[i].addr - sblock->smem_virt + sblock->smem_addr;
+		ring->rxrelblks[relpos].length = sblock->rxblksz;
+		pr_debug("sblock_release: addr=%x\n", ring->rxrelblks[relpos].addr);
+	}
+	wmb();
+	relhd->rxrel_wrptr = relhd->rxrel_wrptr + count;
+	sblock->stat.released += count;
+	spin_unlock_irqrestore(&ring->rellock, flags);
+
+	trace_sipc_sblock_release(dst, channel, count);
+
+	if (sblock->caps & SBLOCK_CAP_RELRING) {
+		sblock_kick(sblock, &sblock->relpending, &sblock->relwork,
+				SMSG_EVENT_SBLOCK_RELEASE, count);
+	} else if (sblock_release_legacy(sblock)) {
+		schedule_work(&sblock->relwork);
+	}
+
+	return 0;
+}
+
+int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	return sblock_release_multi(dst, channel, blk, 1);
+}
+
+int sblock_set_flush(uint8_t dst, uint8_t channel, uint32_t thresh, uint32_t delay)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+
+	if (!sblock) {
+		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	if (thresh == 0 || thresh > min(sblock->ring->header->txblk_count,
+			sblock->ring->header->rxblk_count)) {
+		return -EINVAL;
+	}
+
+	sblock->flush_thresh = thresh;
+	sblock->flush_delay = msecs_to_jiffies(delay);
+
+	return 0;
+}
+
+int sblock_status(uint8_t dst, uint8_t channel)
+{
+	struct sblock_mgr *sblock = sblocks[dst][channel];
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+struct page *sblock_page(uint8_t dst, uint8_t channel, struct sblock *blk,
+		uint32_t *offset)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+	struct page *page;
+	unsigned long pfn;
+	uint32_t addr;
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
+		return NULL;
+	}
 
 	addr = blk->addr - sblock->smem_virt + sblock->smem_addr;
-	pr_debug("sblock_release: addr=%x\n", addr);
+	pfn = __phys_to_pfn(addr);
+	if (!pfn_valid(pfn)) {
+		return NULL;
+	}
+
+	page = pfn_to_page(pfn);
+	if (PageHighMem(page)) {
+		return NULL;
+	}
+
+	*offset = addr & ~PAGE_MASK;
 
-	/* send released rx block index */
-	smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBLOCK_RELEASE, addr);
-	smsg_send(dst, &mevt, -1);
+	/* drop stale lines of the cached alias, the peer wrote through smem */
+	outer_inv_range(addr, addr + blk->length);
+	dmac_unmap_area(page_address(page) + *offset, blk->length, DMA_FROM_DEVICE);
+
+	return page;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int sblock_debug_show(struct seq_file *m, void *private)
+{
+	struct sblock_mgr *sblock;
+	volatile struct sblock_ring_header *ringhd;
+	volatile struct sblock_rel_header *relhd;
+	int i, j;
+
+	mutex_lock(&sblocks_lock);
+	for (i = 0; i < SIPC_ID_NR; i++) {
+		for (j = 0; j < SMSG_CH_NR; j++) {
+			sblock = sblocks[i][j];
+			if (!sblock) {
+				continue;
+			}
+
+			ringhd = sblock->ring->header;
+			relhd = sblock->ring->relhd;
+			seq_printf(m, "sblock %d-%d: state %u, caps 0x%x, flush %u/%ums\n",
+					sblock->dst, sblock->channel, sblock->state,
+					sblock->caps, sblock->flush_thresh,
+					jiffies_to_msecs(sblock->flush_delay));
+			seq_printf(m, "  tx: %u x %u, wrptr %u rdptr %u, "
+					"txrel wrptr %u rdptr %u\n",
+					ringhd->txblk_count, ringhd->txblk_size,
+					ringhd->txblk_wrptr, ringhd->txblk_rdptr,
+					relhd->txrel_wrptr, relhd->txrel_rdptr);
+			seq_printf(m, "  rx: %u x %u, wrptr %u rdptr %u, "
+					"rxrel wrptr %u rdptr %u\n",
+					ringhd->rxblk_count, ringhd->rxblk_size,
+					ringhd->rxblk_wrptr, ringhd->rxblk_rdptr,
+					relhd->rxrel_wrptr, relhd->rxrel_rdptr);
+			seq_printf(m, "  sent %u, received %u, released %u, "
+					"events %u, txinflight %u (max %u)\n",
+					sblock->stat.sent, sblock->stat.received,
+					sblock->stat.released, sblock->stat.events,
+					sblock->stat.txinflight,
+					sblock->stat.txinflight_max);
+			sipc_hist_show(m, "get wait (us)", &sblock->stat.getwait);
+			sipc_hist_show(m, "rx pending", &sblock->stat.rxoccupancy);
+		}
+	}
+	mutex_unlock(&sblocks_lock);
 
 	return 0;
 }
 
+static int sblock_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sblock_debug_show, inode->i_private);
+}
+
+static const struct file_operations sblock_debug_fops = {
+	.open = sblock_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init sblock_debugfs_init(void)
+{
+	debugfs_create_file("sblock", S_IRUGO, sipc_debugfs_root(), NULL,
+			&sblock_debug_fops);
+
+	return 0;
+}
+
+late_initcall(sblock_debugfs_init);
+#endif
+
 EXPORT_SYMBOL(sblock_create);
 EXPORT_SYMBOL(sblock_destroy);
 EXPORT_SYMBOL(sblock_register_notifier);
 EXPORT_SYMBOL(sblock_get);
+EXPORT_SYMBOL(sblock_put);
 EXPORT_SYMBOL(sblock_send);
+EXPORT_SYMBOL(sblock_send_multi);
 EXPORT_SYMBOL(sblock_receive);
+EXPORT_SYMBOL(sblock_receive_multi);
+EXPORT_SYMBOL(sblock_rx_pending);
 EXPORT_SYMBOL(sblock_release);
+EXPORT_SYMBOL(sblock_release_multi);
+EXPORT_SYMBOL(sblock_set_flush);
+EXPORT_SYMBOL(sblock_status);
+EXPORT_SYMBOL(sblock_page);
 
 MODULE_AUTHOR("Chen Gaopeng");
 MODULE_DESCRIPTION("SIPC/SBLOCK driver");
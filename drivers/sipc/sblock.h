@@ -22,9 +22,25 @@
 #define SMSG_EVENT_SBLOCK_SEND		0x0001
 #define SMSG_EVENT_SBLOCK_RELEASE	0x0002
 
+/*
+ * capabilities a peer may put in the value of its SMSG_CMD_SBLOCK_INIT,
+ * a legacy peer sends no SBLOCK_CAP_MAGIC and gets the legacy protocol
+ */
+#define SBLOCK_CAP_MAGIC		0x5b1c0000
+#define SBLOCK_CAP_MAGIC_MASK		0xffff0000
+#define SBLOCK_CAP_RELRING		0x0001	/* batched release rings */
+#define SBLOCK_CAPS			(SBLOCK_CAP_RELRING)
+
+/* set in sblock_rel_header once the release rings are agreed on */
+#define SBLOCK_REL_MAGIC		0x5b1e1ea5
+
 #define SBLOCK_STATE_IDLE		0
 #define SBLOCK_STATE_READY		1
 
+/* default: an event as soon as possible for every block */
+#define SBLOCK_FLUSH_THRESH		1
+#define SBLOCK_FLUSH_DELAY		0
+
 struct sblock_blks {
 	uint32_t		addr; /*phy address*/
 	uint32_t		length;
@@ -54,24 +70,63 @@ struct sblock_ring_header {
 	uint32_t		rxblk_wrptr;
 };
 
+/*
+ * release rings, they follow the rx block descriptors and are only used
+ * when both sides have SBLOCK_CAP_RELRING: the receiver puts consumed
+ * blocks here and one SMSG_EVENT_SBLOCK_RELEASE (value 0) hands back all
+ * of them. Otherwise every block is released by its own event carrying
+ * the block address.
+ */
+struct sblock_rel_header {
+	uint32_t		magic;		/* SBLOCK_REL_MAGIC if in use */
+	uint32_t		txrel_blks;	/* tx blocks released by peer */
+	uint32_t		txrel_rdptr;
+	uint32_t		txrel_wrptr;
+	uint32_t		rxrel_blks;	/* rx blocks released by us */
+	uint32_t		rxrel_rdptr;
+	uint32_t		rxrel_wrptr;
+};
+
+/* smem address of the sblock_rel_header of a ring */
+#define sblock_rel_header_addr(ringhd) \
+	((ringhd)->rxblk_blks + (ringhd)->rxblk_count * sizeof(struct sblock_blks))
+
 struct sblock_ring {
 	struct sblock_ring_header	*header;
+	struct sblock_rel_header	*relhd;
 	void			*txblk_virt; /* virt of header->txblk_addr */
 	void			*rxblk_virt; /* virt of header->rxblk_addr */
 	struct sblock_blks	*txblks;     /* virt of header->txblk_blks */
 	struct sblock_blks	*rxblks;     /* virt of header->rxblk_blks */
+	struct sblock_blks	*txrelblks;  /* virt of relhd->txrel_blks */
+	struct sblock_blks	*rxrelblks;  /* virt of relhd->rxrel_blks */
 
 	struct sblock_txunit	*txunits;    /* txblk units pool */
 	struct list_head	txpool;
 	spinlock_t		plock;
 
-	struct mutex		txlock;
-	struct mutex		rxlock;
+	spinlock_t		txlock;
+	spinlock_t		rxlock;
+	spinlock_t		rellock;     /* lock for rx release ring, which
+					      * queues the per-block events
+					      * without SBLOCK_CAP_RELRING */
 
 	wait_queue_head_t	getwait;
 	wait_queue_head_t	recvwait;
 };
 
+/* sblock statistics, shown in debugfs sipc/sblock */
+struct sblock_stat {
+	uint32_t		sent;
+	uint32_t		received;
+	uint32_t		released;
+	uint32_t		events;		/* send/release events raised */
+	uint32_t		txinflight;	/* got but not given back by peer */
+	uint32_t		txinflight_max;
+	struct sipc_hist	getwait;	/* sblock_get wait, us */
+	struct sipc_hist	rxoccupancy;	/* rx blocks pending at receive */
+};
+
 struct sblock_mgr {
 	uint8_t			dst;
 	uint8_t			channel;
@@ -84,11 +139,26 @@ struct sblock_mgr {
 	uint32_t		txblksz;
 	uint32_t		rxblksz;
 
+	uint32_t		caps;	/* SBLOCK_CAP_* agreed with the peer */
+
 	struct sblock_ring	*ring;
 	struct task_struct	*thread;
 
+	/* event coalescing for send/release */
+	uint32_t		flush_thresh; /* blocks pending before an event */
+	uint32_t		flush_delay;  /* jiffies before pending are flushed */
+	atomic_t		txpending;    /* sent blocks not signalled yet */
+	atomic_t		relpending;   /* released blocks not signalled yet */
+	struct work_struct	sendwork;
+	struct work_struct	relwork;
+	struct timer_list	flushtimer;
+
 	void			(*handler)(int event, void *data);
 	void			*data;
+	unsigned long		notify;	     /* SBLOCK_NOTIFY_* bits to call */
+	struct tasklet_struct	notifytask;  /* calls handler out of irq */
+
+	struct sblock_stat	stat;
 };
 
 #endif
@@ -20,12 +20,21 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/io.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 
 #include <linux/sipc.h>
 #include "sbuf.h"
 
 static struct sbuf_mgr *sbufs[SIPC_ID_NR][SMSG_CH_NR];
+/* keeps sbuf_destroy from freeing a sbuf while debugfs shows it */
+static DEFINE_MUTEX(sbufs_lock);
+
+static uint32_t sbuf_buf_offset(uint32_t offset, uint32_t size)
+{
+	/* a buf of whole pages starts on a page, so that it can be mmapped */
+	return IS_ALIGNED(size, PAGE_SIZE) ? PAGE_ALIGN(offset) : offset;
+}
 
 static int sbuf_thread(void *data)
 {
@@ -104,6 +113,7 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 	struct sbuf_mgr *sbuf;
 	volatile struct sbuf_smem_header *smem;
 	volatile struct sbuf_ring_header *ringhd;
+	uint32_t offset, txoffset, rxoffset;
 	int hsize, i;
 
 	sbuf = kzalloc(sizeof(struct sbuf_mgr), GFP_KERNEL);
@@ -117,9 +127,15 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 	sbuf->channel = channel;
 	sbuf->ringnr = bufnum;
 
-	/* allocate smem */
+	/* allocate smem, page-sized bufs are page-aligned to be mmapped */
 	hsize = sizeof(struct sbuf_smem_header) + sizeof(struct sbuf_ring_header) * bufnum;
-	sbuf->smem_size = hsize + (txbufsize + rxbufsize) * bufnum;
+	offset = hsize;
+	for (i = 0; i < bufnum; i++) {
+		txoffset = sbuf_buf_offset(offset, txbufsize);
+		rxoffset = sbuf_buf_offset(txoffset + txbufsize, rxbufsize);
+		offset = rxoffset + rxbufsize;
+	}
+	sbuf->smem_size = offset;
 	sbuf->smem_addr = smem_alloc(sbuf->smem_size);
 	if (!sbuf->smem_addr) {
 		printk(KERN_ERR "Failed to allocate smem for sbuf\n");
@@ -147,22 +163,25 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 	/* initialize all ring bufs */
 	smem = (volatile struct sbuf_smem_header *)sbuf->smem_virt;
 	smem->ringnr = bufnum;
+	offset = hsize;
 	for (i = 0; i < bufnum; i++) {
+		txoffset = sbuf_buf_offset(offset, txbufsize);
+		rxoffset = sbuf_buf_offset(txoffset + txbufsize, rxbufsize);
+		offset = rxoffset + rxbufsize;
+
 		ringhd = (volatile struct sbuf_ring_header *)&(smem->headers[i]);
-		ringhd->txbuf_addr = sbuf->smem_addr + hsize +
-				(txbufsize + rxbufsize) * i;
+		ringhd->txbuf_addr = sbuf->smem_addr + txoffset;
 		ringhd->txbuf_size = txbufsize;
 		ringhd->txbuf_rdptr = 0;
 		ringhd->txbuf_wrptr = 0;
-		ringhd->rxbuf_addr = smem->headers[i].txbuf_addr + txbufsize;
+		ringhd->rxbuf_addr = sbuf->smem_addr + rxoffset;
 		ringhd->rxbuf_size = rxbufsize;
 		ringhd->rxbuf_rdptr = 0;
 		ringhd->rxbuf_wrptr = 0;
 
 		sbuf->rings[i].header = ringhd;
-		sbuf->rings[i].txbuf_virt = sbuf->smem_virt + hsize +
-				(txbufsize + rxbufsize) * i;
-		sbuf->rings[i].rxbuf_virt = sbuf->rings[i].txbuf_virt + txbufsize;
+		sbuf->rings[i].txbuf_virt = sbuf->smem_virt + txoffset;
+		sbuf->rings[i].rxbuf_virt = sbuf->smem_virt + rxoffset;
 		init_waitqueue_head(&(sbuf->rings[i].txwait));
 		init_waitqueue_head(&(sbuf->rings[i].rxwait));
 		mutex_init(&(sbuf->rings[i].txlock));
@@ -181,7 +200,9 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 		return PTR_ERR(sbuf->thread);
 	}
 
+	mutex_lock(&sbufs_lock);
 	sbufs[dst][channel] = sbuf;
+	mutex_unlock(&sbufs_lock);
 	wake_up_process(sbuf->thread);
 
 	return 0;
@@ -194,12 +215,14 @@ void sbuf_destroy(uint8_t dst, uint8_t channel)
 	sbuf->state = SBUF_STATE_IDLE;
 	kthread_stop(sbuf->thread);
 
+	mutex_lock(&sbufs_lock);
+	sbufs[dst][channel] = NULL;
+	mutex_unlock(&sbufs_lock);
+
 	kfree(sbuf->rings);
 	iounmap(sbuf->smem_virt);
 	smem_free(sbuf->smem_addr, sbuf->smem_size);
 	kfree(sbuf);
-
-	sbufs[dst][channel] = NULL;
 }
 
 int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
@@ -237,6 +260,10 @@ int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
 		}
 	}
 
+	if ((int)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr) >= ringhd->txbuf_size) {
+		ring->txstall++;
+	}
+
 	if (timeout == 0) {
 		/* no wait */
 		if ((int)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr) >=
@@ -312,8 +339,11 @@ int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
 		buf += txsize;
 	}
 
+	ring->txbytes += len - left;
 	mutex_unlock(&ring->txlock);
 
+	trace_sipc_sbuf_write(dst, channel, bufid, len - left);
+
 	pr_debug("sbuf_write done: len=%d\n", len - left);
 
 	if (len == left) {
@@ -359,6 +389,7 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 	}
 
 	if (ringhd->rxbuf_wrptr == ringhd->rxbuf_rdptr) {
+		ring->rxstall++;
 		if (timeout == 0) {
 			/* no wait */
 			printk(KERN_WARNING "sbuf %d-%d ring %d rxbuf is empty!\n",
@@ -432,8 +463,11 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 		buf += rxsize;
 	}
 
+	ring->rxbytes += len - left;
 	mutex_unlock(&ring->rxlock);
 
+	trace_sipc_sbuf_read(dst, channel, bufid, len - left);
+
 	pr_debug("sbuf_read done: len=%d", len - left);
 
 	if (len == left) {
@@ -473,6 +507,224 @@ int sbuf_poll_wait(uint8_t dst, uint8_t channel, uint32_t bufid,
 	return mask;
 }
 
+int sbuf_mmap(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct vm_area_struct *vma)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	volatile struct sbuf_ring_header *ringhd;
+	uint32_t offset, size, addr, bufsize;
+
+	if (!sbuf) {
+		return -ENODEV;
+	}
+	if (sbuf->state != SBUF_STATE_READY) {
+		printk(KERN_ERR "sbuf-%d-%d not ready to mmap!\n", dst, channel);
+		return -ENODEV;
+	}
+	if (bufid >= sbuf->ringnr) {
+		return -EINVAL;
+	}
+
+	ringhd = sbuf->rings[bufid].header;
+	offset = vma->vm_pgoff << PAGE_SHIFT;
+	size = vma->vm_end - vma->vm_start;
+
+	/* rx buf is at offset 0 and read-only, tx buf follows it */
+	if (offset == 0) {
+		if (vma->vm_flags & VM_WRITE) {
+			return -EACCES;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+		addr = ringhd->rxbuf_addr;
+		bufsize = ringhd->rxbuf_size;
+	} else if (offset == PAGE_ALIGN(ringhd->rxbuf_size)) {
+		addr = ringhd->txbuf_addr;
+		bufsize = ringhd->txbuf_size;
+	} else {
+		return -EINVAL;
+	}
+
+	if (!IS_ALIGNED(addr, PAGE_SIZE) || !IS_ALIGNED(bufsize, PAGE_SIZE) ||
+			size > bufsize) {
+		printk(KERN_ERR "sbuf-%d-%d ring %d can't be mmapped!\n",
+				dst, channel, bufid);
+		return -EINVAL;
+	}
+
+	/* peer accesses smem uncached too */
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	vma->vm_flags |= VM_IO | VM_RESERVED;
+
+	return remap_pfn_range(vma, vma->vm_start, addr >> PAGE_SHIFT,
+			size, vma->vm_page_prot);
+}
+
+int sbuf_rx_get(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct sbuf_ptr *ptr, int timeout)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	struct sbuf_ring *ring;
+	volatile struct sbuf_ring_header *ringhd;
+	int rval = 0;
+
+	if (!sbuf) {
+		return -ENODEV;
+	}
+	if (sbuf->state != SBUF_STATE_READY) {
+		printk(KERN_ERR "sbuf-%d-%d not ready to read!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	ring = &(sbuf->rings[bufid]);
+	ringhd = ring->header;
+
+	if (ringhd->rxbuf_wrptr == ringhd->rxbuf_rdptr) {
+		if (timeout == 0) {
+			/* no wait */
+			rval = -ENODATA;
+		} else if (timeout < 0) {
+			/* wait forever */
+			rval = wait_event_interruptible(ring->rxwait,
+				ringhd->rxbuf_wrptr != ringhd->rxbuf_rdptr);
+		} else {
+			/* wait timeout */
+			rval = wait_event_interruptible_timeout(ring->rxwait,
+				ringhd->rxbuf_wrptr != ringhd->rxbuf_rdptr,
+				msecs_to_jiffies(timeout));
+			if (rval == 0) {
+				rval = -ETIME;
+			} else if (rval > 0) {
+				rval = 0;
+			}
+		}
+	}
+
+	ptr->size = ringhd->rxbuf_size;
+	ptr->rdptr = ringhd->rxbuf_rdptr;
+	ptr->wrptr = ringhd->rxbuf_wrptr;
+
+	return rval;
+}
+
+int sbuf_rx_put(uint8_t dst, uint8_t channel, uint32_t bufid, uint32_t len)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	struct sbuf_ring *ring;
+	volatile struct sbuf_ring_header *ringhd;
+	struct smsg mevt;
+	int rval = 0;
+
+	if (!sbuf || sbuf->state != SBUF_STATE_READY) {
+		return -ENODEV;
+	}
+
+	ring = &(sbuf->rings[bufid]);
+	ringhd = ring->header;
+
+	mutex_lock(&ring->rxlock);
+	if (len > (uint32_t)(ringhd->rxbuf_wrptr - ringhd->rxbuf_rdptr)) {
+		rval = -EINVAL;
+	} else if (len) {
+		/* one rdptr event for the whole consumed range */
+		mb();	/* the consumer's reads are done before the peer reuses it */
+		ringhd->rxbuf_rdptr = ringhd->rxbuf_rdptr + len;
+		smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_RDPTR, bufid);
+		smsg_send(dst, &mevt, -1);
+		ring->rxbytes += len;
+	}
+	mutex_unlock(&ring->rxlock);
+
+	if (!rval && len) {
+		trace_sipc_sbuf_read(dst, channel, bufid, len);
+	}
+
+	return rval;
+}
+
+int sbuf_tx_get(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct sbuf_ptr *ptr, int timeout)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	struct sbuf_ring *ring;
+	volatile struct sbuf_ring_header *ringhd;
+	int rval = 0;
+
+	if (!sbuf) {
+		return -ENODEV;
+	}
+	if (sbuf->state != SBUF_STATE_READY) {
+		printk(KERN_ERR "sbuf-%d-%d not ready to write!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	ring = &(sbuf->rings[bufid]);
+	ringhd = ring->header;
+
+	if ((int)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr) >= ringhd->txbuf_size) {
+		if (timeout == 0) {
+			/* no wait */
+			rval = -EBUSY;
+		} else if (timeout < 0) {
+			/* wait forever */
+			rval = wait_event_interruptible(ring->txwait,
+				(int)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr) <
+				ringhd->txbuf_size);
+		} else {
+			/* wait timeout */
+			rval = wait_event_interruptible_timeout(ring->txwait,
+				(int)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr) <
+				ringhd->txbuf_size, msecs_to_jiffies(timeout));
+			if (rval == 0) {
+				rval = -ETIME;
+			} else if (rval > 0) {
+				rval = 0;
+			}
+		}
+	}
+
+	ptr->size = ringhd->txbuf_size;
+	ptr->rdptr = ringhd->txbuf_rdptr;
+	ptr->wrptr = ringhd->txbuf_wrptr;
+
+	return rval;
+}
+
+int sbuf_tx_put(uint8_t dst, uint8_t channel, uint32_t bufid, uint32_t len)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	struct sbuf_ring *ring;
+	volatile struct sbuf_ring_header *ringhd;
+	struct smsg mevt;
+	int rval = 0;
+
+	if (!sbuf || sbuf->state != SBUF_STATE_READY) {
+		return -ENODEV;
+	}
+
+	ring = &(sbuf->rings[bufid]);
+	ringhd = ring->header;
+
+	mutex_lock(&ring->txlock);
+	if (len > ringhd->txbuf_size -
+			(uint32_t)(ringhd->txbuf_wrptr - ringhd->txbuf_rdptr)) {
+		rval = -EINVAL;
+	} else if (len) {
+		/* one wrptr event for the whole produced range */
+		wmb();
+		ringhd->txbuf_wrptr = ringhd->txbuf_wrptr + len;
+		smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_WRPTR, bufid);
+		smsg_send(dst, &mevt, -1);
+		ring->txbytes += len;
+	}
+	mutex_unlock(&ring->txlock);
+
+	if (!rval && len) {
+		trace_sipc_sbuf_write(dst, channel, bufid, len);
+	}
+
+	return rval;
+}
+
 int sbuf_status(uint8_t dst, uint8_t channel)
 {
 	struct sbuf_mgr *sbuf = sbufs[dst][channel];
@@ -487,12 +739,84 @@ int sbuf_status(uint8_t dst, uint8_t channel)
 	return 0;
 }
 
+#ifdef CONFIG_DEBUG_FS
+/* byte counters are cumulative, rates are left to the reader */
+static int sbuf_debug_show(struct seq_file *m, void *private)
+{
+	struct sbuf_mgr *sbuf;
+	struct sbuf_ring *ring;
+	volatile struct sbuf_ring_header *ringhd;
+	int i, j, k;
+
+	seq_printf(m, "time %u ms\n", jiffies_to_msecs(jiffies));
+
+	mutex_lock(&sbufs_lock);
+	for (i = 0; i < SIPC_ID_NR; i++) {
+		for (j = 0; j < SMSG_CH_NR; j++) {
+			sbuf = sbufs[i][j];
+			if (!sbuf) {
+				continue;
+			}
+
+			seq_printf(m, "sbuf %d-%d: state %u, rings %u\n",
+					sbuf->dst, sbuf->channel, sbuf->state,
+					sbuf->ringnr);
+			for (k = 0; k < sbuf->ringnr; k++) {
+				ring = &sbuf->rings[k];
+				ringhd = ring->header;
+
+				seq_printf(m, "  ring %d: tx size %u wrptr %u rdptr %u, "
+						"rx size %u wrptr %u rdptr %u\n",
+						k, ringhd->txbuf_size,
+						ringhd->txbuf_wrptr, ringhd->txbuf_rdptr,
+						ringhd->rxbuf_size,
+						ringhd->rxbuf_wrptr, ringhd->rxbuf_rdptr);
+				seq_printf(m, "    tx %llu bytes, stall %u; "
+						"rx %llu bytes, stall %u\n",
+						ring->txbytes, ring->txstall,
+						ring->rxbytes, ring->rxstall);
+			}
+		}
+	}
+	mutex_unlock(&sbufs_lock);
+
+	return 0;
+}
+
+static int sbuf_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sbuf_debug_show, inode->i_private);
+}
+
+static const struct file_operations sbuf_debug_fops = {
+	.open = sbuf_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init sbuf_debugfs_init(void)
+{
+	debugfs_create_file("sbuf", S_IRUGO, sipc_debugfs_root(), NULL,
+			&sbuf_debug_fops);
+
+	return 0;
+}
+
+late_initcall(sbuf_debugfs_init);
+#endif
+
 EXPORT_SYMBOL(sbuf_create);
 EXPORT_SYMBOL(sbuf_destroy);
 EXPORT_SYMBOL(sbuf_write);
 EXPORT_SYMBOL(sbuf_read);
 EXPORT_SYMBOL(sbuf_poll_wait);
 EXPORT_SYMBOL(sbuf_status);
+EXPORT_SYMBOL(sbuf_mmap);
+EXPORT_SYMBOL(sbuf_rx_get);
+EXPORT_SYMBOL(sbuf_rx_put);
+EXPORT_SYMBOL(sbuf_tx_get);
+EXPORT_SYMBOL(sbuf_tx_put);
 
 MODULE_AUTHOR("Chen Gaopeng");
 MODULE_DESCRIPTION("SIPC/SBUF driver");
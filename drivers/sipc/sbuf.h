@@ -58,6 +58,12 @@ struct sbuf_ring {
 	/* send/recv mutex */
 	struct mutex		txlock;
 	struct mutex		rxlock;
+
+	/* statistics, shown in debugfs sipc/sbuf */
+	uint64_t		txbytes;
+	uint64_t		rxbytes;
+	uint32_t		txstall;	/* writer found txbuf full */
+	uint32_t		rxstall;	/* reader found rxbuf empty */
 };
 
 #define SBUF_STATE_IDLE		0
@@ -40,9 +40,39 @@
 #define SETH_BLOCK_NUM	64
 #define SETH_BLOCK_SIZE	(ETH_HLEN + ETH_DATA_LEN + NET_IP_ALIGN)
 
+#define SETH_NAPI_WEIGHT	SETH_BLOCK_NUM
+#define SETH_RX_BATCH		16
+
+#ifdef CONFIG_SIPC_SETH_ZEROCOPY
+/* one rx block per page, so that the page refcount tracks one block */
+#define SETH_RX_BLOCK_SIZE	PAGE_SIZE
+/* small packets are still copied, it's cheaper than lending a block */
+#define SETH_ZC_COPYBREAK	256
+#define SETH_ZC_RECLAIM_DELAY	(HZ / 10)
+/*
+ * at most half of the rx blocks are lent, so that sockets which stop
+ * reading can't take every block from the modem; the rest are copied
+ */
+#define SETH_ZC_BLOCKS		(SETH_BLOCK_NUM / 2)
+#else
+#define SETH_RX_BLOCK_SIZE	SETH_BLOCK_SIZE
+#endif
+
 #define DEV_ON 1
 #define DEV_OFF 0
 
+#ifdef CONFIG_SIPC_SETH_ZEROCOPY
+/*
+ * Rx sblock lent to the network stack as a page fragment.
+ */
+typedef struct SEthZcBlk {
+	struct list_head list;
+	struct sblock blk;
+	struct page* page;
+	int base;			/* page refcount before lending */
+} SEthZcBlk;
+#endif
+
 /*
  * Device instance data.
  */
@@ -52,8 +82,183 @@ typedef struct SEth {
 	struct seth_init_data* pdata;	/* platform data */
 	int state;			/* device state */
 	int stopped;			/* sblock indicator */
+	struct napi_struct napi;	/* rx poll */
+#ifdef CONFIG_SIPC_SETH_ZEROCOPY
+	SEthZcBlk zcblks[SETH_ZC_BLOCKS];
+	struct list_head zcfree;	/* unused lending slots */
+	struct list_head zcbusy;	/* blocks lent to the stack */
+	spinlock_t zclock;
+	struct delayed_work zcwork;	/* reclaim when rx goes idle */
+#endif
 } SEth;
 
+#ifdef CONFIG_SIPC_SETH_ZEROCOPY
+/*
+ * Give back the lent rx sblocks whose pages are not referenced
+ * by any skb anymore.
+ */
+static void
+seth_zc_reclaim (SEth* seth)
+{
+	struct seth_init_data *pdata = seth->pdata;
+	SEthZcBlk *zcblk, *tmp;
+	LIST_HEAD(done);
+	int busy;
+	int ret;
+
+	spin_lock_bh(&seth->zclock);
+	list_for_each_entry_safe(zcblk, tmp, &seth->zcbusy, list) {
+		if (page_count(zcblk->page) == zcblk->base) {
+			list_move_tail(&zcblk->list, &done);
+		}
+	}
+	spin_unlock_bh(&seth->zclock);
+
+	list_for_each_entry(zcblk, &done, list) {
+		ret = sblock_release(pdata->dst, pdata->channel, &zcblk->blk);
+		if (ret) {
+			SETH_ERR ("release lent sblock failed (%d)\n", ret);
+		}
+	}
+
+	spin_lock_bh(&seth->zclock);
+	list_splice(&done, &seth->zcfree);
+	busy = !list_empty(&seth->zcbusy);
+	spin_unlock_bh(&seth->zclock);
+
+	if (busy) {
+		schedule_delayed_work(&seth->zcwork, SETH_ZC_RECLAIM_DELAY);
+	}
+}
+
+static void
+seth_zc_work (struct work_struct* work)
+{
+	SEth* seth = container_of(work, SEth, zcwork.work);
+
+	seth_zc_reclaim(seth);
+}
+
+/*
+ * Build an skb whose payload is the rx sblock itself, only the
+ * ethernet header is copied. Returns NULL if the block can't be lent.
+ */
+static struct sk_buff*
+seth_zc_skb (SEth* seth, struct sblock* blk)
+{
+	struct seth_init_data *pdata = seth->pdata;
+	SEthZcBlk *zcblk = NULL;
+	struct sk_buff* skb;
+	struct page* page;
+	uint32_t offset;
+	int fraglen;
+
+	if (blk->length <= SETH_ZC_COPYBREAK) {
+		return NULL;
+	}
+
+	page = sblock_page(pdata->dst, pdata->channel, blk, &offset);
+	if (!page) {
+		return NULL;
+	}
+
+	spin_lock_bh(&seth->zclock);
+	if (!list_empty(&seth->zcfree)) {
+		zcblk = list_first_entry(&seth->zcfree, SEthZcBlk, list);
+		list_del(&zcblk->list);
+	}
+	spin_unlock_bh(&seth->zclock);
+
+	if (!zcblk) {
+		return NULL;
+	}
+
+	skb = netdev_alloc_skb_ip_align(seth->netdev, ETH_HLEN);
+	if (!skb) {
+		spin_lock_bh(&seth->zclock);
+		list_add(&zcblk->list, &seth->zcfree);
+		spin_unlock_bh(&seth->zclock);
+		return NULL;
+	}
+
+	memcpy(skb_put(skb, ETH_HLEN), page_address(page) + offset, ETH_HLEN);
+
+	zcblk->blk = *blk;
+	zcblk->page = page;
+	zcblk->base = page_count(page);
+	get_page(page);
+
+	fraglen = blk->length - ETH_HLEN;
+	skb_fill_page_desc(skb, 0, page, offset + ETH_HLEN, fraglen);
+	skb->len += fraglen;
+	skb->data_len += fraglen;
+	skb->truesize += SETH_RX_BLOCK_SIZE;
+
+	spin_lock_bh(&seth->zclock);
+	list_add_tail(&zcblk->list, &seth->zcbusy);
+	spin_unlock_bh(&seth->zclock);
+
+	schedule_delayed_work(&seth->zcwork, SETH_ZC_RECLAIM_DELAY);
+
+	return skb;
+}
+
+static void
+seth_zc_init (SEth* seth)
+{
+	int i;
+
+	INIT_LIST_HEAD(&seth->zcfree);
+	INIT_LIST_HEAD(&seth->zcbusy);
+	spin_lock_init(&seth->zclock);
+	INIT_DELAYED_WORK(&seth->zcwork, seth_zc_work);
+
+	for (i = 0; i < SETH_ZC_BLOCKS; i++) {
+		list_add_tail(&seth->zcblks[i].list, &seth->zcfree);
+	}
+}
+
+/*
+ * Wait until the stack has dropped every lent page, the rx blocks are
+ * freed with the sblock after this. Rx must be stopped already.
+ */
+static void
+seth_zc_exit (SEth* seth)
+{
+	int busy, warned = 0;
+
+	for (;;) {
+		seth_zc_reclaim(seth);
+
+		spin_lock_bh(&seth->zclock);
+		busy = !list_empty(&seth->zcbusy);
+		spin_unlock_bh(&seth->zclock);
+		if (!busy) {
+			break;
+		}
+
+		if (!warned) {
+			SETH_INFO ("waiting for lent sblocks of %s\n",
+					seth->netdev->name);
+			warned = 1;
+		}
+		msleep(jiffies_to_msecs(SETH_ZC_RECLAIM_DELAY));
+	}
+
+	cancel_delayed_work_sync(&seth->zcwork);
+}
+#else
+static inline struct sk_buff*
+seth_zc_skb (SEth* seth, struct sblock* blk)
+{
+	return NULL;
+}
+
+static inline void seth_zc_reclaim (SEth* seth) {}
+static inline void seth_zc_init (SEth* seth) {}
+static inline void seth_zc_exit (SEth* seth) {}
+#endif
+
 /*
  * Tx_ready handler.
  */
@@ -77,41 +282,38 @@ seth_tx_ready_handler (void* data)
 	}
 }
 
-static void
-seth_rx_handler (void* data)
+/*
+ * Pass one rx sblock up, returns 1 if the sblock is to be released.
+ */
+static int
+seth_rx_one (SEth* seth, struct sblock* blk)
 {
-	SEth* seth = (SEth *)data;
-	struct seth_init_data *pdata = seth->pdata;
-	struct sblock blk;
 	struct sk_buff* skb;
-	int ret;
-	int i;
+	int lent;
 
-	if (seth->state != DEV_ON) {
-		SETH_ERR ("rx_handler the state of %s is off!\n", seth->netdev->name);
-		seth->stats.rx_errors++;
-		return;
+	if (blk->length < ETH_HLEN) {
+		SETH_ERR ("receive runt sblock (%d)\n", blk->length);
+		seth->stats.rx_length_errors++;
+		return 1;
 	}
 
-	ret = sblock_receive(pdata->dst, pdata->channel, &blk, 0);
-	if (ret) {
-		SETH_ERR ("receive sblock failed (%d)\n", ret);
-		seth->stats.rx_errors++;
-		return;
-	}
-	
-	skb = dev_alloc_skb (blk.length + NET_IP_ALIGN); //16 bytes align
+	/* lent sblock is released once the stack frees the page */
+	skb = seth_zc_skb(seth, blk);
+	lent = (skb != NULL);
 	if (!skb) {
-		SETH_ERR ("alloc skbuff failed!\n");
-		seth->stats.rx_dropped++;
-		return;
-	}
+		skb = dev_alloc_skb (blk->length + NET_IP_ALIGN); //16 bytes align
+		if (!skb) {
+			SETH_ERR ("alloc skbuff failed!\n");
+			seth->stats.rx_dropped++;
+			return 1;
+		}
 
-	skb_reserve(skb, NET_IP_ALIGN);
+		skb_reserve(skb, NET_IP_ALIGN);
 
-	memcpy(skb->data, blk.addr, blk.length);
+		memcpy(skb->data, blk->addr, blk->length);
 
-	skb_put (skb, blk.length);
+		skb_put (skb, blk->length);
+	}
 
 	skb->dev = seth->netdev;
 	skb->protocol  = eth_type_trans (skb, seth->netdev);
@@ -120,14 +322,72 @@ seth_rx_handler (void* data)
 	seth->stats.rx_packets++;
 	seth->stats.rx_bytes += skb->len;
 
-	netif_rx (skb);
+	napi_gro_receive (&seth->napi, skb);
 
 	seth->netdev->last_rx = jiffies;
 
-	ret = sblock_release(pdata->dst, pdata->channel, &blk);
-	if (ret) {
-		SETH_ERR ("release sblock failed (%d)\n", ret);
+	return !lent;
+}
+
+/*
+ * NAPI poll, drains up to budget sblocks in batches.
+ */
+static int
+seth_rx_poll (struct napi_struct* napi, int budget)
+{
+	SEth* seth = container_of(napi, SEth, napi);
+	struct seth_init_data *pdata = seth->pdata;
+	struct sblock blks[SETH_RX_BATCH];
+	struct sblock relblks[SETH_RX_BATCH];
+	int done = 0;
+	int n, nrel, i;
+	int ret;
+
+	if (seth->state != DEV_ON) {
+		SETH_ERR ("rx_poll the state of %s is off!\n", seth->netdev->name);
+		seth->stats.rx_errors++;
+		napi_complete (napi);
+		return 0;
+	}
+
+	seth_zc_reclaim(seth);
+
+	while (done < budget) {
+		n = sblock_receive_multi(pdata->dst, pdata->channel,
+				blks, min(budget - done, SETH_RX_BATCH));
+		if (n <= 0) {
+			break;
+		}
+
+		nrel = 0;
+		for (i = 0; i < n; i++) {
+			if (seth_rx_one(seth, &blks[i])) {
+				relblks[nrel++] = blks[i];
+			}
+		}
+		done += n;
+
+		/* one release event for the whole batch */
+		if (nrel) {
+			ret = sblock_release_multi(pdata->dst, pdata->channel,
+					relblks, nrel);
+			if (ret) {
+				SETH_ERR ("release sblock failed (%d)\n", ret);
+			}
+		}
 	}
+
+	if (done < budget) {
+		napi_complete (napi);
+
+		/* a block may arrive after the last receive, before complete */
+		if (sblock_rx_pending(pdata->dst, pdata->channel) &&
+				napi_reschedule (napi)) {
+			SETH_DEBUG ("rx_poll rescheduled\n");
+		}
+	}
+
+	return done;
 }
 
 static void
@@ -138,10 +398,15 @@ seth_handler (int event, void* data)
 	switch(event) {
 		case SBLOCK_NOTIFY_GET:
 			SETH_DEBUG ("SBLOCK_NOTIFY_GET is received\n");
+			if (seth->stopped) {
+				seth->stopped = 0;
+				netif_wake_queue (seth->netdev);
+			}
 			break;
 		case SBLOCK_NOTIFY_RECV:
 			SETH_DEBUG ("SBLOCK_NOTIFY_RECV is received\n");
-			seth_rx_handler(seth);
+			/* called from the sblock notify tasklet */
+			napi_schedule (&seth->napi);
 			break;
 		case SBLOCK_NOTIFY_STATUS:
 			SETH_DEBUG ("SBLOCK_NOTIFY_STATUS is received\n");
@@ -172,34 +437,49 @@ seth_start_xmit (struct sk_buff* skb, struct net_device* dev)
 		return NETDEV_TX_OK;
 	}
 	/*
-	 * Get a free sblock.
+	 * Get a free sblock, never sleep in xmit: stop the queue and let
+	 * SBLOCK_NOTIFY_GET wake it up.
 	 */
-
-	ret = sblock_get(pdata->dst, pdata->channel, &blk, 0xFFFFFFFF);
+	ret = sblock_get(pdata->dst, pdata->channel, &blk, 0);
 	if(ret) {
-		SETH_ERR ("Get free sblock failed(%d)\n", ret);
 		netif_stop_queue (dev);
-		seth->stats.tx_fifo_errors++;
 		seth->stopped = 1;
-		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
+
+		/* a block may be released before the queue is stopped */
+		ret = sblock_get(pdata->dst, pdata->channel, &blk, 0);
+		if(ret) {
+			SETH_DEBUG ("Get free sblock failed(%d)\n", ret);
+			seth->stats.tx_fifo_errors++;
+			return NETDEV_TX_BUSY;
+		}
+
+		seth->stopped = 0;
+		netif_wake_queue (dev);
 	}
 
 	if(blk.length < skb->len) {
 		SETH_ERR ("The size of sblock is so tiny!\n");
+		sblock_put(pdata->dst, pdata->channel, &blk);
 		seth->stats.tx_fifo_errors++;
 		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
+		return NETDEV_TX_OK;
 	}
 
+	/*
+	 * The frame is built straight in the sblock: paged skbs are
+	 * gathered without linearizing, and the checksum is folded into
+	 * the same pass.
+	 */
 	blk.length = skb->len;
-	memcpy (blk.addr, skb->data, skb->len);
+	skb_copy_and_csum_dev (skb, blk.addr);
 	ret = sblock_send(pdata->dst, pdata->channel, &blk);
 	if(ret) {
+		/* the channel is down, drop the frame */
 		SETH_ERR ("send sblock failed(%d)\n", ret);
+		sblock_put(pdata->dst, pdata->channel, &blk);
 		seth->stats.tx_fifo_errors++;
 		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
+		return NETDEV_TX_OK;
 	}
 
 	/*
@@ -228,8 +508,14 @@ static int seth_open (struct net_device *dev)
 	seth->state = DEV_ON;
 	*/
 
+	napi_enable(&seth->napi);
 	netif_start_queue(dev);
 
+	/* drain the blocks received while the interface was down */
+	local_bh_disable();
+	napi_schedule(&seth->napi);
+	local_bh_enable();
+
 	return 0;
 }
 
@@ -241,6 +527,7 @@ static int seth_close (struct net_device *dev)
 	SEth* seth = netdev_priv(dev);
 
 	netif_stop_queue(dev);
+	napi_disable(&seth->napi);
 
 	/*
 	seth->state = DEV_OFF;
@@ -273,9 +560,14 @@ static int __devexit seth_remove (struct platform_device *pdev)
 	struct SEth* seth = platform_get_drvdata(pdev);
 	struct seth_init_data *pdata = seth->pdata;
 
+	/* stop rx first, closing the device disables NAPI */
+	unregister_netdev(seth->netdev);
+
+	/* the skbs still queued on sockets hold pages of the rx blocks */
+	seth_zc_exit(seth);
 	sblock_destroy(pdata->dst, pdata->channel);
 
-	unregister_netdev(seth->netdev);
+	netif_napi_del(&seth->napi);
 	free_netdev(seth->netdev);
 
 	platform_set_drvdata(pdev, NULL);
@@ -315,6 +607,8 @@ static int __devinit seth_probe(struct platform_device *pdev)
 	seth->netdev = netdev;
 	seth->state = DEV_OFF;
 	seth->stopped = 0;
+	seth_zc_init(seth);
+	netif_napi_add(netdev, &seth->napi, seth_rx_poll, SETH_NAPI_WEIGHT);
 
 #ifdef HAVE_NET_DEVICE_OPS
 	netdev->netdev_ops = &seth_ops;
@@ -329,12 +623,13 @@ static int __devinit seth_probe(struct platform_device *pdev)
 	netdev->watchdog_timeo = 100*HZ;
 	netdev->irq = 0;
 	netdev->dma = 0;
+	netdev->features |= NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HW_CSUM;
 
 	random_ether_addr(netdev->dev_addr);
 
 	ret = sblock_create(pdata->dst, pdata->channel,
 		SETH_BLOCK_NUM, SETH_BLOCK_SIZE,
-		SETH_BLOCK_NUM, SETH_BLOCK_SIZE);
+		SETH_BLOCK_NUM, SETH_RX_BLOCK_SIZE);
 	if (ret) {
 		SETH_ERR ("create sblock failed (%d)\n", ret);
 		free_netdev(netdev);
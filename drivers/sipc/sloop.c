@@ -0,0 +1,527 @@
+/*
+ * Copyright (C) 2012 Spreadtrum Communications Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * SIPC loopback peer: a software CP on the other side of a smsg_ipc, so
+ * that smsg/sbuf/sblock can run without modem hardware. The AP smsgs
+ * wake up the peer thread, and the peer smsgs are delivered to the AP by
+ * a tasklet calling the smsg irq handler.
+ *
+ * The peer answers the channel open, asks for the sbuf/sblock rings on
+ * the channels configured for them, and echoes everything back: smsgs
+ * on plain channels, sbuf bytes from tx to rx ring, and sblock tx blocks
+ * into its rx blocks.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/wait.h>
+#include <linux/interrupt.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/io.h>
+
+#include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+#include "sbuf.h"
+#include "sblock.h"
+
+/* smsgs in each direction, must be 2^n */
+#define SLOOP_SMSG_NR		128
+
+#define SLOOP_CH_SMSG		0
+#define SLOOP_CH_SBUF		1
+#define SLOOP_CH_SBLOCK		2
+
+static uint dst = SIPC_ID_WCN;
+module_param(dst, uint, 0444);
+MODULE_PARM_DESC(dst, "processor ID served by the loopback peer");
+
+static uint smem_addr;
+module_param(smem_addr, uint, 0444);
+MODULE_PARM_DESC(smem_addr, "smem carveout, it must not be in the kernel linear map");
+
+static uint smem_size;
+module_param(smem_size, uint, 0444);
+MODULE_PARM_DESC(smem_size, "smem carveout size, 0 to keep the platform smem");
+
+static uint sbuf_channels = (1 << SMSG_CH_PIPE) | (1 << SMSG_CH_PLOG) |
+	(1 << SMSG_CH_TTY);
+module_param(sbuf_channels, uint, 0444);
+MODULE_PARM_DESC(sbuf_channels, "mask of channels with sbuf rings");
+
+static uint sblock_channels = (1 << SMSG_CH_DATA);
+module_param(sblock_channels, uint, 0444);
+MODULE_PARM_DESC(sblock_channels, "mask of channels with sblock rings");
+
+struct sloop_chan {
+	int			type;
+
+	/* AP smem of the channel, mapped when the INIT is done */
+	void			*smem_virt;
+	uint32_t		smem_addr;
+	uint32_t		smem_size;
+
+	/* sblock release header, NULL if the AP didn't agree on the rings */
+	volatile struct sblock_rel_header *relhd;
+
+	/* sblock rx blocks owned by the peer */
+	uint32_t		*rxfree;
+	uint32_t		rxfree_nr;
+	uint32_t		rxfree_max;
+};
+
+struct sloop {
+	struct smsg_ipc		ipc;
+
+	/* smsg rings, tx is AP to peer, rx is peer to AP */
+	struct smsg		txbuf[SLOOP_SMSG_NR];
+	struct smsg		rxbuf[SLOOP_SMSG_NR];
+	uint32_t		txbuf_rdptr;
+	uint32_t		txbuf_wrptr;
+	uint32_t		rxbuf_rdptr;
+	uint32_t		rxbuf_wrptr;
+
+	struct tasklet_struct	irq;
+	wait_queue_head_t	wait;
+	struct task_struct	*thread;
+
+	struct sloop_chan	chans[SMSG_CH_NR];
+};
+
+static struct sloop *sloop;
+
+static uint32_t sloop_rxirq_status(void)
+{
+	return 0;
+}
+
+static void sloop_rxirq_clear(void)
+{
+}
+
+/* called by smsg_send with the ipc txlock held */
+static void sloop_txirq_trigger(void)
+{
+	wake_up(&sloop->wait);
+}
+
+static void sloop_irq(unsigned long data)
+{
+	struct sloop *sl = (struct sloop *)data;
+
+	sl->ipc.irq_handler(sl->ipc.irq, &sl->ipc);
+}
+
+static void sloop_send(struct sloop *sl, struct smsg *msg)
+{
+	uint32_t wr = readl(&sl->rxbuf_wrptr);
+
+	/* only the peer thread writes the rx ring, wait for the AP */
+	while ((int)(wr - readl(&sl->rxbuf_rdptr)) >= SLOOP_SMSG_NR) {
+		tasklet_schedule(&sl->irq);
+		msleep(1);
+	}
+
+	memcpy(&sl->rxbuf[wr & (SLOOP_SMSG_NR - 1)], msg, sizeof(struct smsg));
+	writel(wr + 1, &sl->rxbuf_wrptr);
+
+	tasklet_schedule(&sl->irq);
+}
+
+static void sloop_event(struct sloop *sl, uint8_t channel, uint16_t flag,
+		uint32_t value)
+{
+	struct smsg mevt;
+
+	smsg_set(&mevt, channel, SMSG_TYPE_EVENT, flag, value);
+	sloop_send(sl, &mevt);
+}
+
+static inline void *sloop_virt(struct sloop_chan *ch, uint32_t addr)
+{
+	return ch->smem_virt + (addr - ch->smem_addr);
+}
+
+static void sloop_chan_reset(struct sloop_chan *ch)
+{
+	if (ch->smem_virt) {
+		iounmap(ch->smem_virt);
+		ch->smem_virt = NULL;
+	}
+	ch->relhd = NULL;
+	kfree(ch->rxfree);
+	ch->rxfree = NULL;
+	ch->rxfree_nr = 0;
+	ch->rxfree_max = 0;
+}
+
+/* map the AP smem of a channel, addr is from the INIT done */
+static int sloop_chan_map(struct sloop_chan *ch, uint32_t addr)
+{
+	volatile struct sbuf_smem_header *smem;
+	volatile struct sbuf_ring_header *bufhd;
+	volatile struct sblock_ring_header *blkhd;
+	void *virt;
+	uint32_t size, i;
+
+	/* the header tells how much to map */
+	virt = ioremap(addr, PAGE_SIZE);
+	if (!virt) {
+		return -ENOMEM;
+	}
+	if (ch->type == SLOOP_CH_SBUF) {
+		smem = virt;
+		bufhd = &smem->headers[smem->ringnr - 1];
+		size = bufhd->rxbuf_addr + bufhd->rxbuf_size - addr;
+	} else {
+		blkhd = virt;
+		size = blkhd->rxblk_addr +
+			blkhd->rxblk_count * blkhd->rxblk_size - addr;
+	}
+	iounmap(virt);
+
+	ch->smem_virt = ioremap(addr, size);
+	if (!ch->smem_virt) {
+		return -ENOMEM;
+	}
+	ch->smem_addr = addr;
+	ch->smem_size = size;
+
+	if (ch->type == SLOOP_CH_SBLOCK) {
+		/* the release rings are used only if the AP marked them */
+		blkhd = ch->smem_virt;
+		ch->relhd = sloop_virt(ch, sblock_rel_header_addr(blkhd));
+		if (ch->relhd->magic != SBLOCK_REL_MAGIC) {
+			ch->relhd = NULL;
+		}
+		rmb();
+
+		/* all the rx blocks start on the peer side */
+		ch->rxfree = kmalloc(sizeof(uint32_t) * blkhd->rxblk_count,
+				GFP_KERNEL);
+		if (!ch->rxfree) {
+			sloop_chan_reset(ch);
+			return -ENOMEM;
+		}
+		for (i = 0; i < blkhd->rxblk_count; i++) {
+			ch->rxfree[i] = blkhd->rxblk_addr + i * blkhd->rxblk_size;
+		}
+		ch->rxfree_nr = blkhd->rxblk_count;
+		ch->rxfree_max = blkhd->rxblk_count;
+	}
+
+	return 0;
+}
+
+/* take back the rx blocks released by the AP */
+static void sloop_sblock_released(struct sloop_chan *ch, uint32_t value)
+{
+	volatile struct sblock_ring_header *ringhd = ch->smem_virt;
+	volatile struct sblock_rel_header *relhd = ch->relhd;
+	struct sblock_blks *relblks;
+	int relpos;
+
+	if (value && ch->rxfree_nr < ch->rxfree_max) {
+		ch->rxfree[ch->rxfree_nr++] = value;
+	}
+	if (!relhd) {
+		return;
+	}
+
+	relblks = sloop_virt(ch, relhd->rxrel_blks);
+	while (relhd->rxrel_rdptr != relhd->rxrel_wrptr &&
+			ch->rxfree_nr < ch->rxfree_max) {
+		rmb();
+		relpos = relhd->rxrel_rdptr % ringhd->rxblk_count;
+		ch->rxfree[ch->rxfree_nr++] = relblks[relpos].addr;
+		relhd->rxrel_rdptr = relhd->rxrel_rdptr + 1;
+	}
+}
+
+/* copy the AP tx blocks into free rx blocks, and give the tx blocks back */
+static void sloop_sblock_echo(struct sloop *sl, uint8_t channel,
+		struct sloop_chan *ch)
+{
+	volatile struct sblock_ring_header *ringhd = ch->smem_virt;
+	struct sblock_blks *txblks = sloop_virt(ch, ringhd->txblk_blks);
+	struct sblock_blks *rxblks = sloop_virt(ch, ringhd->rxblk_blks);
+	volatile struct sblock_rel_header *relhd = ch->relhd;
+	struct sblock_blks *relblks = NULL;
+	uint32_t txaddr, rxaddr, len;
+	int txpos, rxpos, relpos, n = 0;
+
+	if (relhd) {
+		relblks = sloop_virt(ch, relhd->txrel_blks);
+	}
+	while (ringhd->txblk_rdptr != ringhd->txblk_wrptr && ch->rxfree_nr) {
+		rmb();
+		txpos = ringhd->txblk_rdptr % ringhd->txblk_count;
+		txaddr = txblks[txpos].addr;
+		len = min(txblks[txpos].length, ringhd->rxblk_size);
+
+		rxaddr = ch->rxfree[--ch->rxfree_nr];
+		memcpy(sloop_virt(ch, rxaddr), sloop_virt(ch, txaddr), len);
+
+		rxpos = ringhd->rxblk_wrptr % ringhd->rxblk_count;
+		rxblks[rxpos].addr = rxaddr;
+		rxblks[rxpos].length = len;
+
+		if (relhd) {
+			relpos = relhd->txrel_wrptr % ringhd->txblk_count;
+			relblks[relpos].addr = txaddr;
+			relblks[relpos].length = ringhd->txblk_size;
+		}
+
+		wmb();
+		ringhd->rxblk_wrptr = ringhd->rxblk_wrptr + 1;
+		ringhd->txblk_rdptr = ringhd->txblk_rdptr + 1;
+		if (relhd) {
+			relhd->txrel_wrptr = relhd->txrel_wrptr + 1;
+		} else {
+			/* legacy peer, every tx block goes back on its own */
+			sloop_event(sl, channel, SMSG_EVENT_SBLOCK_RELEASE, txaddr);
+		}
+		n++;
+	}
+
+	/* one event for each direction, as the coalesced sblock does */
+	if (n) {
+		sloop_event(sl, channel, SMSG_EVENT_SBLOCK_SEND, 0);
+		if (relhd) {
+			sloop_event(sl, channel, SMSG_EVENT_SBLOCK_RELEASE, 0);
+		}
+	}
+}
+
+/* copy what fits from the AP tx ring into its rx ring */
+static void sloop_sbuf_echo(struct sloop *sl, uint8_t channel,
+		struct sloop_chan *ch)
+{
+	volatile struct sbuf_smem_header *smem = ch->smem_virt;
+	volatile struct sbuf_ring_header *ringhd;
+	void *txbuf, *rxbuf;
+	uint32_t avail, room, len, done, txoff, rxoff, n;
+	int i;
+
+	for (i = 0; i < smem->ringnr; i++) {
+		ringhd = &smem->headers[i];
+		txbuf = sloop_virt(ch, ringhd->txbuf_addr);
+		rxbuf = sloop_virt(ch, ringhd->rxbuf_addr);
+
+		avail = ringhd->txbuf_wrptr - ringhd->txbuf_rdptr;
+		room = ringhd->rxbuf_size -
+			(ringhd->rxbuf_wrptr - ringhd->rxbuf_rdptr);
+		len = min(avail, room);
+		if (!len) {
+			continue;
+		}
+
+		rmb();
+		for (done = 0; done < len; done += n) {
+			txoff = (ringhd->txbuf_rdptr + done) % ringhd->txbuf_size;
+			rxoff = (ringhd->rxbuf_wrptr + done) % ringhd->rxbuf_size;
+			n = min3(len - done, ringhd->txbuf_size - txoff,
+					ringhd->rxbuf_size - rxoff);
+			memcpy(rxbuf + rxoff, txbuf + txoff, n);
+		}
+		wmb();
+		ringhd->rxbuf_wrptr = ringhd->rxbuf_wrptr + len;
+		ringhd->txbuf_rdptr = ringhd->txbuf_rdptr + len;
+
+		sloop_event(sl, channel, SMSG_EVENT_SBUF_WRPTR, i);
+		sloop_event(sl, channel, SMSG_EVENT_SBUF_RDPTR, i);
+	}
+}
+
+static void sloop_handle(struct sloop *sl, struct smsg *msg)
+{
+	struct sloop_chan *ch;
+	struct smsg mrsp;
+
+	if (msg->channel >= SMSG_CH_NR) {
+		printk(KERN_ERR "sloop: invalid smsg channel %d\n", msg->channel);
+		return;
+	}
+	ch = &sl->chans[msg->channel];
+
+	switch (msg->type) {
+	case SMSG_TYPE_OPEN:
+		sloop_chan_reset(ch);
+		smsg_set(&mrsp, msg->channel, SMSG_TYPE_OPEN, SMSG_OPEN_MAGIC, 0);
+		sloop_send(sl, &mrsp);
+
+		/* the CP side asks for the rings, as a modem does */
+		if (ch->type == SLOOP_CH_SBUF) {
+			smsg_set(&mrsp, msg->channel, SMSG_TYPE_CMD,
+					SMSG_CMD_SBUF_INIT, 0);
+			sloop_send(sl, &mrsp);
+		} else if (ch->type == SLOOP_CH_SBLOCK) {
+			smsg_set(&mrsp, msg->channel, SMSG_TYPE_CMD,
+					SMSG_CMD_SBLOCK_INIT,
+					SBLOCK_CAP_MAGIC | SBLOCK_CAP_RELRING);
+			sloop_send(sl, &mrsp);
+		}
+		break;
+	case SMSG_TYPE_CLOSE:
+		sloop_chan_reset(ch);
+		break;
+	case SMSG_TYPE_DONE:
+		if (ch->type != SLOOP_CH_SMSG && !ch->smem_virt) {
+			if (sloop_chan_map(ch, msg->value)) {
+				printk(KERN_ERR "sloop: failed to map smem 0x%08x "
+						"of channel %d\n",
+						msg->value, msg->channel);
+			}
+		}
+		break;
+	case SMSG_TYPE_CMD:
+		smsg_set(&mrsp, msg->channel, SMSG_TYPE_DONE,
+				msg->flag, msg->value);
+		sloop_send(sl, &mrsp);
+		break;
+	case SMSG_TYPE_EVENT:
+		if (ch->type == SLOOP_CH_SMSG) {
+			sloop_send(sl, msg);
+		} else if (ch->type == SLOOP_CH_SBLOCK && ch->smem_virt &&
+				msg->flag == SMSG_EVENT_SBLOCK_RELEASE) {
+			sloop_sblock_released(ch, msg->value);
+		}
+		/* ring data is moved after the whole batch of smsgs */
+		break;
+	default:
+		sloop_send(sl, msg);
+		break;
+	}
+}
+
+static int sloop_thread(void *data)
+{
+	struct sloop *sl = data;
+	struct sloop_chan *ch;
+	struct smsg mrecv;
+	uint32_t rd;
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(sl->wait,
+				readl(&sl->txbuf_wrptr) != readl(&sl->txbuf_rdptr) ||
+				kthread_should_stop());
+
+		rd = readl(&sl->txbuf_rdptr);
+		while (readl(&sl->txbuf_wrptr) != rd) {
+			rmb();
+			memcpy(&mrecv, &sl->txbuf[rd & (SLOOP_SMSG_NR - 1)],
+					sizeof(struct smsg));
+			writel(++rd, &sl->txbuf_rdptr);
+
+			sloop_handle(sl, &mrecv);
+		}
+
+		for (i = 0; i < SMSG_CH_NR; i++) {
+			ch = &sl->chans[i];
+			if (!ch->smem_virt) {
+				continue;
+			}
+			if (ch->type == SLOOP_CH_SBUF) {
+				sloop_sbuf_echo(sl, i, ch);
+			} else {
+				sloop_sblock_echo(sl, i, ch);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int __init sloop_init(void)
+{
+	struct sloop *sl;
+	int i, rval;
+
+	if (dst >= SIPC_ID_NR) {
+		return -EINVAL;
+	}
+
+	sl = kzalloc(sizeof(struct sloop), GFP_KERNEL);
+	if (!sl) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < SMSG_CH_NR; i++) {
+		if (sblock_channels & (1 << i)) {
+			sl->chans[i].type = SLOOP_CH_SBLOCK;
+		} else if (sbuf_channels & (1 << i)) {
+			sl->chans[i].type = SLOOP_CH_SBUF;
+		}
+	}
+
+	init_waitqueue_head(&sl->wait);
+	tasklet_init(&sl->irq, sloop_irq, (unsigned long)sl);
+
+	sl->ipc.name = "sipc-loop";
+	sl->ipc.dst = dst;
+	sl->ipc.irq = -1;
+	sl->ipc.rxirq_status = sloop_rxirq_status;
+	sl->ipc.rxirq_clear = sloop_rxirq_clear;
+	sl->ipc.txirq_trigger = sloop_txirq_trigger;
+
+	sl->ipc.txbuf_size = SLOOP_SMSG_NR;
+	sl->ipc.txbuf_addr = (uint32_t)sl->txbuf;
+	sl->ipc.txbuf_rdptr = (uint32_t)&sl->txbuf_rdptr;
+	sl->ipc.txbuf_wrptr = (uint32_t)&sl->txbuf_wrptr;
+
+	sl->ipc.rxbuf_size = SLOOP_SMSG_NR;
+	sl->ipc.rxbuf_addr = (uint32_t)sl->rxbuf;
+	sl->ipc.rxbuf_rdptr = (uint32_t)&sl->rxbuf_rdptr;
+	sl->ipc.rxbuf_wrptr = (uint32_t)&sl->rxbuf_wrptr;
+
+	if (smem_size) {
+		rval = smem_init(smem_addr, smem_size);
+		if (rval) {
+			kfree(sl);
+			return rval;
+		}
+	}
+
+	sloop = sl;
+	sl->thread = kthread_run(sloop_thread, sl, "sloop-%d", dst);
+	if (IS_ERR(sl->thread)) {
+		printk(KERN_ERR "Failed to create kthread: sloop-%d\n", dst);
+		rval = PTR_ERR(sl->thread);
+		sloop = NULL;
+		kfree(sl);
+		return rval;
+	}
+
+	rval = smsg_ipc_create(dst, &sl->ipc);
+	if (rval) {
+		kthread_stop(sl->thread);
+		sloop = NULL;
+		kfree(sl);
+		return rval;
+	}
+
+	printk(KERN_INFO "sipc loopback peer on dst %d\n", dst);
+
+	return 0;
+}
+
+module_init(sloop_init);
+
+MODULE_AUTHOR("Chen Gaopeng");
+MODULE_DESCRIPTION("SIPC loopback peer");
+MODULE_LICENSE("GPL");
@@ -15,21 +15,217 @@
 #include <linux/module.h>
 #include <linux/genalloc.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+
+/*
+ * Sub-page allocations are served from size classes of 32 bytes up to
+ * half a page. Each class carves whole smem pages (slabs) into equal
+ * objects; the object maps are kept in kernel memory since smem is not
+ * mapped here. Page-sized and bigger allocations go to the gen pool.
+ */
+#define SMEM_MIN_SHIFT		5
+#define SMEM_CLASS_NR		(PAGE_SHIFT - SMEM_MIN_SHIFT)
+#define SMEM_SLAB_OBJS		(PAGE_SIZE >> SMEM_MIN_SHIFT)
+
+struct smem_slab {
+	struct list_head	list;
+	uint32_t		addr;
+	uint32_t		class;
+	uint32_t		inuse;
+	unsigned long		map[BITS_TO_LONGS(SMEM_SLAB_OBJS)];
+};
+
+struct smem_class {
+	uint32_t		size;
+	uint32_t		objnr;		/* objects per slab */
+	struct list_head	partial;	/* slabs with free objects */
+	struct list_head	full;
+	uint32_t		slabs;
+	uint32_t		inuse;
+};
 
 struct smem_pool {
 	uint32_t		addr;
 	uint32_t		size;
 
 	struct gen_pool		*gen;
+
+	spinlock_t		lock;
+	struct smem_class	classes[SMEM_CLASS_NR];
+	struct smem_slab	**slabs;	/* slab of each smem page */
+	uint32_t		pages;		/* pages allocated, slabs too */
 };
 
 static struct smem_pool		mem_pool;
 
+static int smem_class_index(uint32_t size)
+{
+	if (size <= (1 << SMEM_MIN_SHIFT)) {
+		return 0;
+	}
+	return fls(size - 1) - SMEM_MIN_SHIFT;
+}
+
+static struct smem_slab *smem_slab_new(struct smem_pool *spool, int index)
+{
+	struct smem_slab *slab;
+
+	slab = kzalloc(sizeof(struct smem_slab), GFP_KERNEL);
+	if (!slab) {
+		return NULL;
+	}
+	slab->addr = gen_pool_alloc(spool->gen, PAGE_SIZE);
+	if (!slab->addr) {
+		kfree(slab);
+		return NULL;
+	}
+	slab->class = index;
+
+	return slab;
+}
+
+static uint32_t smem_slab_alloc(struct smem_pool *spool, int index)
+{
+	struct smem_class *cls = &spool->classes[index];
+	struct smem_slab *slab, *new = NULL;
+	uint32_t addr, bit;
+
+	spin_lock(&spool->lock);
+	while (list_empty(&cls->partial)) {
+		if (new) {
+			list_add(&new->list, &cls->partial);
+			spool->slabs[(new->addr - spool->addr) >> PAGE_SHIFT] = new;
+			spool->pages++;
+			cls->slabs++;
+			new = NULL;
+			break;
+		}
+
+		/* grab a page outside the lock, it may not be used */
+		spin_unlock(&spool->lock);
+		new = smem_slab_new(spool, index);
+		if (!new) {
+			return 0;
+		}
+		spin_lock(&spool->lock);
+	}
+
+	slab = list_first_entry(&cls->partial, struct smem_slab, list);
+	bit = find_first_zero_bit(slab->map, cls->objnr);
+	__set_bit(bit, slab->map);
+	if (++slab->inuse == cls->objnr) {
+		list_move(&slab->list, &cls->full);
+	}
+	cls->inuse++;
+	addr = slab->addr + bit * cls->size;
+	spin_unlock(&spool->lock);
+
+	/* someone else refilled the class meanwhile */
+	if (new) {
+		gen_pool_free(spool->gen, new->addr, PAGE_SIZE);
+		kfree(new);
+	}
+
+	return addr;
+}
+
+static void smem_slab_free(struct smem_pool *spool, uint32_t addr, int index)
+{
+	struct smem_class *cls = &spool->classes[index];
+	struct smem_slab *slab;
+	uint32_t page = (addr - spool->addr) >> PAGE_SHIFT;
+
+	spin_lock(&spool->lock);
+	slab = spool->slabs[page];
+	if (!slab || slab->class != index) {
+		spin_unlock(&spool->lock);
+		printk(KERN_ERR "smem free bad addr 0x%08x of class %d\n",
+				addr, cls->size);
+		return;
+	}
+
+	__clear_bit((addr - slab->addr) / cls->size, slab->map);
+	if (slab->inuse-- == cls->objnr) {
+		list_move(&slab->list, &cls->partial);
+	}
+	cls->inuse--;
+
+	if (slab->inuse) {
+		spin_unlock(&spool->lock);
+		return;
+	}
+
+	/* give the empty slab back to the gen pool */
+	list_del(&slab->list);
+	spool->slabs[page] = NULL;
+	spool->pages--;
+	cls->slabs--;
+	spin_unlock(&spool->lock);
+
+	gen_pool_free(spool->gen, slab->addr, PAGE_SIZE);
+	kfree(slab);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int smem_debug_show(struct seq_file *m, void *private)
+{
+	struct smem_pool *spool = &mem_pool;
+	struct smem_class *cls;
+	int i;
+
+	spin_lock(&spool->lock);
+	seq_printf(m, "smem pool: addr 0x%08x, size %u, pages used %u/%lu\n",
+			spool->addr, spool->size, spool->pages,
+			(unsigned long)(spool->size >> PAGE_SHIFT));
+	seq_printf(m, "%8s %8s %8s %8s %8s\n",
+			"size", "slabs", "objects", "inuse", "waste");
+	for (i = 0; i < SMEM_CLASS_NR; i++) {
+		cls = &spool->classes[i];
+		seq_printf(m, "%8u %8u %8u %8u %8u\n",
+				cls->size, cls->slabs, cls->slabs * cls->objnr,
+				cls->inuse,
+				(cls->slabs * cls->objnr - cls->inuse) * cls->size);
+	}
+	spin_unlock(&spool->lock);
+
+	return 0;
+}
+
+static int smem_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smem_debug_show, inode->i_private);
+}
+
+static const struct file_operations smem_debug_fops = {
+	.open = smem_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init smem_debugfs_init(void)
+{
+	debugfs_create_file("smem", S_IRUGO, sipc_debugfs_root(), NULL,
+			&smem_debug_fops);
+
+	return 0;
+}
+
+late_initcall(smem_debugfs_init);
+#endif
+
 int smem_init(uint32_t addr, uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
+	int i;
 
 	spool->addr = addr;
 	spool->size = PAGE_ALIGN(size);
@@ -46,6 +242,21 @@ int smem_init(uint32_t addr, uint32_t size)
 		return -1;
 	}
 
+	spool->slabs = kzalloc(sizeof(struct smem_slab *) *
+			(spool->size >> PAGE_SHIFT), GFP_KERNEL);
+	if (!spool->slabs) {
+		printk(KERN_ERR "Failed to allocate smem slabs!\n");
+		return -1;
+	}
+
+	spin_lock_init(&spool->lock);
+	for (i = 0; i < SMEM_CLASS_NR; i++) {
+		spool->classes[i].size = 1 << (SMEM_MIN_SHIFT + i);
+		spool->classes[i].objnr = PAGE_SIZE >> (SMEM_MIN_SHIFT + i);
+		INIT_LIST_HEAD(&spool->classes[i].partial);
+		INIT_LIST_HEAD(&spool->classes[i].full);
+	}
+
 	return 0;
 }
 
@@ -54,17 +265,46 @@ int smem_init(uint32_t addr, uint32_t size)
 uint32_t smem_alloc(uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
+	uint32_t addr;
+
+	if (size == 0) {
+		return 0;
+	}
+
+	if (size <= PAGE_SIZE / 2) {
+		return smem_slab_alloc(spool, smem_class_index(size));
+	}
 
 	size = PAGE_ALIGN(size);
-	return gen_pool_alloc(spool->gen, size);
+	addr = gen_pool_alloc(spool->gen, size);
+	if (addr) {
+		spin_lock(&spool->lock);
+		spool->pages += size >> PAGE_SHIFT;
+		spin_unlock(&spool->lock);
+	}
+
+	return addr;
 }
 
 void smem_free(uint32_t addr, uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
 
+	if (size == 0) {
+		return;
+	}
+
+	if (size <= PAGE_SIZE / 2) {
+		smem_slab_free(spool, addr, smem_class_index(size));
+		return;
+	}
+
 	size = PAGE_ALIGN(size);
 	gen_pool_free(spool->gen, addr, size);
+
+	spin_lock(&spool->lock);
+	spool->pages -= size >> PAGE_SHIFT;
+	spin_unlock(&spool->lock);
 }
 
 EXPORT_SYMBOL(smem_alloc);
@@ -20,80 +20,106 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/io.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
 
 #include <linux/sipc.h>
 #include <linux/sipc_priv.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/sipc.h>
+
 static struct smsg_ipc *smsg_ipcs[SIPC_ID_NR];
 
 irqreturn_t smsg_irq_handler(int irq, void *dev_id)
 {
 	struct smsg_ipc *ipc = (struct smsg_ipc *)dev_id;
-	struct smsg *msg;
+	struct smsg *msg, mrecv;
 	struct smsg_channel *ch;
-	uint32_t rxpos, wr;
+	struct smsg_stat *stat;
+	int (*handler)(struct smsg *msg, void *data);
+	uint32_t rxpos, rd, wr;
 
 	if (ipc->rxirq_status()) {
 		ipc->rxirq_clear();
 	}
 
-	while (readl(ipc->rxbuf_wrptr) != readl(ipc->rxbuf_rdptr)) {
-		rxpos = (readl(ipc->rxbuf_rdptr) & (ipc->rxbuf_size - 1)) *
+	rd = readl(ipc->rxbuf_rdptr);
+	while (readl(ipc->rxbuf_wrptr) != rd) {
+		rxpos = (rd & (ipc->rxbuf_size - 1)) *
 			sizeof (struct smsg) + ipc->rxbuf_addr;
 		msg = (struct smsg *)rxpos;
 
+		/* read the uncached msg once */
+		memcpy(&mrecv, msg, sizeof(struct smsg));
+
+		/* update smsg rdptr */
+		writel(++rd, ipc->rxbuf_rdptr);
+
 		pr_debug("irq get smsg: wrptr=%d, rdptr=%d, rxpos=0x%08x\n",
-			readl(ipc->rxbuf_wrptr), readl(ipc->rxbuf_rdptr), rxpos);
+			readl(ipc->rxbuf_wrptr), rd, rxpos);
 		pr_debug("irq read smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
-			msg->channel, msg->type, msg->flag, msg->value);
+			mrecv.channel, mrecv.type, mrecv.flag, mrecv.value);
+		trace_sipc_smsg_irq(ipc->dst, &mrecv);
 
-		if (msg->channel >= SMSG_CH_NR || msg->type >= SMSG_TYPE_NR) {
+		if (mrecv.channel >= SMSG_CH_NR || mrecv.type >= SMSG_TYPE_NR) {
 			/* invalid msg */
 			printk(KERN_ERR "invalid smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
-				msg->channel, msg->type, msg->flag, msg->value);
-
-			/* update smsg rdptr */
-			writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
-
+				mrecv.channel, mrecv.type, mrecv.flag, mrecv.value);
 			continue;
 		}
 
-		ch = ipc->channels[msg->channel];
+		stat = &ipc->stats[mrecv.channel];
+		stat->rxcount++;
+		if (mrecv.type == SMSG_TYPE_DONE && stat->cmdstamp.tv64) {
+			sipc_hist_add(&stat->ack, sipc_us_since(stat->cmdstamp));
+			stat->cmdstamp.tv64 = 0;
+		}
+
+		ch = ipc->channels[mrecv.channel];
 		if (!ch) {
-			if (ipc->states[msg->channel] == CHAN_STATE_UNUSED &&
-					msg->type == SMSG_TYPE_OPEN &&
-					msg->flag == SMSG_OPEN_MAGIC) {
+			if (ipc->states[mrecv.channel] == CHAN_STATE_UNUSED &&
+					mrecv.type == SMSG_TYPE_OPEN &&
+					mrecv.flag == SMSG_OPEN_MAGIC) {
 
-				ipc->states[msg->channel] = CHAN_STATE_WAITING;
+				ipc->states[mrecv.channel] = CHAN_STATE_WAITING;
 			} else {
 				/* drop this bad msg since channel is not opened */
 				printk(KERN_ERR "smsg channel %d not opened! "
 					"drop smsg: type=%d, flag=0x%04x, value=0x%08x\n",
-					msg->channel, msg->type, msg->flag, msg->value);
+					mrecv.channel, mrecv.type, mrecv.flag, mrecv.value);
 			}
-
-			/* update smsg rdptr */
-			writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
-
 			continue;
 		}
 
-		if ((int)(readl(ch->wrptr) - readl(ch->rdptr)) >= SMSG_CACHE_NR) {
+		/* callback delivery, no wakeup at all */
+		handler = ACCESS_ONCE(ch->handler);
+		if (handler) {
+			smp_rmb();
+			if (handler(&mrecv, ch->data) == 0) {
+				continue;
+			}
+		}
+
+		wr = ch->wrptr;
+		if ((int)(wr - ACCESS_ONCE(ch->rdptr)) >= SMSG_CACHE_NR) {
 			/* msg cache is full, drop this msg */
-			printk(KERN_ERR "smsg channel %d recv cache is full! "
+			ch->dropped++;
+			pr_debug("smsg channel %d recv cache is full! "
 				"drop smsg: type=%d, flag=0x%04x, value=0x%08x\n",
-				msg->channel, msg->type, msg->flag, msg->value);
-		} else {
-			/* write smsg to cache */
-			wr = readl(ch->wrptr) & (SMSG_CACHE_NR - 1);
-			memcpy(&(ch->caches[wr]), msg, sizeof(struct smsg));
-			writel(readl(ch->wrptr) + 1, ch->wrptr);
+				mrecv.channel, mrecv.type, mrecv.flag, mrecv.value);
+			continue;
 		}
 
-		/* update smsg rdptr */
-		writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
+		/* write smsg to cache, then publish it */
+		ch->caches[wr & (SMSG_CACHE_NR - 1)] = mrecv;
+		ch->stamps[wr & (SMSG_CACHE_NR - 1)] = ktime_get();
+		smp_wmb();
+		ch->wrptr = wr + 1;
 
-		wake_up_interruptible_all(&(ch->rxwait));
+		wake_up_interruptible(&(ch->rxwait));
 	}
 
 	return IRQ_HANDLED;
@@ -107,12 +133,17 @@ int smsg_ipc_create(uint8_t dst, struct smsg_ipc *ipc)
 		ipc->irq_handler = smsg_irq_handler;
 	}
 
-	mutex_init(&(ipc->txlock));
+	spin_lock_init(&(ipc->txlock));
 	smsg_ipcs[dst] = ipc;
 
 	/* explicitly call irq handler in case of missing irq on boot */
 	ipc->irq_handler(ipc->irq, ipc);
 
+	/* a software peer has no irq line, it calls irq_handler itself */
+	if (ipc->irq < 0) {
+		return 0;
+	}
+
 	/* register IPI irq */
 	rval = request_irq(ipc->irq, ipc->irq_handler,
 			0, ipc->name, ipc);
@@ -129,8 +160,12 @@ int smsg_ipc_destroy(uint8_t dst)
 {
 	struct smsg_ipc *ipc = smsg_ipcs[dst];
 
-	kthread_stop(ipc->thread);
-	free_irq(ipc->irq, ipc);
+	if (ipc->thread) {
+		kthread_stop(ipc->thread);
+	}
+	if (ipc->irq >= 0) {
+		free_irq(ipc->irq, ipc);
+	}
 	smsg_ipcs[dst] = NULL;
 
 	return 0;
@@ -202,8 +237,9 @@ int smsg_ch_close(uint8_t dst, uint8_t channel,  int timeout)
 int smsg_send(uint8_t dst, struct smsg *msg, int timeout)
 {
 	struct smsg_ipc *ipc = smsg_ipcs[dst];
-	uint32_t txpos;
-	int rval = 0;
+	unsigned long flags;
+	uint32_t txpos, wr;
+	int nowait;
 
 	if (!ipc->channels[msg->channel]) {
 		printk(KERN_ERR "channel %d not inited!\n", msg->channel);
@@ -221,59 +257,57 @@ int smsg_send(uint8_t dst, struct smsg *msg, int timeout)
 	pr_debug("send smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
 			msg->channel, msg->type, msg->flag, msg->value);
 
-	if (timeout == 0) {
-		if (!mutex_trylock(&(ipc->txlock))) {
-			printk(KERN_INFO "send smsg busy!\n");
-			return -EBUSY;
-		}
-
-		/* no wait */
-		if ((int)(readl(ipc->txbuf_wrptr) -
-			readl(ipc->txbuf_rdptr)) >= ipc->txbuf_size) {
-
-			printk(KERN_WARNING "smsg txbuf is full!\n");
-			rval = -EBUSY;
+	nowait = (timeout == 0);
+	if (timeout < 0) {
+		timeout =  3600 * 1000;	/* 1 hour */
+	}
 
-			goto send_failed;
+	/*
+	 * txlock only covers writing one msg, so smsg_send with no wait
+	 * can be called in atomic context, waiting for room is done
+	 * without the lock
+	 */
+	for (;;) {
+		spin_lock_irqsave(&(ipc->txlock), flags);
+		wr = readl(ipc->txbuf_wrptr);
+		if ((int)(wr - readl(ipc->txbuf_rdptr)) < ipc->txbuf_size) {
+			break;
 		}
-	} else {
-		mutex_lock(&(ipc->txlock));
+		spin_unlock_irqrestore(&(ipc->txlock), flags);
+		ipc->stats[msg->channel].txfull++;
 
-		/* wait timeout */
-		if (timeout < 0) {
-			timeout =  3600 * 1000;	/* 1 hour */
-		}
-
-		while ((int)(readl(ipc->txbuf_wrptr) -
-			readl(ipc->txbuf_rdptr)) >= ipc->txbuf_size) {
-			if (timeout < 0) {
-				printk(KERN_WARNING "smsg txbuf is full, timeout!\n");
-				rval = -ETIME;
-
-				goto send_failed;
-			}
-			msleep(10);
-			timeout -= 10;
+		if (nowait) {
+			printk(KERN_WARNING "smsg txbuf is full!\n");
+			return -EBUSY;
+		} else if (timeout <= 0) {
+			printk(KERN_WARNING "smsg txbuf is full, timeout!\n");
+			return -ETIME;
 		}
+		msleep(10);
+		timeout -= 10;
 	}
 
 	/* calc txpos and write smsg */
-	txpos = (readl(ipc->txbuf_wrptr) & (ipc->txbuf_size - 1)) *
+	txpos = (wr & (ipc->txbuf_size - 1)) *
 		sizeof(struct smsg) + ipc->txbuf_addr;
 	memcpy((void *)txpos, msg, sizeof(struct smsg));
 
 	pr_debug("write smsg: wrptr=%d, rdptr=%d, txpos=0x%08x\n",
-			readl(ipc->txbuf_wrptr),
-			readl(ipc->txbuf_rdptr), txpos);
+			wr, readl(ipc->txbuf_rdptr), txpos);
 
-	/* update wrptr */
-	writel(readl(ipc->txbuf_wrptr) + 1, ipc->txbuf_wrptr);
+	/* update wrptr, writel orders it after the msg body */
+	writel(wr + 1, ipc->txbuf_wrptr);
 	ipc->txirq_trigger();
 
-send_failed:
-	mutex_unlock(&(ipc->txlock));
+	ipc->stats[msg->channel].txcount++;
+	if (msg->type == SMSG_TYPE_CMD) {
+		ipc->stats[msg->channel].cmdstamp = ktime_get();
+	}
+	trace_sipc_smsg_send(dst, msg);
 
-	return rval;
+	spin_unlock_irqrestore(&(ipc->txlock), flags);
+
+	return 0;
 }
 
 int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
@@ -298,7 +332,7 @@ int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
 		}
 
 		/* no wait */
-		if (readl(ch->wrptr) == readl(ch->rdptr)) {
+		if (ACCESS_ONCE(ch->wrptr) == ch->rdptr) {
 			printk(KERN_WARNING "smsg rx cache is empty!\n");
 			rval = -ENODATA;
 
@@ -309,7 +343,7 @@ int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
 
 		/* wait forever */
 		rval = wait_event_interruptible(ch->rxwait,
-				readl(ch->wrptr) != readl(ch->rdptr));
+				ACCESS_ONCE(ch->wrptr) != ch->rdptr);
 		if (rval < 0) {
 			printk(KERN_WARNING "smsg_recv wait interrupted!\n");
 
@@ -320,7 +354,7 @@ int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
 
 		/* wait timeout */
 		rval = wait_event_interruptible_timeout(ch->rxwait,
-			readl(ch->wrptr) != readl(ch->rdptr), timeout);
+			ACCESS_ONCE(ch->wrptr) != ch->rdptr, timeout);
 		if (rval < 0) {
 			printk(KERN_WARNING "smsg_recv wait interrupted!\n");
 
@@ -333,13 +367,18 @@ int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
 		}
 	}
 
-	/* read smsg from cache */
-	rd = readl(ch->rdptr) & (SMSG_CACHE_NR - 1);
+	/* read smsg from cache, then free the slot for the irq handler */
+	rval = 0;
+	smp_rmb();
+	rd = ch->rdptr & (SMSG_CACHE_NR - 1);
 	memcpy(msg, &(ch->caches[rd]), sizeof(struct smsg));
-	writel(readl(ch->rdptr) + 1, ch->rdptr);
+	sipc_hist_add(&ipc->stats[msg->channel].wakeup,
+			sipc_us_since(ch->stamps[rd]));
+	smp_mb();
+	ch->rdptr = ch->rdptr + 1;
 
 	pr_debug("read smsg: wrptr=%d, rdptr=%d, rd=%d\n",
-			readl(ch->wrptr), readl(ch->rdptr), rd);
+			ch->wrptr, ch->rdptr, rd);
 	pr_debug("recv smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
 			msg->channel, msg->type, msg->flag, msg->value);
 
@@ -349,10 +388,160 @@ recv_failed:
 	return rval;
 }
 
+int smsg_register_handler(uint8_t dst, uint8_t channel,
+		int (*handler)(struct smsg *msg, void *data), void *data)
+{
+	struct smsg_ipc *ipc = smsg_ipcs[dst];
+	struct smsg_channel *ch = ipc->channels[channel];
+
+	if (!ch) {
+		printk(KERN_ERR "channel %d not opened!\n", channel);
+		return -ENODEV;
+	}
+
+	/* data must be visible before the irq handler sees the callback */
+	ch->data = data;
+	smp_wmb();
+	ch->handler = handler;
+
+	return 0;
+}
+
+int smsg_unregister_handler(uint8_t dst, uint8_t channel)
+{
+	struct smsg_ipc *ipc = smsg_ipcs[dst];
+	struct smsg_channel *ch = ipc->channels[channel];
+
+	if (!ch) {
+		return -ENODEV;
+	}
+
+	ch->handler = NULL;
+	smp_wmb();
+
+	/*
+	 * wait for an irq handler that may still be running the callback,
+	 * a software peer runs it from a tasklet, which synchronize_sched
+	 * waits for as well
+	 */
+	if (ipc->irq >= 0) {
+		synchronize_irq(ipc->irq);
+	} else {
+		synchronize_sched();
+	}
+	ch->data = NULL;
+
+	return 0;
+}
+
+uint32_t smsg_ch_dropped(uint8_t dst, uint8_t channel)
+{
+	struct smsg_ipc *ipc = smsg_ipcs[dst];
+	struct smsg_channel *ch = ipc->channels[channel];
+
+	return ch ? ch->dropped : 0;
+}
+
+void sipc_hist_show(struct seq_file *m, const char *name,
+		struct sipc_hist *hist)
+{
+	int i, last;
+
+	seq_printf(m, "  %s: count %u, avg %llu, max %u\n", name,
+			hist->count,
+			hist->count ? div_u64(hist->sum, hist->count) : 0,
+			hist->max);
+
+	for (last = SIPC_HIST_NR - 1; last > 0; last--) {
+		if (hist->buckets[last]) {
+			break;
+		}
+	}
+	for (i = 0; i <= last && hist->count; i++) {
+		seq_printf(m, "    < %-8u %u\n", 1 << i, hist->buckets[i]);
+	}
+}
+
+struct dentry *sipc_debugfs_root(void)
+{
+	static struct dentry *root;
+
+	/* only called from initcalls */
+	if (!root) {
+		root = debugfs_create_dir("sipc", NULL);
+	}
+
+	return root;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int smsg_debug_show(struct seq_file *m, void *private)
+{
+	struct smsg_ipc *ipc;
+	struct smsg_stat *stat;
+	int i, j;
+
+	for (i = 0; i < SIPC_ID_NR; i++) {
+		ipc = smsg_ipcs[i];
+		if (!ipc) {
+			continue;
+		}
+
+		seq_printf(m, "sipc %s: txbuf wrptr %u rdptr %u, rxbuf wrptr %u rdptr %u\n",
+				ipc->name,
+				readl(ipc->txbuf_wrptr), readl(ipc->txbuf_rdptr),
+				readl(ipc->rxbuf_wrptr), readl(ipc->rxbuf_rdptr));
+
+		for (j = 0; j < SMSG_CH_NR; j++) {
+			stat = &ipc->stats[j];
+			if (ipc->states[j] == CHAN_STATE_UNUSED &&
+					!stat->txcount && !stat->rxcount) {
+				continue;
+			}
+
+			seq_printf(m, "channel %d: state %d, tx %u, rx %u, "
+					"txfull %u, dropped %u\n",
+					j, ipc->states[j],
+					stat->txcount, stat->rxcount, stat->txfull,
+					ipc->channels[j] ? ipc->channels[j]->dropped : 0);
+			sipc_hist_show(m, "irq to recv (us)", &stat->wakeup);
+			sipc_hist_show(m, "cmd to done (us)", &stat->ack);
+		}
+	}
+
+	return 0;
+}
+
+static int smsg_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smsg_debug_show, inode->i_private);
+}
+
+static const struct file_operations smsg_debug_fops = {
+	.open = smsg_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init smsg_debugfs_init(void)
+{
+	debugfs_create_file("smsg", S_IRUGO, sipc_debugfs_root(), NULL,
+			&smsg_debug_fops);
+
+	return 0;
+}
+
+late_initcall(smsg_debugfs_init);
+#endif
+
 EXPORT_SYMBOL(smsg_ch_open);
 EXPORT_SYMBOL(smsg_ch_close);
 EXPORT_SYMBOL(smsg_send);
 EXPORT_SYMBOL(smsg_recv);
+EXPORT_SYMBOL(smsg_register_handler);
+EXPORT_SYMBOL(smsg_unregister_handler);
+EXPORT_SYMBOL(smsg_ch_dropped);
 
 MODULE_AUTHOR("Chen Gaopeng");
 MODULE_DESCRIPTION("SIPC/SMSG driver");
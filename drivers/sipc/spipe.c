@@ -17,6 +17,8 @@
 #include <linux/poll.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <asm/uaccess.h>
 
 #include <linux/sipc.h>
 #include <linux/spipe.h>
@@ -109,9 +111,63 @@ static unsigned int spipe_poll(struct file *filp, poll_table *wait)
 			filp, wait);
 }
 
+static int spipe_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct spipe_sbuf *sbuf = filp->private_data;
+
+	return sbuf_mmap(sbuf->dst, sbuf->channel, sbuf->bufid, vma);
+}
+
 static long spipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	return 0;
+	struct spipe_sbuf *sbuf = filp->private_data;
+	struct spipe_ring_info info;
+	struct sbuf_ptr ptr;
+	uint32_t len;
+	int timeout = -1;
+	int rval;
+
+	if (filp->f_flags & O_NONBLOCK) {
+		timeout = 0;
+	}
+
+	switch (cmd) {
+	case SPIPE_IOC_RX_GET:
+	case SPIPE_IOC_TX_GET:
+		if (cmd == SPIPE_IOC_RX_GET) {
+			rval = sbuf_rx_get(sbuf->dst, sbuf->channel, sbuf->bufid,
+					&ptr, timeout);
+		} else {
+			rval = sbuf_tx_get(sbuf->dst, sbuf->channel, sbuf->bufid,
+					&ptr, timeout);
+		}
+		if (rval == -ENODATA || rval == -EBUSY) {
+			rval = -EAGAIN;
+		}
+		if (rval) {
+			return rval;
+		}
+
+		info.size = ptr.size;
+		info.rdptr = ptr.rdptr;
+		info.wrptr = ptr.wrptr;
+		if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+			return -EFAULT;
+		}
+		return 0;
+	case SPIPE_IOC_RX_PUT:
+		if (get_user(len, (uint32_t __user *)arg)) {
+			return -EFAULT;
+		}
+		return sbuf_rx_put(sbuf->dst, sbuf->channel, sbuf->bufid, len);
+	case SPIPE_IOC_TX_PUT:
+		if (get_user(len, (uint32_t __user *)arg)) {
+			return -EFAULT;
+		}
+		return sbuf_tx_put(sbuf->dst, sbuf->channel, sbuf->bufid, len);
+	default:
+		return -ENOTTY;
+	}
 }
 
 static const struct file_operations spipe_fops = {
@@ -120,6 +176,7 @@ static const struct file_operations spipe_fops = {
 	.read		= spipe_read,
 	.write		= spipe_write,
 	.poll		= spipe_poll,
+	.mmap		= spipe_mmap,
 	.unlocked_ioctl	= spipe_ioctl,
 	.owner		= THIS_MODULE,
 	.llseek		= default_llseek,
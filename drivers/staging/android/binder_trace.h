@@ -0,0 +1,117 @@
+/*
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_node;
+struct binder_proc;
+struct binder_transaction;
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t),
+	TP_ARGS(t),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, queue_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->queue_us = ktime_us_delta(t->recv_time,
+						   t->start_time);
+	),
+	TP_printk("transaction=%d queue_us=%lld",
+		  __entry->debug_id, __entry->queue_us)
+);
+
+TRACE_EVENT(binder_transaction_replied,
+	TP_PROTO(struct binder_transaction *t, ktime_t now),
+	TP_ARGS(t, now),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, service_us)
+		__field(s64, total_us)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->service_us = ktime_us_delta(now, t->recv_time);
+		__entry->total_us = ktime_us_delta(now, t->start_time);
+	),
+	TP_printk("transaction=%d service_us=%lld total_us=%lld",
+		  __entry->debug_id, __entry->service_us, __entry->total_us)
+);
+
+TRACE_EVENT(binder_thread_pool_starved,
+	TP_PROTO(struct binder_proc *proc, bool exhausted),
+	TP_ARGS(proc, exhausted),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, exhausted)
+		__field(int, ready_threads)
+		__field(int, requested_threads)
+		__field(int, started_threads)
+		__field(int, max_threads)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->exhausted = exhausted;
+		__entry->ready_threads = proc->ready_threads;
+		__entry->requested_threads = proc->requested_threads;
+		__entry->started_threads = proc->requested_threads_started;
+		__entry->max_threads = proc->max_threads;
+	),
+	TP_printk("proc=%d exhausted=%d ready=%d requested=%d started=%d max=%d",
+		  __entry->proc, __entry->exhausted, __entry->ready_threads,
+		  __entry->requested_threads, __entry->started_threads,
+		  __entry->max_threads)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -20,11 +20,13 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -36,17 +38,24 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * 'w_off' and 'head' count bytes ever written and never wrap; logger_offset()
+ * turns them into positions in 'buffer'. Writers serialize on the spinlock
+ * 'lock', which is only held to copy an already staged entry into the ring.
+ * Readers take no lock: they read 'head' and 'w_off' and check afterwards
+ * that the entry they copied was not overwritten meanwhile (see
+ * logger_lapped()). A writer moves 'head' past the entries it is about to
+ * overwrite before touching them, and moves 'w_off' past its entry once it
+ * is complete.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* serializes writers */
 	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	size_t			head;	/* oldest entry, new readers start here */
 	size_t			size;	/* size of the log */
 };
 
@@ -54,22 +63,66 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by reader->mutex, which
+ * only serializes the users of one file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* protects r_off */
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_batch; /* read() returns as many as fit */
 	int			r_ver;	/* reader ABI version */
 };
 
+/*
+ * struct logger_scratch - per-cpu staging area for an entry's payload, so it
+ * can be copied from userspace before the log's lock is taken
+ */
+struct logger_scratch {
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
+};
+
+static struct logger_scratch __percpu *logger_scratch;
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
 	return n & (log->size-1);
 }
 
+/*
+ * logger_lapped - has the entry at 'off' been overwritten, given that the
+ * oldest entry in the log is at 'head'?
+ */
+static inline bool logger_lapped(size_t off, size_t head)
+{
+	return (ssize_t)(off - head) < 0;
+}
+
+/*
+ * logger_catch_up - moves 'reader' to the oldest entry if the writers
+ * lapped it, and returns the write offset readers may read up to.
+ *
+ * Caller needs to hold reader->mutex.
+ */
+static size_t logger_catch_up(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	size_t head, w_off;
+
+	/* head never passes a w_off read after it */
+	head = ACCESS_ONCE(log->head);
+	smp_rmb();
+	w_off = ACCESS_ONCE(log->w_off);
+	smp_rmb();
+
+	if (logger_lapped(reader->r_off, head))
+		reader->r_off = head;
+
+	return w_off;
+}
+
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -123,17 +176,33 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * In the log, the length does not include the size of the log entry structure.
  * This function returns the size including the log entry structure.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
 	struct logger_entry scratch;
 	struct logger_entry *entry;
 
-	entry = get_entry_header(log, off, &scratch);
+	entry = get_entry_header(log, logger_offset(log, off), &scratch);
 	return entry->len;
 }
 
+/*
+ * read_entry_header - copies the header of the entry at 'off' into 'entry'.
+ * Returns false if the writers overwrote it while it was being copied.
+ *
+ * The caller must have read a w_off beyond 'off'.
+ */
+static bool read_entry_header(struct logger_log *log, size_t off,
+			      struct logger_entry *entry)
+{
+	struct logger_entry scratch;
+
+	*entry = *get_entry_header(log, logger_offset(log, off), &scratch);
+	smp_rmb();
+	return !logger_lapped(off, ACCESS_ONCE(log->head));
+}
+
 static size_t get_user_hdr_len(int ver)
 {
 	if (ver < 2)
@@ -167,18 +236,19 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - copies the entry at reader->r_off, whose header is
+ * 'entry', to the user-space buffer 'buf'. Returns the number of bytes
+ * copied, or -EAGAIN if the writers overwrote the entry meanwhile, in which
+ * case 'buf' holds garbage and the caller has to start over.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+				   struct logger_entry *entry,
+				   char __user *buf)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	size_t count = entry->len;
 	size_t len;
 	size_t msg_start;
 
@@ -186,11 +256,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
-	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
 	msg_start = logger_offset(log,
 		reader->r_off + sizeof(struct logger_entry));
@@ -212,34 +280,62 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	/* did a writer reuse the space while we were copying it? */
+	smp_rmb();
+	if (logger_lapped(reader->r_off, ACCESS_ONCE(log->head)))
+		return -EAGAIN;
+
+	reader->r_off += sizeof(struct logger_entry) + count;
 
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * get_next_entry_by_uid - Starting at reader->r_off, moves the reader to
+ * the first entry before 'w_off' readable by 'euid'
+ *
+ * Caller must hold reader->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static void get_next_entry_by_uid(struct logger_log *log,
+		struct logger_reader *reader, size_t w_off, uid_t euid)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	while (reader->r_off != w_off) {
+		struct logger_entry entry;
 
-		entry = get_entry_header(log, off, &scratch);
+		if (!read_entry_header(log, reader->r_off, &entry)) {
+			w_off = logger_catch_up(log, reader);
+			continue;
+		}
 
-		if (entry->euid == euid)
-			return off;
+		if (entry.euid == euid)
+			return;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
+		reader->r_off += sizeof(struct logger_entry) + entry.len;
 	}
+}
+
+/*
+ * logger_next_entry - moves 'reader' to the next entry it may read and
+ * copies that entry's header into 'entry'. Returns false if there is none.
+ *
+ * Caller must hold reader->mutex.
+ */
+static bool logger_next_entry(struct logger_log *log,
+			      struct logger_reader *reader,
+			      struct logger_entry *entry)
+{
+	size_t w_off;
+
+	do {
+		w_off = logger_catch_up(log, reader);
+		if (!reader->r_all)
+			get_next_entry_by_uid(log, reader, w_off,
+					      current_euid());
+		if (reader->r_off == w_off)
+			return false;
+	} while (!read_entry_header(log, reader->r_off, entry));
 
-	return off;
+	return true;
 }
 
 /*
@@ -249,7 +345,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  *	- O_NONBLOCK works
  *	- If there are no log entries to read, blocks until log is written to
- *	- Atomically reads exactly one log entry
+ *	- Atomically reads exactly one log entry, or in batch mode as many
+ *	  whole entries as fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -259,17 +356,18 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
+	size_t done;
 	DEFINE_WAIT(wait);
 
+	mutex_lock(&reader->mutex);
+
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
-
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = (logger_catch_up(log, reader) == reader->r_off);
 		if (!ret)
 			break;
 
@@ -288,172 +386,141 @@ start:
 
 	finish_wait(&log->wq, &wait);
 	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+		goto out;
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!logger_next_entry(log, reader, &entry)))
 		goto start;
-	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, &entry, buf);
+	if (unlikely(ret == -EAGAIN))
+		goto start;
+	if (ret < 0 || !reader->r_batch)
+		goto out;
+
+	/* in batch mode, follow up with whatever else is there and fits */
+	done = ret;
+	while (logger_next_entry(log, reader, &entry)) {
+		if (count - done < get_user_hdr_len(reader->r_ver) + entry.len)
+			break;
+
+		ret = do_read_log_to_user(log, reader, &entry, buf + done);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret < 0)
+			break;
+		done += ret;
+	}
+	ret = done;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * make_room - moves log->head past the entries that a new entry of 'len'
+ * bytes at log->w_off is going to overwrite. Readers still inside them will
+ * notice and catch up with log->head.
  *
- * Caller must hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void make_room(struct logger_log *log, size_t len)
 {
-	size_t count = 0;
+	size_t head = log->head;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
+	while (log->w_off + len - head > log->size)
+		head += sizeof(struct logger_entry) +
+			get_entry_msg_len(log, head);
 
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
- */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+	if (head != log->head) {
+		log->head = head;
+		/* head has to be visible before the old entries change */
+		smp_wmb();
 	}
-
-	return 0;
-}
-
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
-
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at 'off', which
+ * counts from log->w_off
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
+	size_t w_off = logger_offset(log, log->w_off + off);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - w_off);
+	memcpy(log->buffer + w_off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * copy_payload_from_user - gathers 'count' bytes of payload from the iovec
+ * into 'buf'. With 'atomic' set it must not sleep, and fails rather than
+ * fault pages in.
  *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_payload_from_user(void *buf, const struct iovec *iov,
+				  unsigned long nr_segs, size_t count,
+				  bool atomic)
 {
-	size_t len;
+	size_t done = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && done < count) {
+		/* figure out how much of this vector we can keep */
+		size_t len = min_t(size_t, iov->iov_len, count - done);
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+		if (atomic)
+			left = __copy_from_user_inatomic(buf + done,
+							 iov->iov_base, len);
+		else
+			left = copy_from_user(buf + done, iov->iov_base, len);
+		if (left)
 			return -EFAULT;
 
-	log->w_off = logger_offset(log, log->w_off + count);
+		iov++;
+		done += len;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is first staged in this cpu's scratch buffer, without the log's
+ * lock, so a writer that faults or is preempted never holds up the others.
+ * Only the copy into the ring is done under log->lock. A writer whose
+ * payload is not resident takes the slow path through a kmalloc'ed buffer.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned char *payload;
+	bool staged = true;
+	size_t len;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -469,43 +536,47 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	payload = get_cpu_ptr(logger_scratch)->buf;
+	pagefault_disable();
+	ret = copy_payload_from_user(payload, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		put_cpu_ptr(logger_scratch);
+		staged = false;
+		payload = kmalloc(header.len, GFP_KERNEL);
+		if (!payload)
+			return -ENOMEM;
+		ret = copy_payload_from_user(payload, iov, nr_segs,
+					     header.len, false);
+		if (ret) {
+			kfree(payload);
+			return ret;
+		}
+	}
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	len = sizeof(struct logger_entry) + header.len;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	spin_lock(&log->lock);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	make_room(log, len);
+	do_write_log(log, 0, &header, sizeof(struct logger_entry));
+	do_write_log(log, sizeof(struct logger_entry), payload, header.len);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	/* the entry has to be complete before readers can see it */
+	smp_wmb();
+	log->w_off += len;
 
-		iov++;
-		ret += nr;
-	}
+	spin_unlock(&log->lock);
 
-	mutex_unlock(&log->mutex);
+	if (staged)
+		put_cpu_ptr(logger_scratch);
+	else
+		kfree(payload);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -537,15 +608,12 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_off = ACCESS_ONCE(log->head);
 
 		file->private_data = reader;
 	} else
@@ -563,11 +631,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 
 		kfree(reader);
 	}
@@ -589,6 +652,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	struct logger_reader *reader;
 	struct logger_log *log;
 	unsigned int ret = POLLOUT | POLLWRNORM;
+	size_t w_off;
 
 	if (!(file->f_mode & FMODE_READ))
 		return ret;
@@ -598,18 +662,68 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	w_off = logger_catch_up(log, reader);
 	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+		get_next_entry_by_uid(log, reader, w_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the whole ring read-only, for readers that consume it in bulk with the
+ * help of ioctl(LOGGER_GET_OFFSETS). The ring holds everybody's entries, so
+ * this is only allowed for readers that may read all of them.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	if (vma->vm_pgoff || size != PAGE_ALIGN(log->size))
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
+
+static long logger_get_offsets(struct logger_log *log, void __user *arg)
+{
+	struct logger_offsets offsets;
+
+	offsets.head = ACCESS_ONCE(log->head);
+	smp_rmb();
+	offsets.w_off = ACCESS_ONCE(log->w_off);
+	offsets.size = log->size;
+
+	if (copy_to_user(arg, &offsets, sizeof(offsets)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -626,11 +740,15 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
-	struct logger_reader *reader;
+	struct logger_reader *reader = NULL;
+	struct logger_entry entry;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+	}
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -641,26 +759,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_catch_up(log, reader) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
-
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (logger_next_entry(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -674,9 +781,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* readers notice they were lapped and catch up with head */
+		spin_lock(&log->lock);
 		log->head = log->w_off;
+		spin_unlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -684,7 +792,6 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
 	case LOGGER_SET_VERSION:
@@ -692,12 +799,27 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader->r_batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_GET_OFFSETS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_get_offsets(log, argp);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	if (reader)
+		mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -707,6 +829,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -716,10 +839,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). The buffer is
+ * page aligned so that it can be mmap()ed.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -729,8 +853,7 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -775,6 +898,12 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_scratch = alloc_percpu(struct logger_scratch);
+	if (!logger_scratch) {
+		printk(KERN_ERR "logger: failed to allocate staging buffers\n");
+		return -ENOMEM;
+	}
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
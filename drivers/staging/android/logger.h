@@ -51,6 +51,23 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * The position of the log, as returned by ioctl(LOGGER_GET_OFFSETS) for
+ * readers that mmap() the ring. 'head' and 'w_off' count the bytes ever
+ * written to the log, modulo 2^32, so compare them by their difference:
+ * the entries between them are valid, and the entry at offset 'off' starts
+ * at (off & (size - 1)) in the mapping, in the version 2 format. Entries
+ * may wrap around the end of the mapping. Writers overwrite the oldest
+ * entries without waiting for anyone, so an entry copied out of the
+ * mapping is only intact if a 'head' fetched afterwards has not moved past
+ * its offset.
+ */
+struct logger_offsets {
+	__u32		head;	/* oldest entry still in the log */
+	__u32		w_off;	/* end of the newest entry */
+	__u32		size;	/* size of the ring */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +83,7 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH		_IO(__LOGGERIO, 7) /* batched read() */
+#define LOGGER_GET_OFFSETS		_IOR(__LOGGERIO, 8, struct logger_offsets)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,21 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * To keep the shrinker cheap, processes are kept in one list per oom_adj
+ * value, largest first. A process moves between lists when its oom_adj is
+ * written, and all sizes are refreshed every rescan_ms milliseconds (0 stops
+ * the refresh; an idle CPU is not woken up for it), so picking a victim does
+ * not need to walk every process.
+ *
+ * /dev/lowmem_pressure reports how hard reclaim is working, as one of "none",
+ * "low", "medium" or "critical", judged from the share of scanned pages that
+ * reclaim manages to free and from how fast free and file memory shrink.
+ * poll() on it returns when the level has changed since the file was last
+ * read, and read() returns end of file until then. With proactive_kill set,
+ * the driver also kills a process from the least important adj band as soon
+ * as the level turns critical, rather than waiting for free memory to drop
+ * below the minfree thresholds.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -34,12 +49,19 @@
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/pid.h>
 #include <linux/notifier.h>
 #include <linux/fs.h>
 #include <linux/swap.h>
 #include <linux/kobject.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
 
 static uint32_t lowmem_debug_level = 5;
 static int lowmem_adj[6] = {
@@ -64,6 +86,74 @@ static unsigned long lowmem_deathpending_timeout;
 
 static struct kobject *lowmem_kobj;
 
+static unsigned int lowmem_rescan_ms = 1000;
+
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	7
+
+/*
+ * struct lowmem_task - a process known to the low memory killer
+ *
+ * Entries don't hold a reference on the task, which is only used as the
+ * hash key and never dereferenced; they are dropped from the task_free
+ * notifier. The task is reached through 'pid' instead, which does hold a
+ * reference. Everything here is protected by lowmem_lock.
+ */
+struct lowmem_task {
+	struct hlist_node	hnode;		/* in lowmem_task_hash */
+	struct list_head	list;		/* in lowmem_buckets, largest first */
+	struct task_struct	*task;		/* the thread group leader */
+	struct pid		*pid;		/* and its pid */
+	int			oom_adj;	/* bucket we are in */
+	int			tasksize;	/* pages, as of the last update */
+};
+
+static DEFINE_SPINLOCK(lowmem_lock);
+static struct list_head lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+
+static void lowmem_rescan(struct work_struct *work);
+static DECLARE_DEFERRED_WORK(lowmem_rescan_work, lowmem_rescan);
+
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_NONE,
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	[LOWMEM_PRESSURE_NONE]		= "none",
+	[LOWMEM_PRESSURE_LOW]		= "low",
+	[LOWMEM_PRESSURE_MEDIUM]	= "medium",
+	[LOWMEM_PRESSURE_CRITICAL]	= "critical",
+};
+
+/* reclaim efficiency, in percent, below which pressure is medium/critical */
+static unsigned int lowmem_pressure_medium = 60;
+static unsigned int lowmem_pressure_critical = 25;
+static bool lowmem_proactive_kill;
+
+#define LOWMEM_PRESSURE_WINDOW	(HZ / 10)
+
+/*
+ * The pressure sampler's state, protected by lowmem_pressure_lock. Readers of
+ * the device only look at lowmem_pressure_level and lowmem_pressure_seq.
+ */
+static DEFINE_MUTEX(lowmem_pressure_lock);
+static unsigned long lowmem_pressure_stamp;
+static unsigned long lowmem_pressure_scanned;
+static unsigned long lowmem_pressure_reclaimed;
+static int lowmem_pressure_avail;
+static enum lowmem_pressure_level lowmem_pressure_level;
+static atomic_t lowmem_pressure_seq = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wq);
+
+static void lowmem_pressure_decay(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_decay);
+static void lowmem_proactive(struct work_struct *work);
+static DECLARE_WORK(lowmem_proactive_work, lowmem_proactive);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -77,17 +167,252 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static int oom_adj_notify_func(struct notifier_block *self,
+			       unsigned long val, void *data);
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static inline struct hlist_head *lowmem_task_head(struct task_struct *task)
+{
+	return &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)];
+}
+
+/* Caller needs to hold lowmem_lock. */
+static struct lowmem_task *lowmem_task_lookup(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(lt, pos, lowmem_task_head(task), hnode) {
+		if (lt->task == task)
+			return lt;
+	}
+	return NULL;
+}
+
+/* Caller needs to hold lowmem_lock. */
+static void lowmem_task_forget(struct task_struct *task)
+{
+	struct lowmem_task *lt = lowmem_task_lookup(task);
+
+	if (!lt)
+		return;
+	hlist_del(&lt->hnode);
+	list_del(&lt->list);
+	put_pid(lt->pid);
+	kfree(lt);
+}
+
+/*
+ * lowmem_task_update - files the process led by 'task' under 'oom_adj',
+ * sorted by 'tasksize', or forgets about it if there is nothing to gain
+ * from killing it.
+ *
+ * Caller needs to hold lowmem_lock.
+ */
+static void lowmem_task_update(struct task_struct *task, int oom_adj,
+			       int tasksize)
+{
+	struct lowmem_task *lt = lowmem_task_lookup(task);
+	struct list_head *bucket;
+	struct lowmem_task *pos;
+
+	if (tasksize <= 0 || oom_adj < OOM_DISABLE || oom_adj > OOM_ADJUST_MAX) {
+		lowmem_task_forget(task);
+		return;
+	}
+
+	if (lt) {
+		if (lt->oom_adj == oom_adj && lt->tasksize == tasksize)
+			return;
+		list_del(&lt->list);
+	} else {
+		lt = kmalloc(sizeof(*lt), GFP_ATOMIC);
+		if (!lt)
+			return;	/* the next rescan will try again */
+		/* no pid once the task has been released */
+		lt->pid = get_pid(task_pid(task));
+		if (!lt->pid) {
+			kfree(lt);
+			return;
+		}
+		lt->task = task;
+		hlist_add_head(&lt->hnode, lowmem_task_head(task));
+	}
+	lt->oom_adj = oom_adj;
+	lt->tasksize = tasksize;
+
+	bucket = &lowmem_buckets[oom_adj - OOM_DISABLE];
+	list_for_each_entry(pos, bucket, list) {
+		if (pos->tasksize < tasksize)
+			break;
+	}
+	list_add_tail(&lt->list, &pos->list);
+}
+
+/* Caller needs to hold task_lock(p). */
+static int lowmem_task_size(struct task_struct *p)
+{
+	struct mm_struct *mm = p->mm;
+	int mm_rss, mm_counter;
+
+	if (!mm)
+		return 0;
+
+	mm_rss = get_mm_rss(mm);
+	mm_counter = get_mm_counter(mm, MM_SWAPENTS);
+#ifdef CONFIG_ZRAM
+	return mm_rss + mm_counter;
+#else
+	return mm_rss;
+#endif
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
 
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
 
+	/* not only leaders: exec() may have handed leadership over */
+	spin_lock_irqsave(&lowmem_lock, flags);
+	lowmem_task_forget(task);
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+
 	return NOTIFY_OK;
 }
 
+/* Called with task_lock(task) held, see oom_adj_changed(). */
+static int oom_adj_notify_func(struct notifier_block *self,
+			       unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	lowmem_task_update(task->group_leader, (int)val,
+			   lowmem_task_size(task));
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+
+	return NOTIFY_OK;
+}
+
+/*
+ * lowmem_rescan - refreshes the size and oom_adj of every process, and picks
+ * up the ones that were forked since and never had their oom_adj written.
+ */
+static void lowmem_rescan(struct work_struct *work)
+{
+	struct task_struct *p;
+	unsigned long flags;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		struct signal_struct *sig;
+		int oom_adj = OOM_ADJUST_MAX + 1;
+		int tasksize = 0;
+		struct task_struct *t;
+
+		/* the leader may have exited before the other threads */
+		t = find_lock_task_mm(p);
+		if (t) {
+			sig = t->signal;
+			if (sig) {
+				oom_adj = sig->oom_adj;
+				tasksize = lowmem_task_size(t);
+			}
+			task_unlock(t);
+		}
+
+		spin_lock_irqsave(&lowmem_lock, flags);
+		lowmem_task_update(p, oom_adj, tasksize);
+		spin_unlock_irqrestore(&lowmem_lock, flags);
+	}
+	rcu_read_unlock();
+
+	if (lowmem_rescan_ms)
+		schedule_delayed_work(&lowmem_rescan_work,
+				      msecs_to_jiffies(lowmem_rescan_ms));
+}
+
+/*
+ * lowmem_select - returns the largest process with the highest oom_adj that
+ * is at least 'min_adj', with a reference held, or NULL. The entries it
+ * finds out of date on the way are fixed up.
+ *
+ * The task is looked up through the entry's pid rather than its task
+ * pointer: the task_free notifier only runs once the task is already being
+ * torn down, too late to take a new reference on it.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj,
+					 int *tasksize)
+{
+	struct task_struct *p, *t, *key;
+	struct lowmem_task *lt;
+	unsigned long flags;
+	int adj;
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+retry:
+	p = NULL;
+	spin_lock_irqsave(&lowmem_lock, flags);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj; adj--) {
+		struct list_head *bucket = &lowmem_buckets[adj - OOM_DISABLE];
+
+		if (list_empty(bucket))
+			continue;
+		lt = list_first_entry(bucket, struct lowmem_task, list);
+		key = lt->task;
+		p = get_pid_task(lt->pid, PIDTYPE_PID);
+		if (!p) {
+			/* already released, the notifier is on its way */
+			lowmem_task_forget(key);
+			spin_unlock_irqrestore(&lowmem_lock, flags);
+			goto retry;
+		}
+		break;
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+
+	if (!p)
+		return NULL;
+
+	*oom_adj = OOM_ADJUST_MAX + 1;
+	*tasksize = 0;
+	t = find_lock_task_mm(p);
+	if (t) {
+		if (t->signal) {
+			*oom_adj = t->signal->oom_adj;
+			*tasksize = lowmem_task_size(t);
+		}
+		task_unlock(t);
+	}
+
+	/* p != key if a thread exec()ed and took over the leader's pid */
+	if (*oom_adj != adj || *tasksize <= 0 || p != key) {
+		lowmem_print(2, "lowmem_shrink %d (%s) went stale, adj %d\n",
+			     p->pid, p->comm, *oom_adj);
+		spin_lock_irqsave(&lowmem_lock, flags);
+		lowmem_task_forget(key);
+		if (*tasksize > 0)
+			lowmem_task_update(p, *oom_adj, *tasksize);
+		spin_unlock_irqrestore(&lowmem_lock, flags);
+		put_task_struct(p);
+		goto retry;
+	}
+
+	lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		     p->pid, p->comm, *oom_adj, *tasksize);
+	return p;
+}
+
 static void lowmem_notify_killzone_approach(void);
 
 static inline void get_free_ram(int *p_other_free, int *p_other_file)
@@ -114,21 +439,170 @@ static inline void get_free_ram(int *p_other_free, int *p_other_file)
 }
 
 
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/*
+ * lowmem_kill - kills the largest process with the highest oom_adj that is
+ * at least 'min_adj', and returns its size in pages, or 0 if there was none
+ */
+static int lowmem_kill(int min_adj)
+{
+	struct task_struct *selected;
+	int selected_tasksize = 0;
+	int selected_oom_adj;
+
+	selected = lowmem_select(min_adj, &selected_oom_adj,
+				 &selected_tasksize);
+	if (!selected)
+		return 0;
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, selected_tasksize);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	force_sig(SIGKILL, selected);
+	put_task_struct(selected);
+
+	return selected_tasksize;
+}
+
+static void lowmem_pressure_set(enum lowmem_pressure_level level)
+{
+	if (level == lowmem_pressure_level)
+		return;
+
+	lowmem_print(3, "lowmem_shrink pressure %s -> %s\n",
+		     lowmem_pressure_names[lowmem_pressure_level],
+		     lowmem_pressure_names[level]);
+	lowmem_pressure_level = level;
+	smp_wmb();
+	atomic_inc(&lowmem_pressure_seq);
+	wake_up_interruptible(&lowmem_pressure_wq);
+
+	if (level == LOWMEM_PRESSURE_CRITICAL && lowmem_proactive_kill)
+		schedule_work(&lowmem_proactive_work);
+}
+
+/*
+ * Sums a vm event over the online cpus without all_vm_events(), which takes
+ * the cpu hotplug lock: this runs from reclaim, and a hotplug writer may be
+ * waiting on reclaim.  A cpu going offline folds its events into another.
+ */
+static unsigned long lowmem_vm_event(enum vm_event_item item)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		sum += per_cpu(vm_event_states, cpu).event[item];
+	return sum;
+}
+
+/*
+ * lowmem_pressure_sample - recomputes the pressure level, at most once per
+ * LOWMEM_PRESSURE_WINDOW, from what reclaim achieved since the last sample
+ * and from how much free and file memory is left
+ */
+static void lowmem_pressure_sample(int other_free, int other_file)
+{
+	enum lowmem_pressure_level level = LOWMEM_PRESSURE_NONE;
+	unsigned long scanned = 0, reclaimed = 0;
+	int avail = other_free + other_file;
+	int array_size;
+	int zone;
+
+	if (time_before(jiffies, lowmem_pressure_stamp + LOWMEM_PRESSURE_WINDOW))
+		return;
+	/* one sampler at a time, the others keep the current level */
+	if (!mutex_trylock(&lowmem_pressure_lock))
+		return;
+	lowmem_pressure_stamp = jiffies;
+
+	for (zone = 0; zone < MAX_NR_ZONES; zone++) {
+		scanned += lowmem_vm_event(PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + zone) +
+			lowmem_vm_event(PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + zone);
+		reclaimed += lowmem_vm_event(PGSTEAL_NORMAL - ZONE_NORMAL + zone);
+	}
+
+	if (scanned != lowmem_pressure_scanned) {
+		unsigned long delta = scanned - lowmem_pressure_scanned;
+		unsigned long efficiency;
+
+		efficiency = (reclaimed - lowmem_pressure_reclaimed) * 100 / delta;
+		if (efficiency < lowmem_pressure_critical)
+			level = LOWMEM_PRESSURE_CRITICAL;
+		else if (efficiency < lowmem_pressure_medium)
+			level = LOWMEM_PRESSURE_MEDIUM;
+		else
+			level = LOWMEM_PRESSURE_LOW;
+	}
+
+	/* still falling and already within the minfree bands? */
+	array_size = lowmem_array_size();
+	if (array_size && avail < lowmem_pressure_avail) {
+		if (other_free < lowmem_minfree[0] &&
+		    other_file < lowmem_minfree[0])
+			level = LOWMEM_PRESSURE_CRITICAL;
+		else if (level < LOWMEM_PRESSURE_MEDIUM &&
+			 other_free < lowmem_minfree[array_size - 1] &&
+			 other_file < lowmem_minfree[array_size - 1])
+			level = LOWMEM_PRESSURE_MEDIUM;
+	}
+
+	lowmem_pressure_scanned = scanned;
+	lowmem_pressure_reclaimed = reclaimed;
+	lowmem_pressure_avail = avail;
+	lowmem_pressure_set(level);
+	if (level != LOWMEM_PRESSURE_NONE)
+		schedule_delayed_work(&lowmem_pressure_work, HZ);
+
+	mutex_unlock(&lowmem_pressure_lock);
+}
+
+/*
+ * The shrinker only runs while the system reclaims, so this brings the level
+ * back down once reclaim has stopped.
+ */
+static void lowmem_pressure_decay(struct work_struct *work)
+{
+	int other_free, other_file;
+
+	get_free_ram(&other_free, &other_file);
+	lowmem_pressure_sample(other_free, other_file);
+}
+
+static void lowmem_proactive(struct work_struct *work)
+{
+	int array_size = lowmem_array_size();
+
+	if (!lowmem_proactive_kill || !array_size)
+		return;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return;
+
+	lowmem_print(2, "lowmem_shrink proactive kill at critical pressure\n");
+	lowmem_kill(lowmem_adj[array_size - 1]);
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int array_size;
 	int other_free = 0;
 	int other_file = 0;
- 	int mm_rss = 0;
-	int mm_counter = 0;
 
 	/*
 	 * If we already have a death outstanding, then
@@ -148,10 +622,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_notify_killzone_approach();
 	}
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
+	lowmem_pressure_sample(other_free, other_file);
+
+	array_size = lowmem_array_size();
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -172,64 +645,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
-
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-
- 		mm_rss = get_mm_rss(mm);
-		mm_counter = get_mm_counter(mm, MM_SWAPENTS);		
-		lowmem_print(2, "lowmem_shrink mm_rss %d , mm_counter %d\n", mm_rss, mm_counter);			    
-#ifdef CONFIG_ZRAM
-		tasksize = mm_rss + mm_counter;
-#else		
-		tasksize = get_mm_rss(mm);
-#endif
-
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj);
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -284,6 +702,83 @@ static struct kobj_type lowmem_kobj_type = {
 };
 
 
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)
+		(atomic_read(&lowmem_pressure_seq) - 1);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	char level[16];
+	int seq = atomic_read(&lowmem_pressure_seq);
+	int len;
+
+	/* each level is read once, then EOF until it changes again */
+	if (seq == (int)(unsigned long)file->private_data)
+		return 0;
+
+	smp_rmb();
+	len = snprintf(level, sizeof(level), "%s\n",
+		       lowmem_pressure_names[lowmem_pressure_level]);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, level, len))
+		return -EFAULT;
+
+	file->private_data = (void *)(unsigned long)seq;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	int seen = (unsigned long)file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wq, wait);
+
+	if (atomic_read(&lowmem_pressure_seq) != seen)
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
+static void lowmem_forget_all(void)
+{
+	struct lowmem_task *lt, *tmp;
+	unsigned long flags;
+	int i;
+
+	unregister_oom_adj_notifier(&oom_adj_nb);
+	lowmem_rescan_ms = 0;
+	cancel_delayed_work_sync(&lowmem_rescan_work);
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++) {
+		list_for_each_entry_safe(lt, tmp, &lowmem_buckets[i], list) {
+			hlist_del(&lt->hnode);
+			list_del(&lt->list);
+			put_pid(lt->pid);
+			kfree(lt);
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+}
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -292,7 +787,14 @@ static struct shrinker lowmem_shrinker = {
 static int __init lowmem_init(void)
 {
 	int rc;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+	schedule_delayed_work(&lowmem_rescan_work, 0);
 	register_shrinker(&lowmem_shrinker);
 
 	lowmem_kobj = kzalloc(sizeof(*lowmem_kobj), GFP_KERNEL);
@@ -306,13 +808,23 @@ static int __init lowmem_init(void)
 	if (rc)
 		goto err_kobj;
 
+	rc = misc_register(&lowmem_pressure_misc);
+	if (rc)
+		goto err_misc;
+
 	return 0;
 
+err_misc:
+	kobject_put(lowmem_kobj);
 err_kobj:
 	kfree(lowmem_kobj);
 
 err:
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	lowmem_proactive_kill = false;
+	cancel_work_sync(&lowmem_proactive_work);
+	lowmem_forget_all();
 	task_free_unregister(&task_nb);
 
 	return rc;
@@ -320,18 +832,48 @@ err:
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_pressure_misc);
 	kobject_put(lowmem_kobj);
 	kfree(lowmem_kobj);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	lowmem_proactive_kill = false;
+	cancel_work_sync(&lowmem_proactive_work);
+	lowmem_forget_all();
 	task_free_unregister(&task_nb);
 }
 
+/* the rescan stops re-arming at 0, so it is restarted when that ends */
+static int lowmem_rescan_ms_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int old = lowmem_rescan_ms;
+	int ret;
+
+	ret = param_set_uint(val, kp);
+	if (!ret && !old && lowmem_rescan_ms && keventd_up())
+		schedule_delayed_work(&lowmem_rescan_work, 0);
+	return ret;
+}
+
+static struct kernel_param_ops lowmem_rescan_ms_ops = {
+	.set = lowmem_rescan_ms_set,
+	.get = param_get_uint,
+};
+
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(rescan_ms, &lowmem_rescan_ms_ops, &lowmem_rescan_ms,
+		S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+			 S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+			 S_IRUGO | S_IWUSR);
+module_param_named(proactive_kill, lowmem_proactive_kill, bool,
+			 S_IRUGO | S_IWUSR);
 module_param_named(notify_trigger, lowmem_minfree_notif_trigger, uint,
 			 S_IRUGO | S_IWUSR);
 module_init(lowmem_init);
@@ -0,0 +1,254 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/lzo.h>
+#ifdef CONFIG_ZRAM_DEFLATE
+#include <linux/zlib.h>
+#endif
+
+#include "zram_comp.h"
+
+/*-- LZO: fast, the default */
+
+static void *zram_lzo_create(void)
+{
+	return kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+}
+
+static void zram_lzo_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	int ret;
+
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, private);
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	int ret;
+	size_t dst_len = PAGE_SIZE;
+
+	ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+	if (ret != LZO_E_OK)
+		return ret;
+
+	return dst_len == PAGE_SIZE ? 0 : -EINVAL;
+}
+
+static const struct zram_backend zram_lzo = {
+	.name		= "lzo",
+	.create		= zram_lzo_create,
+	.destroy	= zram_lzo_destroy,
+	.compress	= zram_lzo_compress,
+	.decompress	= zram_lzo_decompress,
+};
+
+#ifdef CONFIG_ZRAM_DEFLATE
+/*-- deflate level 1: slower, better ratio */
+
+/* raw deflate, a window of one page is all a page can use */
+#define ZRAM_DEFLATE_LEVEL	1
+#define ZRAM_DEFLATE_WINBITS	PAGE_SHIFT
+#define ZRAM_DEFLATE_MEMLEVEL	8
+
+static void *zram_deflate_create(void)
+{
+	struct z_stream_s *stream;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return NULL;
+
+	stream->workspace = vzalloc(zlib_deflate_workspacesize(
+				-ZRAM_DEFLATE_WINBITS, ZRAM_DEFLATE_MEMLEVEL));
+	if (!stream->workspace)
+		goto free_stream;
+
+	if (zlib_deflateInit2(stream, ZRAM_DEFLATE_LEVEL, Z_DEFLATED,
+			-ZRAM_DEFLATE_WINBITS, ZRAM_DEFLATE_MEMLEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		goto free_workspace;
+
+	return stream;
+
+free_workspace:
+	vfree(stream->workspace);
+free_stream:
+	kfree(stream);
+	return NULL;
+}
+
+static void zram_deflate_destroy(void *private)
+{
+	struct z_stream_s *stream = private;
+
+	if (!stream)
+		return;
+
+	zlib_deflateEnd(stream);
+	vfree(stream->workspace);
+	kfree(stream);
+}
+
+static int zram_deflate_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	int ret;
+	struct z_stream_s *stream = private;
+
+	ret = zlib_deflateReset(stream);
+	if (ret != Z_OK)
+		return ret;
+
+	stream->next_in = src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	/* the stream buffer is two pages */
+	stream->avail_out = 2 * PAGE_SIZE;
+
+	ret = zlib_deflate(stream, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return ret == Z_OK ? -ENOSPC : ret;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static void *zram_inflate_create(void)
+{
+	struct z_stream_s *stream;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return NULL;
+
+	stream->workspace = vzalloc(zlib_inflate_workspacesize());
+	if (!stream->workspace)
+		goto free_stream;
+
+	if (zlib_inflateInit2(stream, -ZRAM_DEFLATE_WINBITS) != Z_OK)
+		goto free_workspace;
+
+	return stream;
+
+free_workspace:
+	vfree(stream->workspace);
+free_stream:
+	kfree(stream);
+	return NULL;
+}
+
+static void zram_inflate_destroy(void *private)
+{
+	struct z_stream_s *stream = private;
+
+	if (!stream)
+		return;
+
+	zlib_inflateEnd(stream);
+	vfree(stream->workspace);
+	kfree(stream);
+}
+
+static int zram_inflate_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	int ret;
+	struct z_stream_s *stream = private;
+
+	ret = zlib_inflateReset(stream);
+	if (ret != Z_OK)
+		return ret;
+
+	stream->next_in = src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_SYNC_FLUSH);
+	/* raw inflate may want an extra byte to see the end, as in crypto */
+	if (ret == Z_OK && !stream->avail_in && stream->avail_out) {
+		u8 zerostuff = 0;
+		stream->next_in = &zerostuff;
+		stream->avail_in = 1;
+		ret = zlib_inflate(stream, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END)
+		return ret == Z_OK ? -EINVAL : ret;
+
+	return stream->total_out == PAGE_SIZE ? 0 : -EINVAL;
+}
+
+static const struct zram_backend zram_deflate = {
+	.name		= "deflate",
+	.create		= zram_deflate_create,
+	.destroy	= zram_deflate_destroy,
+	.compress	= zram_deflate_compress,
+	.create_decomp	= zram_inflate_create,
+	.destroy_decomp	= zram_inflate_destroy,
+	.decompress	= zram_inflate_decompress,
+};
+#endif /* CONFIG_ZRAM_DEFLATE */
+
+static const struct zram_backend *backends[] = {
+	&zram_lzo,
+#ifdef CONFIG_ZRAM_DEFLATE
+	&zram_deflate,
+#endif
+	NULL
+};
+
+const struct zram_backend *zram_default_backend = &zram_lzo;
+
+const struct zram_backend *zram_find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(name, backends[i]->name))
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+/* list the backends, the one in use in brackets */
+ssize_t zram_show_backends(const struct zram_backend *cur, char *buf)
+{
+	int i;
+	ssize_t len = 0;
+
+	for (i = 0; backends[i]; i++) {
+		if (backends[i] == cur)
+			len += sprintf(buf + len, "[%s] ", backends[i]->name);
+		else
+			len += sprintf(buf + len, "%s ", backends[i]->name);
+	}
+	len += sprintf(buf + len, "\n");
+
+	return len;
+}
@@ -0,0 +1,45 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/types.h>
+
+/*
+ * A compressor backend. Compression runs in process context on the
+ * private state of a stream. Decompression runs with preemption
+ * disabled on a per-CPU state, which is NULL if the backend has no
+ * create_decomp. Both return 0 on success.
+ */
+struct zram_backend {
+	const char *name;
+
+	void *(*create)(void);
+	void (*destroy)(void *private);
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	void *(*create_decomp)(void);
+	void (*destroy_decomp)(void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+};
+
+extern const struct zram_backend *zram_default_backend;
+
+const struct zram_backend *zram_find_backend(const char *name);
+ssize_t zram_show_backends(const struct zram_backend *cur, char *buf);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+/*
+ * Identical pages compress to identical bytes with a given compressor,
+ * so a stored object can be shared by comparing compressed data only.
+ * All the objects are in a per-device rbtree keyed by checksum,
+ * protected by dedup_lock.
+ */
+
+static struct kmem_cache *zram_dedup_cache;
+
+int zram_dedup_cache_create(void)
+{
+	zram_dedup_cache = kmem_cache_create("zram_dedup",
+				sizeof(struct zram_dedup), 0, 0, NULL);
+	return zram_dedup_cache ? 0 : -ENOMEM;
+}
+
+void zram_dedup_cache_destroy(void)
+{
+	kmem_cache_destroy(zram_dedup_cache);
+}
+
+u32 zram_dedup_checksum(const unsigned char *src, size_t len)
+{
+	return jhash(src, len, 0);
+}
+
+struct zram_dedup *zram_dedup_alloc(u32 checksum, gfp_t flags)
+{
+	struct zram_dedup *dedup;
+
+	dedup = kmem_cache_alloc(zram_dedup_cache, flags);
+	if (!dedup)
+		return NULL;
+
+	RB_CLEAR_NODE(&dedup->node);
+	dedup->checksum = checksum;
+	dedup->refcount = 1;
+	dedup->handle = 0;
+	dedup->size = 0;
+
+	return dedup;
+}
+
+void zram_dedup_free(struct zram_dedup *dedup)
+{
+	kmem_cache_free(zram_dedup_cache, dedup);
+}
+
+static int zram_dedup_match(struct zram *zram, struct zram_dedup *dedup,
+			const unsigned char *src, size_t len)
+{
+	int match;
+	unsigned char *cmem;
+
+	if (dedup->size != len)
+		return 0;
+
+	cmem = zs_map_object(zram->mem_pool, dedup->handle, ZS_MM_RO);
+	match = !memcmp(cmem + sizeof(struct zobj_header), src, len);
+	zs_unmap_object(zram->mem_pool, dedup->handle);
+
+	return match;
+}
+
+/*
+ * Find an object with the same compressed data and take a reference,
+ * returns NULL if there's none.
+ */
+struct zram_dedup *zram_dedup_get(struct zram *zram,
+			const unsigned char *src, size_t len, u32 checksum)
+{
+	struct rb_node *node;
+	struct zram_dedup *dedup, *found = NULL;
+
+	spin_lock(&zram->dedup_lock);
+
+	node = zram->dedup_tree.rb_node;
+	while (node) {
+		dedup = rb_entry(node, struct zram_dedup, node);
+		if (checksum < dedup->checksum) {
+			node = node->rb_left;
+		} else if (checksum > dedup->checksum) {
+			node = node->rb_right;
+		} else {
+			break;
+		}
+	}
+
+	/* walk all the objects with this checksum */
+	if (node) {
+		while (rb_prev(node) && rb_entry(rb_prev(node),
+				struct zram_dedup, node)->checksum == checksum)
+			node = rb_prev(node);
+
+		for (; node; node = rb_next(node)) {
+			dedup = rb_entry(node, struct zram_dedup, node);
+			if (dedup->checksum != checksum)
+				break;
+			if (zram_dedup_match(zram, dedup, src, len)) {
+				dedup->refcount++;
+				found = dedup;
+				break;
+			}
+		}
+	}
+
+	spin_unlock(&zram->dedup_lock);
+
+	return found;
+}
+
+/* add a new object, its handle and size are set */
+void zram_dedup_insert(struct zram *zram, struct zram_dedup *dedup)
+{
+	struct rb_node **link, *parent = NULL;
+	struct zram_dedup *entry;
+
+	spin_lock(&zram->dedup_lock);
+
+	link = &zram->dedup_tree.rb_node;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct zram_dedup, node);
+		if (dedup->checksum < entry->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&dedup->node, parent, link);
+	rb_insert_color(&dedup->node, &zram->dedup_tree);
+
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference, returns the references left. The object must be
+ * freed by the caller when none is left.
+ */
+u32 zram_dedup_put(struct zram *zram, struct zram_dedup *dedup)
+{
+	u32 refcount;
+
+	spin_lock(&zram->dedup_lock);
+	refcount = --dedup->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&dedup->node))
+		rb_erase(&dedup->node, &zram->dedup_tree);
+	spin_unlock(&zram->dedup_lock);
+
+	if (!refcount)
+		zram_dedup_free(dedup);
+
+	return refcount;
+}
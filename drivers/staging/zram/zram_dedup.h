@@ -0,0 +1,48 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/types.h>
+#include <linux/rbtree.h>
+
+struct zram;
+
+/*
+ * One for each stored compressed object, shared by all the table
+ * entries whose pages compressed to the same bytes. The object header
+ * points back to it.
+ */
+struct zram_dedup {
+	struct rb_node node;
+	u32 checksum;		/* of the compressed data */
+	u32 refcount;		/* table entries using the object */
+	unsigned long handle;
+	u16 size;		/* compressed size, without header */
+};
+
+int zram_dedup_cache_create(void);
+void zram_dedup_cache_destroy(void);
+
+u32 zram_dedup_checksum(const unsigned char *src, size_t len);
+struct zram_dedup *zram_dedup_alloc(u32 checksum, gfp_t flags);
+void zram_dedup_free(struct zram_dedup *dedup);
+
+struct zram_dedup *zram_dedup_get(struct zram *zram,
+			const unsigned char *src, size_t len, u32 checksum);
+void zram_dedup_insert(struct zram *zram, struct zram_dedup *dedup);
+u32 zram_dedup_put(struct zram *zram, struct zram_dedup *dedup);
+
+#endif
@@ -29,9 +29,13 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#ifdef CONFIG_ZRAM_WRITEBACK
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/workqueue.h>
+#endif /* CONFIG_ZRAM_WRITEBACK */
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 #include <linux/swap.h>
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
@@ -92,6 +96,24 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Seconds since boot, for the page idle ages */
+static u32 zram_now(void)
+{
+	return (u32)div_u64(get_jiffies_64(), HZ);
+}
+
+/* called with tb_lock held, a racing update of the same page is harmless */
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+}
+#else
+static inline void zram_touch(struct zram *zram, u32 index)
+{
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -107,6 +129,80 @@ static int page_zero_filled(void *ptr)
 	return 1;
 }
 
+static struct zram_stream *zram_get_stream(struct zram *zram)
+{
+	struct zram_stream *stream;
+
+	/* any stream would do, the local one is most likely idle */
+	stream = &zram->streams[raw_smp_processor_id()];
+	mutex_lock(&stream->lock);
+
+	return stream;
+}
+
+static void zram_put_stream(struct zram_stream *stream)
+{
+	mutex_unlock(&stream->lock);
+}
+
+static void zram_destroy_streams(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		if (zram->streams[cpu].private)
+			zram->backend->destroy(zram->streams[cpu].private);
+		free_pages((unsigned long)zram->streams[cpu].buffer, 1);
+		if (zram->dstates && zram->dstates[cpu])
+			zram->backend->destroy_decomp(zram->dstates[cpu]);
+	}
+
+	kfree(zram->streams);
+	zram->streams = NULL;
+	kfree(zram->dstates);
+	zram->dstates = NULL;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	int cpu;
+	struct zram_stream *stream;
+
+	zram->streams = kzalloc(nr_cpu_ids * sizeof(*zram->streams),
+				GFP_KERNEL);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	if (zram->backend->create_decomp) {
+		zram->dstates = kzalloc(nr_cpu_ids * sizeof(void *),
+					GFP_KERNEL);
+		if (!zram->dstates)
+			return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		stream = &zram->streams[cpu];
+		mutex_init(&stream->lock);
+
+		stream->private = zram->backend->create();
+		/* output may exceed PAGE_SIZE for incompressible data */
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->private || !stream->buffer)
+			return -ENOMEM;
+
+		if (zram->dstates) {
+			zram->dstates[cpu] = zram->backend->create_decomp();
+			if (!zram->dstates[cpu])
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -152,15 +248,29 @@ static void setup_swap_header(struct zram *zram, union swap_header *s)
 }
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
+/* called with tb_lock held for write */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
 	void *obj;
+	struct zram_dedup *dedup;
+
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Tells a writeback in flight that the page changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		clear_bit(handle, zram->bitmap);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].handle = 0;
+		return;
+	}
+#endif
+
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -172,28 +282,37 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	clen = zram->table[index].size;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		zs_free(zram->mem_pool, handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	obj = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	dedup = ((struct zobj_header *)obj)->dedup;
+	zs_unmap_object(zram->mem_pool, handle);
 
-	xv_free(zram->mem_pool, page, offset);
+	/* Other pages still use the object, only drop our reference */
+	if (dedup && zram_dedup_put(zram, dedup)) {
+		zram_stat_dec(&zram->stats.pages_deduped);
+		zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+		goto out_shared;
+	}
+
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+out_shared:
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -210,46 +329,393 @@ static void handle_zero_page(struct page *page)
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
+	unsigned long handle = zram->table[index].handle;
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
+	zs_unmap_object(zram->mem_pool, handle);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	flush_dcache_page(page);
 }
 
+/* called with tb_lock held, the page must be stored in memory */
+static int zram_decompress_page(struct zram *zram, struct page *page,
+				u32 index)
+{
+	int ret;
+	unsigned long handle;
+	struct zobj_header *zheader;
+	unsigned char *user_mem, *cmem;
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	handle = zram->table[index].handle;
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+
+	/* preemption is off under tb_lock, the cpu state is ours */
+	ret = zram->backend->decompress(
+		cmem + sizeof(*zheader), zram->table[index].size,
+		user_mem, zram->dstates ?
+			zram->dstates[smp_processor_id()] : NULL);
+
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Writeback moves pages that are not worth their memory to a backing
+ * block device: incompressible ones soon after they are stored, and
+ * any page not accessed for wb_idle_age seconds. The table entry then
+ * holds the block number, block 0 is never used. Reads of such pages
+ * are passed on to the backing device.
+ */
+
+static const fmode_t zram_bd_mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+
+/* called with init_lock held */
+void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, zram_bd_mode);
+	vfree(zram->bitmap);
+	kfree(zram->backing_dev);
+
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	zram->backing_dev = NULL;
+}
+
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	char *name;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_reset_bdev(zram);
+	if (!strcmp(name, "none"))
+		goto out;
+
+	bdev = blkdev_get_by_path(name, zram_bd_mode, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	/* block 0 is never used */
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_blocks < 2) {
+		blkdev_put(bdev, zram_bd_mode);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		blkdev_put(bdev, zram_bd_mode);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_blocks = nr_blocks;
+	zram->backing_dev = name;
+	name = NULL;
+
+	pr_info("%s: backing device %s, %lu pages\n",
+		zram->disk->disk_name, zram->backing_dev, nr_blocks);
+
+out:
+	mutex_unlock(&zram->init_lock);
+	kfree(name);
+	return ret;
+}
+
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block = 1;
+
+	do {
+		block = find_next_zero_bit(zram->bitmap, zram->nr_blocks,
+					block);
+		if (block >= zram->nr_blocks)
+			return 0;
+	} while (test_and_set_bit(block, zram->bitmap));
+
+	return block;
+}
+
+static void zram_bd_write_end(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bd_write(struct zram *zram, struct page *page,
+			unsigned long block)
+{
+	int ret = 0;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_write_end;
+	bio->bi_private = &done;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	zram_stat64_inc(zram, &zram->stats.bd_writes);
+	return ret;
+}
+
+/*
+ * A bio with written back pages ends when the last of its reads from
+ * the backing device does. We are called from make_request, so these
+ * only start once we return and can't be waited for.
+ */
+struct zram_bd_read {
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
+
+static void zram_bd_read_put(struct zram_bd_read *rd)
+{
+	if (!atomic_dec_and_test(&rd->pending))
+		return;
+
+	if (rd->error) {
+		bio_io_error(rd->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &rd->parent->bi_flags);
+		bio_endio(rd->parent, 0);
+	}
+	kfree(rd);
+}
+
+static void zram_bd_read_end(struct bio *bio, int err)
+{
+	struct zram_bd_read *rd = bio->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		rd->error = -EIO;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_bd_read_put(rd);
+}
+
+static int zram_bd_read(struct zram *zram, struct bio *parent,
+			struct zram_bd_read **rdp, struct page *page,
+			unsigned long block)
+{
+	struct bio *bio;
+	struct zram_bd_read *rd = *rdp;
+
+	if (!rd) {
+		rd = kmalloc(sizeof(*rd), GFP_NOIO);
+		if (!rd)
+			return -ENOMEM;
+
+		rd->parent = parent;
+		/* dropped by zram_read() when done with the bio */
+		atomic_set(&rd->pending, 1);
+		rd->error = 0;
+		*rdp = rd;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_read_end;
+	bio->bi_private = rd;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	atomic_inc(&rd->pending);
+	submit_bio(READ, bio);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return 0;
+}
+
+/* called with tb_lock held */
+static int zram_wb_candidate(struct zram *zram, u32 index, int mode,
+			u32 now)
+{
+	if (!zram->table[index].handle ||
+			zram_test_flag(zram, index, ZRAM_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_HUGE) &&
+			zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	return (mode & ZRAM_WB_IDLE) && zram->wb_idle_age &&
+		now - zram->table[index].ac_time >= zram->wb_idle_age;
+}
+
+/*
+ * Write back the pages selected by mode (ZRAM_WB_*), returns how many
+ * were or -ENODEV if the device has no backing device.
+ */
+int zram_writeback(struct zram *zram, int mode)
+{
+	int ret = 0;
+	u32 index, now;
+	unsigned long block;
+	struct page *page;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	/* keeps the table, pool and backing device around */
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	now = zram_now();
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		int err;
+
+		write_lock(&zram->tb_lock);
+		if (!zram_wb_candidate(zram, index, mode, now)) {
+			write_unlock(&zram->tb_lock);
+			continue;
+		}
+		err = zram_decompress_page(zram, page, index);
+		if (!err)
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->tb_lock);
+		if (err)
+			continue;
+
+		block = zram_alloc_block(zram);
+		if (!block || zram_bd_write(zram, page, block)) {
+			if (block)
+				clear_bit(block, zram->bitmap);
+			write_lock(&zram->tb_lock);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(&zram->tb_lock);
+			break;
+		}
+
+		write_lock(&zram->tb_lock);
+		/* Rewritten or freed while we wrote, the copy is stale */
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			write_unlock(&zram->tb_lock);
+			clear_bit(block, zram->bitmap);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram->table[index].handle = block;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_wb);
+		write_unlock(&zram->tb_lock);
+
+		ret++;
+		cond_resched();
+	}
+
+	if (ret)
+		pr_debug("%s: wrote back %d pages\n",
+			zram->disk->disk_name, ret);
+
+out:
+	mutex_unlock(&zram->init_lock);
+	__free_page(page);
+	return ret;
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(to_delayed_work(work),
+					struct zram, wb_work);
+
+	if (zram_writeback(zram, ZRAM_WB_HUGE | ZRAM_WB_IDLE) >= 0 &&
+			zram->wb_idle_age)
+		schedule_delayed_work(&zram->wb_work,
+				zram->wb_idle_age * HZ);
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 static void zram_read(struct zram *zram, struct bio *bio)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct zram_bd_read *rd = NULL;
+#endif
 
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		/* only writers of this very page can hold us up */
+		read_lock(&zram->tb_lock);
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			read_unlock(&zram->tb_lock);
 			handle_zero_page(page);
 			index++;
 			continue;
 		}
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			read_unlock(&zram->tb_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			handle_zero_page(page);
@@ -257,29 +723,26 @@ static void zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Page was written back, read it from the backing device */
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long block = zram->table[index].handle;
+
+			read_unlock(&zram->tb_lock);
+			if (zram_bd_read(zram, bio, &rd, page, block))
+				goto out;
 			index++;
 			continue;
 		}
+#endif
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_decompress_page(zram, page, index);
+		if (likely(!ret))
+			zram_touch(zram, index);
+		read_unlock(&zram->tb_lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -290,11 +753,25 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* the last of us and the backing device reads ends the bio */
+	if (rd) {
+		zram_bd_read_put(rd);
+		return;
+	}
+#endif
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (rd) {
+		rd->error = -EIO;
+		zram_bd_read_put(rd);
+		return;
+	}
+#endif
 	bio_io_error(bio);
 }
 
@@ -309,42 +786,46 @@ static void zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
+		u32 checksum;
 		size_t clen;
+		unsigned long handle;
+		struct zram_stream *stream;
+		struct zram_dedup *dedup = NULL;
 		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		struct page *page;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
+		 * Compress into the stream buffer and copy the result to
+		 * its own object without the table lock. The table entry
+		 * is only switched to the new object at the end, so reads
+		 * and writes of other pages go on in parallel.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		stream = zram_get_stream(zram);
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
+			zram_put_stream(stream);
+
+			write_lock(&zram->tb_lock);
+			zram_free_page(zram, index);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_stat_inc(&zram->stats.pages_zero);
+			write_unlock(&zram->tb_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		ret = zram->backend->compress(user_mem, stream->buffer,
+					&clen, stream->private);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_put_stream(stream);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -356,10 +837,12 @@ static void zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			zram_put_stream(stream);
+			stream = NULL;
+
 			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+			handle = zs_malloc(zram->mem_pool, PAGE_SIZE);
+			if (unlikely(!handle)) {
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -367,52 +850,96 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+		} else {
+			/* Share the object of a page with the same data */
+			checksum = zram_dedup_checksum(stream->buffer, clen);
+			dedup = zram_dedup_get(zram, stream->buffer, clen,
+						checksum);
+			if (dedup) {
+				zram_put_stream(stream);
+
+				write_lock(&zram->tb_lock);
+				zram_free_page(zram, index);
+				zram->table[index].handle = dedup->handle;
+				zram->table[index].size = clen;
+				zram_touch(zram, index);
+				zram_stat64_add(zram, &zram->stats.dedup_saved,
+						clen);
+				zram_stat_inc(&zram->stats.pages_deduped);
+				zram_stat_inc(&zram->stats.pages_stored);
+				write_unlock(&zram->tb_lock);
+				index++;
+				continue;
+			}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+			/* Not fatal, the object just can't be shared */
+			dedup = zram_dedup_alloc(checksum, GFP_NOIO);
+
+			handle = zs_malloc(zram->mem_pool,
+					clen + sizeof(struct zobj_header));
+			if (!handle) {
+				zram_put_stream(stream);
+				if (dedup)
+					zram_dedup_free(dedup);
+				pr_info("Error allocating memory for compressed "
+					"page: %u, size=%zu\n", index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
 
-memstore:
-		zram->table[index].offset = offset;
+			src = stream->buffer;
+		}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		if (clen != PAGE_SIZE) {
 			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
+			zheader->dedup = dedup;
 			cmem += sizeof(*zheader);
 		}
-#endif
 
 		memcpy(cmem, src, clen);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		zs_unmap_object(zram->mem_pool, handle);
+		if (stream)
+			zram_put_stream(stream);
+		else
 			kunmap_atomic(src, KM_USER0);
 
+		/* The object is complete, later writers may share it */
+		if (dedup) {
+			dedup->handle = handle;
+			dedup->size = clen;
+			zram_dedup_insert(zram, dedup);
+		}
+
+		/* System overwrites unused sectors, free the old object */
+		write_lock(&zram->tb_lock);
+		zram_free_page(zram, index);
+
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+		zram_touch(zram, index);
+		if (unlikely(clen == PAGE_SIZE)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		}
+
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->tb_lock);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Don't keep incompressible pages in memory for long */
+		if (unlikely(clen == PAGE_SIZE) && zram->bdev)
+			schedule_delayed_work(&zram->wb_work, HZ);
+#endif
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -476,39 +1003,51 @@ void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* before init_lock, the writeback pass takes it */
+	cancel_delayed_work_sync(&zram->wb_work);
+#endif
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_destroy_streams(zram);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle;
+		void *obj;
+		struct zram_dedup *dedup;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		handle = zram->table[index].handle;
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		/* Shared objects are freed with their last reference */
+		if (likely(!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+			obj = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+			dedup = ((struct zobj_header *)obj)->dedup;
+			zs_unmap_object(zram->mem_pool, handle);
+			if (dedup && zram_dedup_put(zram, dedup))
+				continue;
+		}
+
+		zs_free(zram->mem_pool, handle);
 	}
+	zram->dedup_tree = RB_ROOT;
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_reset_bdev(zram);
+#endif
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -521,7 +1060,7 @@ int zram_init_device(struct zram *zram)
 	int ret;
 	size_t num_pages;
 #ifdef CONFIG_ZRAM_FOR_ANDROID
-	struct page *page;
+	unsigned long handle;
 	union swap_header *swap_header;
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
@@ -534,16 +1073,16 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
+	if (!zram->mem_pool) {
+		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -559,31 +1098,30 @@ int zram_init_device(struct zram *zram)
 	}
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
-	page = alloc_page(__GFP_ZERO);
-	if (!page) {
+	handle = zs_malloc(zram->mem_pool, PAGE_SIZE);
+	if (!handle) {
 		pr_err("Error allocating swap header page\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
-	zram->table[0].page = page;
+	zram->table[0].handle = handle;
+	zram->table[0].size = PAGE_SIZE;
 	zram_set_flag(zram, 0, ZRAM_UNCOMPRESSED);
-	swap_header = kmap(page);
+	swap_header = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memset(swap_header, 0, PAGE_SIZE);
 	setup_swap_header(zram, swap_header);
-	kunmap(page);
+	zs_unmap_object(zram->mem_pool, handle);
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
-	if (!zram->mem_pool) {
-		pr_err("Error creating memory pool\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
 	zram->init_done = 1;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bdev && zram->wb_idle_age)
+		schedule_delayed_work(&zram->wb_work, zram->wb_idle_age * HZ);
+#endif
 	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -602,7 +1140,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->tb_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -615,8 +1155,14 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
+	rwlock_init(&zram->tb_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+#endif
+	spin_lock_init(&zram->dedup_lock);
+	zram->dedup_tree = RB_ROOT;
 	mutex_init(&zram->init_lock);
+	zram->backend = zram_default_backend;
 	spin_lock_init(&zram->stat64_lock);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
@@ -677,6 +1223,13 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+	mutex_lock(&zram->init_lock);
+	zram_reset_bdev(zram);
+	mutex_unlock(&zram->init_lock);
+#endif
+
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
 
@@ -700,11 +1253,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_dedup_cache_create();
+	if (ret) {
+		pr_warning("Unable to create dedup cache\n");
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_cache;
 	}
 
 	if (!num_devices) {
@@ -734,6 +1293,8 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_cache:
+	zram_dedup_cache_destroy();
 out:
 	return ret;
 }
@@ -752,6 +1313,7 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	zram_dedup_cache_destroy();
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
@@ -17,8 +17,13 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#ifdef CONFIG_ZRAM_WRITEBACK
+#include <linux/workqueue.h>
+#endif
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -29,13 +34,10 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * The dedup entry tells how many table entries share the object.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	struct zram_dedup *dedup;	/* NULL if not shareable */
 };
 
 /*-- Configurable parameters */
@@ -51,8 +53,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,6 +73,12 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is on the backing device, handle is the block */
+	ZRAM_WB,
+
+	/* Page is being written back */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -78,10 +86,13 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;
+	u16 size;	/* object size, without header */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -96,16 +107,36 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_deduped;	/* no. of pages sharing another's object */
+	u64 dedup_saved;	/* compressed bytes not stored thanks to it */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+};
+
+/*
+ * Compression workspace and buffer, one per possible CPU. Writers take
+ * the stream of the CPU they run on, so writes on different CPUs are
+ * compressed in parallel.
+ */
+struct zram_stream {
+	struct mutex lock;	/* writer may sleep or migrate holding it */
+	void *private;		/* backend compression state */
+	void *buffer;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zram_backend *backend;
+	struct zram_stream *streams;	/* indexed by cpu id */
+	void **dstates;		/* backend decompression state, by cpu id */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats,
+				 * never held while compressing */
+	struct rb_root dedup_tree;	/* stored objects by checksum */
+	spinlock_t dedup_lock;	/* protect dedup_tree and refcounts,
+				 * nests inside tb_lock */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -118,6 +149,14 @@ struct zram {
 	u64 disksize;	/* bytes */
 
 	struct zram_stats stats;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct block_device *bdev;	/* backing device, NULL if none */
+	char *backing_dev;		/* its path */
+	unsigned long *bitmap;		/* blocks in use on it */
+	unsigned long nr_blocks;
+	u32 wb_idle_age;		/* seconds, 0 to keep idle pages */
+	struct delayed_work wb_work;
+#endif
 };
 
 extern struct zram *devices;
@@ -129,4 +168,14 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* zram_writeback() modes */
+#define ZRAM_WB_HUGE	(1 << 0)	/* incompressible pages */
+#define ZRAM_WB_IDLE	(1 << 1)	/* pages idle for wb_idle_age */
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_bdev(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int mode);
+#endif
+
 #endif
@@ -0,0 +1,538 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are served from size classes. Each class carves groups of
+ * pages into equal slots, and users hold handles rather than addresses.
+ * As objects are freed the groups of a class get sparse, compaction
+ * then moves the objects of the emptiest groups into the fullest ones
+ * and frees the emptied pages, updating the handles.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *zs_handle_cache;
+static DEFINE_PER_CPU(struct zs_map_area, zs_map_area);
+
+static u32 get_class_index(size_t size)
+{
+	return DIV_ROUND_UP(size, ZS_SIZE_CLASS_DELTA) - 1;
+}
+
+/*
+ * Use the number of pages per group that leaves the least tail unused,
+ * e.g. three 1.3k objects in one page waste 0.1k, a 2.1k object two.
+ */
+static u32 get_pages_per_group(u32 size)
+{
+	u32 i, bytes, usedpc, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_GROUP; i++) {
+		bytes = i * PAGE_SIZE;
+		usedpc = (bytes - bytes % size) * 100 / bytes;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int obj_is_free(struct zs_group *group, u32 idx)
+{
+	return group->slot[idx] & 1;
+}
+
+static void obj_set_free(struct zs_group *group, u32 idx)
+{
+	group->slot[idx] = ((unsigned long)group->free << 1) | 1;
+	group->free = idx;
+}
+
+/* called with class lock held, the group must have a free object */
+static void obj_alloc(struct zs_class *class, struct zs_group *group,
+			struct zs_handle *handle)
+{
+	u32 idx = group->free;
+
+	group->free = group->slot[idx] >> 1;
+	group->slot[idx] = (unsigned long)handle;
+	handle->group = group;
+	handle->idx = idx;
+
+	class->objs_inuse++;
+	if (++group->inuse == class->objs_per_group)
+		list_move(&group->list, &class->full);
+}
+
+/*
+ * Called with class lock held. Returns 1 if the group is now empty, it
+ * is then off the class lists and must be freed by the caller.
+ */
+static int obj_free(struct zs_class *class, struct zs_group *group, u32 idx)
+{
+	if (group->inuse == class->objs_per_group)
+		list_move(&group->list, &class->partial);
+
+	obj_set_free(group, idx);
+	class->objs_inuse--;
+	if (--group->inuse)
+		return 0;
+
+	list_del(&group->list);
+	class->groups--;
+	return 1;
+}
+
+/* Copy an object out of (write == 0) or into its pages */
+static void obj_copy(struct zs_class *class, struct zs_group *group,
+			u32 idx, char *buf, int write)
+{
+	u32 start, offset, len, done = 0;
+	char *vaddr;
+
+	start = idx * class->size;
+	while (done < class->size) {
+		offset = (start + done) & ~PAGE_MASK;
+		len = min_t(u32, class->size - done, PAGE_SIZE - offset);
+
+		vaddr = kmap_atomic(group->pages[(start + done) >> PAGE_SHIFT],
+					KM_USER1);
+		if (write)
+			memcpy(vaddr + offset, buf + done, len);
+		else
+			memcpy(buf + done, vaddr + offset, len);
+		kunmap_atomic(vaddr, KM_USER1);
+
+		done += len;
+	}
+}
+
+static struct zs_group *alloc_group(struct zs_pool *pool,
+				struct zs_class *class)
+{
+	u32 i;
+	struct zs_group *group;
+
+	group = kzalloc(sizeof(*group) +
+			class->objs_per_group * sizeof(group->slot[0]),
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!group)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_group; i++) {
+		group->pages[i] = alloc_page(pool->flags);
+		if (!group->pages[i])
+			goto fail;
+	}
+
+	group->class = class;
+	group->free = ZS_NO_OBJ;
+	for (i = class->objs_per_group; i; i--)
+		obj_set_free(group, i - 1);
+
+	atomic_long_add(class->pages_per_group, &pool->pages);
+	return group;
+
+fail:
+	while (i)
+		__free_page(group->pages[--i]);
+	kfree(group);
+	return NULL;
+}
+
+static void free_group(struct zs_pool *pool, struct zs_group *group)
+{
+	u32 i;
+
+	for (i = 0; i < group->class->pages_per_group; i++)
+		__free_page(group->pages[i]);
+	atomic_long_sub(group->class->pages_per_group, &pool->pages);
+	kfree(group);
+}
+
+/* Pages that compacting the class would free */
+static unsigned long class_compactable(struct zs_class *class)
+{
+	unsigned long free;
+
+	free = class->groups * class->objs_per_group - class->objs_inuse;
+	return free / class->objs_per_group * class->pages_per_group;
+}
+
+static struct zs_group *find_partial(struct zs_class *class,
+				struct zs_group *skip, int fullest)
+{
+	struct zs_group *group, *found = NULL;
+
+	list_for_each_entry(group, &class->partial, list) {
+		if (group == skip)
+			continue;
+		if (!found || (fullest ? group->inuse > found->inuse :
+					group->inuse < found->inuse))
+			found = group;
+	}
+
+	return found;
+}
+
+/*
+ * Move the objects of the emptiest group of the class to the fullest
+ * ones. Called with migrate_lock held for write and class lock held,
+ * returns the emptied group or NULL if there's nothing to compact.
+ *
+ * There are at least a group's worth of free objects when the class
+ * is compactable, so the others have room for all of the emptiest.
+ */
+static struct zs_group *compact_group(struct zs_pool *pool,
+				struct zs_class *class)
+{
+	u32 idx;
+	struct zs_handle *handle;
+	struct zs_group *src, *dst = NULL;
+
+	if (!class_compactable(class))
+		return NULL;
+
+	src = find_partial(class, NULL, 0);
+	if (!src)
+		return NULL;
+
+	for (idx = 0; idx < class->objs_per_group; idx++) {
+		if (obj_is_free(src, idx))
+			continue;
+
+		if (!dst || dst->inuse == class->objs_per_group) {
+			dst = find_partial(class, src, 1);
+			if (WARN_ON(!dst))
+				return NULL;
+		}
+
+		handle = (struct zs_handle *)src->slot[idx];
+		obj_copy(class, src, idx, pool->compact_buf, 0);
+		obj_alloc(class, dst, handle);
+		obj_copy(class, dst, handle->idx, pool->compact_buf, 1);
+
+		if (obj_free(class, src, idx))
+			return src;
+	}
+
+	return NULL;
+}
+
+/* Compact until nr_pages are freed, returns the number freed */
+static unsigned long zs_compact_pages(struct zs_pool *pool,
+				unsigned long nr_pages)
+{
+	int i;
+	unsigned long freed = 0;
+	struct zs_class *class;
+	struct zs_group *group;
+
+	for (i = 0; i < ZS_NR_CLASSES && freed < nr_pages; i++) {
+		class = &pool->classes[i];
+
+		do {
+			/* one group at a time, mappers only wait that long */
+			write_lock(&pool->migrate_lock);
+			spin_lock(&class->lock);
+			group = compact_group(pool, class);
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+
+			if (group) {
+				freed += class->pages_per_group;
+				free_group(pool, group);
+			}
+			cond_resched();
+		} while (group && freed < nr_pages);
+	}
+
+	if (freed)
+		pr_debug("%s: compaction freed %lu pages\n", pool->name, freed);
+
+	return freed;
+}
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	int i;
+	unsigned long compactable = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact_pages(pool, sc->nr_to_scan);
+
+	/* an estimate is good enough here, don't take the locks */
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		compactable += class_compactable(&pool->classes[i]);
+
+	return min_t(unsigned long, compactable, INT_MAX);
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool, for messages
+ * @flags: allocation flags used for the pages of the pool
+ *
+ * The pool registers a shrinker, which compacts it under memory
+ * pressure.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	u32 i;
+	struct zs_class *class;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->compact_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!pool->compact_buf) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		spin_lock_init(&class->lock);
+		class->size = (i + 1) * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_group = get_pages_per_group(class->size);
+		class->objs_per_group = class->pages_per_group * PAGE_SIZE /
+					class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+	}
+
+	pool->name = name;
+	pool->flags = flags;
+	rwlock_init(&pool->migrate_lock);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	u32 i;
+	struct zs_class *class;
+	struct zs_group *group, *tmp;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		class = &pool->classes[i];
+		if (class->objs_inuse)
+			pr_info("%s: freeing %lu objects of size %u still "
+				"in use\n", pool->name, class->objs_inuse,
+				class->size);
+
+		list_for_each_entry_safe(group, tmp, &class->partial, list)
+			free_group(pool, group);
+		list_for_each_entry_safe(group, tmp, &class->full, list)
+			free_group(pool, group);
+	}
+
+	kfree(pool->compact_buf);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * Returns a handle to the object, 0 on failure. May sleep if the pool
+ * flags allow it.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_class *class;
+	struct zs_group *group;
+	struct zs_handle *handle;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cache,
+				pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = &pool->classes[get_class_index(size)];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		group = alloc_group(pool, class);
+		if (!group) {
+			kmem_cache_free(zs_handle_cache, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&group->list, &class->partial);
+		class->groups++;
+	}
+
+	group = list_first_entry(&class->partial, struct zs_group, list);
+	obj_alloc(class, group, handle);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	int empty;
+	struct zs_class *class;
+	struct zs_group *group;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+
+	read_lock(&pool->migrate_lock);
+	group = handle->group;
+	class = group->class;
+
+	spin_lock(&class->lock);
+	empty = obj_free(class, group, handle->idx);
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (empty)
+		free_group(pool, group);
+	kmem_cache_free(zs_handle_cache, handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @obj: handle returned from zs_malloc
+ * @mm: what the caller will do with the object
+ *
+ * The object stays put until zs_unmap_object(). Objects that span two
+ * pages are copied through a per CPU buffer.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	u32 offset;
+	struct zs_class *class;
+	struct zs_map_area *area;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+
+	/* also keeps us on this cpu and its map area */
+	read_lock(&pool->migrate_lock);
+	class = handle->group->class;
+	area = &__get_cpu_var(zs_map_area);
+
+	offset = handle->idx * class->size;
+	if ((offset & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(
+			handle->group->pages[offset >> PAGE_SHIFT], KM_USER1);
+		return area->vaddr + (offset & ~PAGE_MASK);
+	}
+
+	area->vaddr = NULL;
+	area->mm = mm;
+	if (mm != ZS_MM_WO)
+		obj_copy(class, handle->group, handle->idx, area->buf, 0);
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_map_area *area;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vaddr)
+		kunmap_atomic(area->vaddr, KM_USER1);
+	else if (area->mm != ZS_MM_RO)
+		obj_copy(handle->group->class, handle->group, handle->idx,
+			area->buf, 1);
+	area->vaddr = NULL;
+
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/**
+ * zs_compact - Move objects together and free the pages emptied.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. Mappings of the objects being
+ * moved wait, one group at a time.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return zs_compact_pages(pool, ULONG_MAX);
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+static int __init zs_init(void)
+{
+	int cpu;
+
+	zs_handle_cache = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		per_cpu(zs_map_area, cpu).buf = kmalloc(ZS_MAX_ALLOC_SIZE,
+							GFP_KERNEL);
+		if (!per_cpu(zs_map_area, cpu).buf)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu(zs_map_area, cpu).buf);
+	kmem_cache_destroy(zs_handle_cache);
+	return -ENOMEM;
+}
+module_init(zs_init);
@@ -0,0 +1,93 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+/*
+ * Objects of a size class are laid out back to back over a group of
+ * up to this many pages, so they may span two pages.
+ */
+#define ZS_MAX_PAGES_PER_GROUP	4
+
+/* Size classes are separated by this many bytes: 32 for 4k pages */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 7)
+
+/* End of user params */
+
+#define ZS_MIN_ALLOC_SIZE	ZS_SIZE_CLASS_DELTA
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_NR_CLASSES		(ZS_MAX_ALLOC_SIZE / ZS_SIZE_CLASS_DELTA)
+
+/* End of a group free list */
+#define ZS_NO_OBJ		0xffff
+
+struct zs_class;
+
+struct zs_group {
+	struct list_head list;	/* in the class partial or full list */
+	struct zs_class *class;
+	struct page *pages[ZS_MAX_PAGES_PER_GROUP];
+	u16 inuse;		/* allocated objects */
+	u16 free;		/* first free object */
+	/*
+	 * Handle of each allocated object, so compaction can update it.
+	 * Free objects hold (next free << 1) | 1 instead.
+	 */
+	unsigned long slot[0];
+};
+
+/* What a handle points to, only ever changed by compaction */
+struct zs_handle {
+	struct zs_group *group;
+	u32 idx;
+};
+
+struct zs_class {
+	spinlock_t lock;	/* protect lists and groups of the class */
+	u32 size;
+	u32 pages_per_group;
+	u32 objs_per_group;
+	struct list_head partial;	/* groups with free objects */
+	struct list_head full;
+	unsigned long groups;
+	unsigned long objs_inuse;
+};
+
+struct zs_pool {
+	const char *name;
+	gfp_t flags;
+	/*
+	 * Held for read by anything that needs objects to stay where they
+	 * are (map and free), for write by compaction moving them.
+	 */
+	rwlock_t migrate_lock;
+	struct zs_class classes[ZS_NR_CLASSES];
+	atomic_long_t pages;
+	char *compact_buf;	/* under migrate_lock held for write */
+	struct shrinker shrinker;
+};
+
+/* Per CPU state of the mapped object */
+struct zs_map_area {
+	char *buf;		/* copy of an object spanning two pages */
+	void *vaddr;		/* kmap address if it does not span */
+	enum zs_mapmode mm;
+};
+
+#endif
@@ -112,6 +112,41 @@ int smsg_send(uint8_t dst, struct smsg *msg, int timeout);
  */
 int smsg_recv(uint8_t dst, struct smsg *msg, int timeout);
 
+/**
+ * smsg_register_handler -- deliver msgs of a channel by callback, it's
+ * 		called in irq context instead of caching the msg and waking
+ * 		up the receiver, msgs it doesn't consume go to smsg_recv
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID, it should be opened
+ * @handler: callback, returns 0 if the msg is consumed
+ * @data: opaque data passed to the handler
+ * @return: 0 on success, <0 on failue
+ */
+int smsg_register_handler(uint8_t dst, uint8_t channel,
+		int (*handler)(struct smsg *msg, void *data), void *data);
+
+/**
+ * smsg_unregister_handler -- stop delivering msgs of a channel by callback,
+ * 		when it returns the handler is no longer running and its data
+ * 		may be freed
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: 0 on success, <0 on failue
+ */
+int smsg_unregister_handler(uint8_t dst, uint8_t channel);
+
+/**
+ * smsg_ch_dropped -- get the number of msgs dropped on a channel since
+ * 		its recv cache was full
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: dropped msg count
+ */
+uint32_t smsg_ch_dropped(uint8_t dst, uint8_t channel);
+
 /* quickly fill a smsg body */
 static inline void smsg_set(struct smsg *msg, uint8_t channel,
 		uint8_t type, uint16_t flag, uint32_t value)
@@ -134,9 +169,11 @@ static inline void smsg_open_ack(uint8_t dst, uint16_t channel)
 /* SMEM interfaces */
 
 /**
- * smem_alloc -- allocate shared memory block
+ * smem_alloc -- allocate shared memory block, sizes up to half a page
+ * 		come from size classes (power of 2, at least 32 bytes),
+ * 		bigger ones are page-aligned whole pages
  *
- * @size: size to be allocated, page-aligned
+ * @size: size to be allocated
  * @return: phys addr or 0 if failed
  */
 uint32_t smem_alloc(uint32_t size);
@@ -145,7 +182,7 @@ uint32_t smem_alloc(uint32_t size);
  * smem_free -- free shared memory block
  *
  * @addr: smem phys addr to be freed
- * @order: size to be freed
+ * @size: size to be freed, the same as allocated
  */
 void smem_free(uint32_t addr, uint32_t size);
 
@@ -215,6 +252,75 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 int sbuf_poll_wait(uint8_t dst, uint8_t channel, uint32_t bufid,
 		struct file *file, poll_table *wait);
 
+/* ring pointers of a sbuf for mmap users, rdptr/wrptr are free-running */
+struct sbuf_ptr {
+	uint32_t	size;
+	uint32_t	rdptr;
+	uint32_t	wrptr;
+};
+
+/**
+ * sbuf_mmap -- map a ring buffer of a sbuf to user space, offset 0 is
+ * 		the rx buffer (read-only), offset PAGE_ALIGN(rxbuf size) is
+ * 		the tx buffer, both should be whole pages
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @vma: vma to be mapped
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_mmap(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct vm_area_struct *vma);
+
+/**
+ * sbuf_rx_get -- wait for data in a sbuf, get the rx pointers
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @ptr: return the rx ring pointers
+ * @timeout: milliseconds, 0 means no wait, -1 means unlimited
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_rx_get(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct sbuf_ptr *ptr, int timeout);
+
+/**
+ * sbuf_rx_put -- consume data read in place, the peer gets one event
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @len: consumed bytes
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_rx_put(uint8_t dst, uint8_t channel, uint32_t bufid, uint32_t len);
+
+/**
+ * sbuf_tx_get -- wait for room in a sbuf, get the tx pointers
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @ptr: return the tx ring pointers
+ * @timeout: milliseconds, 0 means no wait, -1 means unlimited
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_tx_get(uint8_t dst, uint8_t channel, uint32_t bufid,
+		struct sbuf_ptr *ptr, int timeout);
+
+/**
+ * sbuf_tx_put -- publish data written in place, the peer gets one event
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @len: produced bytes
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_tx_put(uint8_t dst, uint8_t channel, uint32_t bufid, uint32_t len);
+
 /**
  * sbuf_status -- get sbuf status
  *
@@ -264,6 +370,7 @@ void sblock_destroy(uint8_t dst, uint8_t channel);
  * sblock_register_notifier -- register a callback that's called
  * 		when a tx sblock is available or a rx block is received.
  * 		non-blocked sblock_get or sblock_receive can be called.
+ * 		SBLOCK_NOTIFY_GET/RECV come in softirq (tasklet) context.
  *
  * @dst: dest processor ID
  * @channel: channel ID
@@ -282,12 +389,24 @@ int sblock_register_notifier(uint8_t dst, uint8_t channel,
  * @channel: channel ID
  * @blk: return a gotten sblock pointer
  * @timeout: milliseconds, 0 means no wait, -1 means unlimited
- * @return: 0 on success, <0 on failue
+ * @return: 0 on success, <0 on failue, -ENODATA quietly if no sblock is
+ *          free and timeout is 0
  */
 int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
 
 /**
- * sblock_send  -- send a sblock, it should be from sblock_get
+ * sblock_put  -- give back a sblock from sblock_get that won't be sent
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blk: the sblock to be given back
+ * @return: 0 on success, <0 on failue
+ */
+int sblock_put(uint8_t dst, uint8_t channel, struct sblock *blk);
+
+/**
+ * sblock_send  -- send a sblock, it should be from sblock_get, it
+ * 		doesn't sleep, the event is raised per sblock_set_flush
  *
  * @dst: dest processor ID
  * @channel: channel ID
@@ -296,6 +415,18 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
  */
 int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk);
 
+/**
+ * sblock_send_multi  -- send count sblocks with one event to the peer,
+ * 		it doesn't sleep, the event is raised per sblock_set_flush
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blks: the sblocks to be sent
+ * @count: number of sblocks
+ * @return: 0 on success, <0 on failue
+ */
+int sblock_send_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count);
+
 /**
  * sblock_receive  -- receive a sblock, it should be released after it's handled
  *
@@ -308,7 +439,29 @@ int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk);
 int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
 
 /**
- * sblock_release  -- release a sblock from reveiver
+ * sblock_receive_multi  -- receive up to count sblocks without waiting,
+ * 		it can be called in softirq context, e.g. from a NAPI poll
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blks: array to return the received sblocks
+ * @count: size of the blks array
+ * @return: number of received sblocks, <0 on failue
+ */
+int sblock_receive_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count);
+
+/**
+ * sblock_rx_pending  -- get the number of sblocks waiting to be received
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: number of pending sblocks
+ */
+int sblock_rx_pending(uint8_t dst, uint8_t channel);
+
+/**
+ * sblock_release  -- release a sblock from reveiver, it doesn't sleep,
+ * 		the event is raised per sblock_set_flush
  *
  * @dst: dest processor ID
  * @channel: channel ID
@@ -316,6 +469,54 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
  */
 int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk);
 
+/**
+ * sblock_release_multi  -- release count sblocks, with one event to the peer
+ *                         if it has the release rings
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blks: the sblocks to be released
+ * @count: number of sblocks
+ * @return: 0 on success, <0 on failue
+ */
+int sblock_release_multi(uint8_t dst, uint8_t channel, struct sblock *blks, int count);
+
+/**
+ * sblock_set_flush  -- set how send/release events are coalesced, an
+ * 		event is raised once thresh sblocks are pending, or delay
+ * 		after the first pending one
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @thresh: pending sblocks before an event, 1 means no coalescing
+ * @delay: milliseconds to flush pending sblocks below thresh
+ * @return: 0 on success, <0 on failue
+ */
+int sblock_set_flush(uint8_t dst, uint8_t channel, uint32_t thresh, uint32_t delay);
+
+/**
+ * sblock_status -- get sblock status
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: 0 when ready, <0 when broken
+ */
+int sblock_status(uint8_t dst, uint8_t channel);
+
+/**
+ * sblock_page  -- get the page backing a received sblock, so that a
+ * 		zero-copy receiver can lend it out, the cached alias of
+ * 		the block is invalidated before returning
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blk: a received sblock
+ * @offset: return the offset of blk->addr in the page
+ * @return: the page, or NULL if smem is not in the kernel linear map
+ */
+struct page *sblock_page(uint8_t dst, uint8_t channel, struct sblock *blk,
+		uint32_t *offset);
+
 
 /* ****************************************************************** */
 /* TODO: SRPC interfaces */
@@ -14,17 +14,81 @@
 #ifndef __SIPC_PRIV_H
 #define __SIPC_PRIV_H
 
+#include <linux/ktime.h>
+
 #define SMSG_CACHE_NR		64
 
+/* log2 histogram, bucket i counts values in [2^(i-1), 2^i) */
+#define SIPC_HIST_NR		20
+
+struct sipc_hist {
+	uint32_t		count;
+	uint32_t		max;
+	uint64_t		sum;
+	uint32_t		buckets[SIPC_HIST_NR];
+};
+
+static inline void sipc_hist_add(struct sipc_hist *hist, uint32_t val)
+{
+	int i = fls(val);
+
+	if (i >= SIPC_HIST_NR) {
+		i = SIPC_HIST_NR - 1;
+	}
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += val;
+	if (val > hist->max) {
+		hist->max = val;
+	}
+}
+
+static inline uint32_t sipc_us_since(ktime_t stamp)
+{
+	return (uint32_t)ktime_us_delta(ktime_get(), stamp);
+}
+
+struct seq_file;
+struct dentry;
+
+/* print a histogram in debugfs */
+void sipc_hist_show(struct seq_file *m, const char *name,
+		struct sipc_hist *hist);
+
+/* debugfs dir "sipc", created on first use */
+struct dentry *sipc_debugfs_root(void);
+
+/* per-channel smsg statistics, kept across channel close/open */
+struct smsg_stat {
+	uint32_t		txcount;
+	uint32_t		rxcount;
+	uint32_t		txfull;		/* sends that found tx ring full */
+	ktime_t			cmdstamp;	/* last CMD sent, 0 if acked */
+	struct sipc_hist	wakeup;		/* irq to smsg_recv return, us */
+	struct sipc_hist	ack;		/* CMD sent to DONE recv, us */
+};
+
 struct smsg_channel {
 	/* wait queue for recv-buffer */
 	wait_queue_head_t	rxwait;
 	struct mutex		rxlock;
 
-	/* cached msgs for recv */
-	uint32_t		wrptr[1];
-	uint32_t		rdptr[1];
+	/*
+	 * cached msgs for recv, it's a single-producer/single-consumer
+	 * ring: only the irq handler moves wrptr, only the rxlock holder
+	 * moves rdptr, so no lock is shared between them
+	 */
+	uint32_t		wrptr;
+	uint32_t		rdptr;
 	struct smsg		caches[SMSG_CACHE_NR];
+	ktime_t			stamps[SMSG_CACHE_NR];	/* cached time */
+
+	/* msgs dropped because the cache was full */
+	uint32_t		dropped;
+
+	/* optional callback in irq context, returns 0 if msg is consumed */
+	int			(*handler)(struct smsg *msg, void *data);
+	void			*data;
 };
 
 /* smsg ring-buffer between AP/CP ipc */
@@ -57,14 +121,17 @@ struct smsg_ipc {
 	/* sipc ctrl thread */
 	struct task_struct	*thread;
 
-	/* lock for send-buffer */
-	struct mutex		txlock;
+	/* lock for send-buffer, never held while waiting for room */
+	spinlock_t		txlock;
 
 	/* all fixed channels receivers */
 	struct smsg_channel	*channels[SMSG_CH_NR];
 
 	/* all channel states: 0 unused, 1 opened */
 	uint8_t			states[SMSG_CH_NR];
+
+	/* all channel statistics */
+	struct smsg_stat	stats[SMSG_CH_NR];
 };
 
 #define CHAN_STATE_UNUSED	0
@@ -14,6 +14,9 @@
 #ifndef __SPIPE_H
 #define __SPIPE_H
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 struct spipe_init_data {
 	char			*name;
 	uint8_t			dst;
@@ -23,4 +26,25 @@ struct spipe_init_data {
 	uint32_t		rxbuf_size;
 };
 
+/*
+ * mmap interface: the rx ring is mapped read-only at offset 0, the tx
+ * ring at offset PAGE_ALIGN(rx size). rdptr/wrptr are free-running,
+ * the data is at ptr % size in the mapping.
+ */
+struct spipe_ring_info {
+	__u32			size;
+	__u32			rdptr;
+	__u32			wrptr;
+};
+
+#define SPIPE_IOC_MAGIC		'P'
+/* wait for rx data (unless O_NONBLOCK) and get the rx pointers */
+#define SPIPE_IOC_RX_GET	_IOR(SPIPE_IOC_MAGIC, 1, struct spipe_ring_info)
+/* consume n bytes of rx data */
+#define SPIPE_IOC_RX_PUT	_IOW(SPIPE_IOC_MAGIC, 2, __u32)
+/* wait for tx room (unless O_NONBLOCK) and get the tx pointers */
+#define SPIPE_IOC_TX_GET	_IOR(SPIPE_IOC_MAGIC, 3, struct spipe_ring_info)
+/* publish n bytes of tx data */
+#define SPIPE_IOC_TX_PUT	_IOW(SPIPE_IOC_MAGIC, 4, __u32)
+
 #endif
@@ -0,0 +1,146 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sipc
+
+#if !defined(_TRACE_SIPC_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SIPC_H
+
+#include <linux/tracepoint.h>
+
+struct smsg;
+
+DECLARE_EVENT_CLASS(sipc_smsg,
+
+	TP_PROTO(uint8_t dst, struct smsg *msg),
+
+	TP_ARGS(dst, msg),
+
+	TP_STRUCT__entry(
+		__field(	uint8_t,	dst		)
+		__field(	uint8_t,	channel		)
+		__field(	uint8_t,	type		)
+		__field(	uint16_t,	flag		)
+		__field(	uint32_t,	value		)
+	),
+
+	TP_fast_assign(
+		__entry->dst = dst;
+		__entry->channel = msg->channel;
+		__entry->type = msg->type;
+		__entry->flag = msg->flag;
+		__entry->value = msg->value;
+	),
+
+	TP_printk("dst=%u channel=%u type=%u flag=0x%04x value=0x%08x",
+		__entry->dst, __entry->channel, __entry->type,
+		__entry->flag, __entry->value)
+);
+
+/**
+ * sipc_smsg_send - a smsg is written to the tx ring
+ * @dst: dest processor ID
+ * @msg: the smsg
+ */
+DEFINE_EVENT(sipc_smsg, sipc_smsg_send,
+
+	TP_PROTO(uint8_t dst, struct smsg *msg),
+
+	TP_ARGS(dst, msg)
+);
+
+/**
+ * sipc_smsg_irq - a smsg is taken from the rx ring in the irq handler
+ * @dst: dest processor ID
+ * @msg: the smsg
+ */
+DEFINE_EVENT(sipc_smsg, sipc_smsg_irq,
+
+	TP_PROTO(uint8_t dst, struct smsg *msg),
+
+	TP_ARGS(dst, msg)
+);
+
+DECLARE_EVENT_CLASS(sipc_sblock,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, int count),
+
+	TP_ARGS(dst, channel, count),
+
+	TP_STRUCT__entry(
+		__field(	uint8_t,	dst		)
+		__field(	uint8_t,	channel		)
+		__field(	int,		count		)
+	),
+
+	TP_fast_assign(
+		__entry->dst = dst;
+		__entry->channel = channel;
+		__entry->count = count;
+	),
+
+	TP_printk("dst=%u channel=%u count=%d",
+		__entry->dst, __entry->channel, __entry->count)
+);
+
+DEFINE_EVENT(sipc_sblock, sipc_sblock_send,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, int count),
+
+	TP_ARGS(dst, channel, count)
+);
+
+DEFINE_EVENT(sipc_sblock, sipc_sblock_receive,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, int count),
+
+	TP_ARGS(dst, channel, count)
+);
+
+DEFINE_EVENT(sipc_sblock, sipc_sblock_release,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, int count),
+
+	TP_ARGS(dst, channel, count)
+);
+
+DECLARE_EVENT_CLASS(sipc_sbuf,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, uint32_t bufid, int len),
+
+	TP_ARGS(dst, channel, bufid, len),
+
+	TP_STRUCT__entry(
+		__field(	uint8_t,	dst		)
+		__field(	uint8_t,	channel		)
+		__field(	uint32_t,	bufid		)
+		__field(	int,		len		)
+	),
+
+	TP_fast_assign(
+		__entry->dst = dst;
+		__entry->channel = channel;
+		__entry->bufid = bufid;
+		__entry->len = len;
+	),
+
+	TP_printk("dst=%u channel=%u bufid=%u len=%d",
+		__entry->dst, __entry->channel, __entry->bufid, __entry->len)
+);
+
+DEFINE_EVENT(sipc_sbuf, sipc_sbuf_write,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, uint32_t bufid, int len),
+
+	TP_ARGS(dst, channel, bufid, len)
+);
+
+DEFINE_EVENT(sipc_sbuf, sipc_sbuf_read,
+
+	TP_PROTO(uint8_t dst, uint8_t channel, uint32_t bufid, int len),
+
+	TP_ARGS(dst, channel, bufid, len)
+);
+
+#endif /* _TRACE_SIPC_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
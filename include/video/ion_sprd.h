@@ -47,9 +47,32 @@ struct ion_msync_data {
 	size_t size;
 };
 
+/* carveout buffers allocated with this flag are mapped cacheable */
+#define ION_SPRD_FLAG_CACHED	(1 << 31)
+
+enum ion_sync_direction {
+	ION_SYNC_TO_DEVICE,		/* cpu wrote, device will read */
+	ION_SYNC_FROM_DEVICE,		/* device wrote, cpu will read */
+	ION_SYNC_BIDIRECTIONAL,
+};
+
+/*
+ * Range of a buffer to hand over between cpu and device with
+ * ION_SPRD_CUSTOM_SYNC: 'vaddr' is where byte 'offset' of the buffer is
+ * mapped in the caller, 'direction' one of enum ion_sync_direction.
+ */
+struct ion_sync_data {
+	int fd_buffer;
+	void *vaddr;
+	size_t offset;
+	size_t size;
+	int direction;
+};
+
 enum ION_SPRD_CUSTOM_CMD {
 	ION_SPRD_CUSTOM_PHYS,
-	ION_SPRD_CUSTOM_MSYNC
+	ION_SPRD_CUSTOM_MSYNC,
+	ION_SPRD_CUSTOM_SYNC
 };
 
 #endif /* _ION_SPRD_H */
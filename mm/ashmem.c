@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,7 +39,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +48,16 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects all of the above */
+	atomic_t purging;		/* ranges the shrinker is truncating */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by the area's `mutex'; `lru' and `purged' are also
+ * protected by `ashmem_lru_lock', so that the shrinker can claim a range
+ * without taking the area's mutex.
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +68,28 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and each range's place on it
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker only ever takes ashmem_lru_lock, and truncates the ranges
+ * it claimed after dropping it.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* woken when an area's in-flight purges complete */
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_purge_wait);
+
+/* number of ranges the shrinker claims per trip through ashmem_lru_lock */
+#define ASHMEM_PURGE_BATCH	8
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -82,7 +98,7 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
   ((range)->pgend - (range)->pgstart + 1)
 
 #define range_on_lru(range) \
-  ((range)->purged == ASHMEM_NOT_PURGED)
+  (!list_empty(&(range)->lru))
 
 #define page_range_subsumes_range(range, start, end) \
   (((range)->pgstart >= (start)) && ((range)->pgend <= (end)))
@@ -102,52 +118,49 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+/* Caller must hold ashmem_lru_lock. */
 static inline void lru_add(struct ashmem_range *range)
 {
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
 }
 
+/* Caller must hold ashmem_lru_lock. */
 static inline void lru_del(struct ashmem_range *range)
 {
-	list_del(&range->lru);
+	list_del_init(&range->lru);
 	lru_count -= range_size(range);
 }
 
 /*
- * range_alloc - allocate and initialize a new ashmem_range structure
+ * range_init - initialize a preallocated ashmem_range structure
  *
  * 'asma' - associated ashmem_area
+ * 'range' - the new range, allocated before any lock was taken
  * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex and ashmem_lru_lock.
  */
-static int range_alloc(struct ashmem_area *asma,
+static void range_init(struct ashmem_area *asma, struct ashmem_range *range,
 		       struct ashmem_range *prev_range, unsigned int purged,
 		       size_t start, size_t end)
 {
-	struct ashmem_range *range;
-
-	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
-	if (unlikely(!range))
-		return -ENOMEM;
-
 	range->asma = asma;
 	range->pgstart = start;
 	range->pgend = end;
 	range->purged = purged;
+	INIT_LIST_HEAD(&range->lru);
 
 	list_add_tail(&range->unpinned, &prev_range->unpinned);
 
-	if (range_on_lru(range))
+	if (purged == ASHMEM_NOT_PURGED)
 		lru_add(range);
-
-	return 0;
 }
 
+/* Caller must hold asma->mutex and ashmem_lru_lock. */
 static void range_del(struct ashmem_range *range)
 {
 	list_del(&range->unpinned);
@@ -159,7 +172,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex and ashmem_lru_lock.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -187,6 +200,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->purging, 0);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +214,15 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	spin_lock(&ashmem_lru_lock);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
+	mutex_unlock(&asma->mutex);
+
+	/* the shrinker may still be truncating ranges it took from us */
+	wait_event(ashmem_purge_wait, !atomic_read(&asma->purging));
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +237,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +258,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +267,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +288,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +305,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,7 +348,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -344,36 +364,64 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ *
+ * Ranges are claimed in batches under ashmem_lru_lock: each is taken off the
+ * LRU, marked purged and counted in its area's 'purging', then truncated with
+ * no ashmem lock held.  A racing pin of such a range reports it as purged and
+ * waits for the truncation to finish before returning.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct {
+		struct ashmem_area *asma;
+		loff_t start;
+		loff_t end;
+	} batch[ASHMEM_PURGE_BATCH];
+	long nr_to_scan = sc->nr_to_scan;
+	int i, n;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
-	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
+	if (nr_to_scan && !(sc->gfp_mask & __GFP_FS))
 		return -1;
-	if (!sc->nr_to_scan)
+	if (!nr_to_scan)
 		return lru_count;
 
-	//avoid deadlock when memory is low
-        if (!mutex_trylock(&ashmem_mutex))
-		return -1;
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	while (nr_to_scan > 0) {
+		n = 0;
+		spin_lock(&ashmem_lru_lock);
+		while (n < ASHMEM_PURGE_BATCH && nr_to_scan > 0 &&
+		       !list_empty(&ashmem_lru_list)) {
+			struct ashmem_range *range;
+
+			range = list_first_entry(&ashmem_lru_list,
+						 struct ashmem_range, lru);
+			lru_del(range);
+			range->purged = ASHMEM_WAS_PURGED;
+			atomic_inc(&range->asma->purging);
+
+			batch[n].asma = range->asma;
+			batch[n].start = range->pgstart * PAGE_SIZE;
+			batch[n].end = (range->pgend + 1) * PAGE_SIZE - 1;
+			n++;
+
+			nr_to_scan -= range_size(range);
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
+		if (!n)
 			break;
+
+		/* the areas can't go away while their 'purging' is elevated */
+		for (i = 0; i < n; i++) {
+			struct ashmem_area *asma = batch[i].asma;
+
+			vmtruncate_range(asma->file->f_dentry->d_inode,
+					 batch[i].start, batch[i].end);
+			if (atomic_dec_and_test(&asma->purging))
+				wake_up_all(&ashmem_purge_wait);
+		}
 	}
-	mutex_unlock(&ashmem_mutex);
 
 	return lru_count;
 }
@@ -387,7 +435,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -402,7 +450,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -410,7 +458,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -424,7 +472,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -433,7 +481,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -450,7 +498,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -459,13 +507,18 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * 'new_range' is used if the pin punches a hole in an unpinned range and is
+ * freed otherwise.
+ *
+ * Caller must hold asma->mutex.
  */
-static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
+static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend,
+		      struct ashmem_range *new_range)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
+	spin_lock(&ashmem_lru_lock);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
 		/* moved past last applicable page; we can short circuit */
 		if (range_before_page(range, pgstart))
@@ -512,12 +565,24 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			range_init(asma, new_range, range, range->purged,
+				   pgend + 1, range->pgend);
+			new_range = NULL;
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
 	}
+	spin_unlock(&ashmem_lru_lock);
+
+	if (new_range)
+		kmem_cache_free(ashmem_range_cachep, new_range);
+
+	/*
+	 * Some of the pages may still be under truncation; don't let the user
+	 * write to them until the shrinker is done with this area.
+	 */
+	if (ret == ASHMEM_WAS_PURGED)
+		wait_event(ashmem_purge_wait, !atomic_read(&asma->purging));
 
 	return ret;
 }
@@ -525,13 +590,18 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * 'new_range' becomes the unpinned range, or is freed if the pages were
+ * already unpinned.
+ *
+ * Caller must hold asma->mutex.
  */
-static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
+static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend,
+			struct ashmem_range *new_range)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
+	spin_lock(&ashmem_lru_lock);
 restart:
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
 		/* short circuit: this is our insertion point */
@@ -542,8 +612,11 @@ restart:
 		 * The user can ask us to unpin pages that are already entirely
 		 * or partially pinned. We handle those two cases here.
 		 */
-		if (page_range_subsumed_by_range(range, pgstart, pgend))
+		if (page_range_subsumed_by_range(range, pgstart, pgend)) {
+			spin_unlock(&ashmem_lru_lock);
+			kmem_cache_free(ashmem_range_cachep, new_range);
 			return 0;
+		}
 		if (page_range_in_range(range, pgstart, pgend)) {
 			pgstart = min_t(size_t, range->pgstart, pgstart),
 			pgend = max_t(size_t, range->pgend, pgend);
@@ -553,14 +626,17 @@ restart:
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	range_init(asma, new_range, range, purged, pgstart, pgend);
+	spin_unlock(&ashmem_lru_lock);
+
+	return 0;
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -584,6 +660,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
 	struct ashmem_pin pin;
+	struct ashmem_range *range = NULL;
 	size_t pgstart, pgend;
 	int ret = -EINVAL;
 
@@ -609,21 +686,28 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	/* allocate up front, so nothing below sleeps with ashmem_lru_lock held */
+	if (cmd == ASHMEM_PIN || cmd == ASHMEM_UNPIN) {
+		range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
+		if (unlikely(!range))
+			return -ENOMEM;
+	}
+
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
-		ret = ashmem_pin(asma, pgstart, pgend);
+		ret = ashmem_pin(asma, pgstart, pgend, range);
 		break;
 	case ASHMEM_UNPIN:
-		ret = ashmem_unpin(asma, pgstart, pgend);
+		ret = ashmem_unpin(asma, pgstart, pgend, range);
 		break;
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_get_pin_status(asma, pgstart, pgend);
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
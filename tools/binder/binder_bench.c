@@ -0,0 +1,765 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -I../../drivers/staging/android -o binder_bench binder_bench.c */
+
+/*
+ * Binder lock contention benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Runs 1, 2, 4, ... independent client/server process pairs that do
+ * synchronous ping-pong transactions through /dev/binder, and reports
+ * the aggregate transaction rate for each step.  The pairs share no
+ * binder objects, so any loss of scaling beyond the number of CPUs is
+ * contention inside the driver.
+ *
+ * Servers publish themselves through the context manager using the
+ * servicemanager ADD_SERVICE/CHECK_SERVICE protocol.  If no context
+ * manager is running, a small built-in one is started instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_MAP_SIZE		(128 * 1024)
+
+#define SVC_MGR_HANDLE		0
+#define SVC_MGR_CHECK_SERVICE	2
+#define SVC_MGR_ADD_SERVICE	3
+#define SVC_MGR_NAME		"android.os.IServiceManager"
+
+#define BENCH_PING		1	/* first user transaction code */
+#define MAX_PAIRS		64
+#define MAX_PAYLOAD		4096
+#define MAX_SERVICES		(2 * MAX_PAIRS)
+
+struct bench_binder {
+	int fd;
+	void *map;
+};
+
+struct parcel {
+	uint8_t data[MAX_PAYLOAD + 512];
+	size_t len;
+	size_t offs[2];
+	int noffs;
+	size_t pos;		/* read cursor */
+};
+
+struct bench_result {
+	uint64_t elapsed_ns;
+	unsigned long done;
+};
+
+static unsigned long iterations = 10000;
+static size_t payload = 64;
+static int max_pairs;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_binder_open(struct bench_binder *bb)
+{
+	struct binder_version vers;
+
+	bb->fd = open(BINDER_DEV, O_RDWR);
+	if (bb->fd < 0) {
+		perror("open " BINDER_DEV);
+		return -1;
+	}
+	if (ioctl(bb->fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		close(bb->fd);
+		return -1;
+	}
+	bb->map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE,
+		       bb->fd, 0);
+	if (bb->map == MAP_FAILED) {
+		perror("mmap");
+		close(bb->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_binder_write_read(struct bench_binder *bb,
+				   void *wbuf, size_t wlen,
+				   void *rbuf, size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	bwr.write_size = wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rlen;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(bb->fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		perror("BINDER_WRITE_READ");
+		return -1;
+	}
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+static int bench_binder_cmd(struct bench_binder *bb, uint32_t cmd,
+			    const void *arg, size_t size)
+{
+	uint32_t buf[8];
+
+	buf[0] = cmd;
+	memcpy(&buf[1], arg, size);
+	return bench_binder_write_read(bb, buf, sizeof(uint32_t) + size,
+				       NULL, 0, NULL);
+}
+
+/* Acknowledge reference count requests on our own nodes. */
+static int bench_binder_ack_ref(struct bench_binder *bb, uint32_t br,
+				struct binder_ptr_cookie *pc)
+{
+	if (br == BR_INCREFS)
+		return bench_binder_cmd(bb, BC_INCREFS_DONE, pc, sizeof(*pc));
+	if (br == BR_ACQUIRE)
+		return bench_binder_cmd(bb, BC_ACQUIRE_DONE, pc, sizeof(*pc));
+	return 0;
+}
+
+static void parcel_init(struct parcel *p)
+{
+	p->len = 0;
+	p->noffs = 0;
+	p->pos = 0;
+}
+
+static void parcel_put(struct parcel *p, const void *data, size_t len)
+{
+	memcpy(p->data + p->len, data, len);
+	p->len += (len + 3) & ~3;
+}
+
+static void parcel_put_u32(struct parcel *p, uint32_t val)
+{
+	parcel_put(p, &val, sizeof(val));
+}
+
+static void parcel_put_str16(struct parcel *p, const char *str)
+{
+	uint32_t len = strlen(str);
+	uint16_t *out;
+	uint32_t i;
+
+	parcel_put_u32(p, len);
+	out = (uint16_t *)(p->data + p->len);
+	for (i = 0; i < len; i++)
+		out[i] = str[i];
+	out[len] = 0;
+	p->len += ((len + 1) * sizeof(uint16_t) + 3) & ~3;
+}
+
+static void parcel_put_obj(struct parcel *p, unsigned long type, void *ptr,
+			   signed long handle)
+{
+	struct flat_binder_object obj;
+
+	memset(&obj, 0, sizeof(obj));
+	obj.type = type;
+	obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	if (type == BINDER_TYPE_BINDER)
+		obj.binder = ptr;
+	else
+		obj.handle = handle;
+	p->offs[p->noffs++] = p->len;
+	parcel_put(p, &obj, sizeof(obj));
+}
+
+static uint32_t parcel_get_u32(struct parcel *p)
+{
+	uint32_t val = 0;
+
+	if (p->pos + sizeof(val) <= p->len)
+		memcpy(&val, p->data + p->pos, sizeof(val));
+	p->pos += sizeof(val);
+	return val;
+}
+
+/* Reads a string16 back into 8-bit chars, truncating to @size. */
+static void parcel_get_str16(struct parcel *p, char *str, size_t size)
+{
+	uint32_t len = parcel_get_u32(p);
+	uint16_t *in = (uint16_t *)(p->data + p->pos);
+	uint32_t i;
+
+	for (i = 0; i < len && i + 1 < size &&
+	     p->pos + (i + 1) * sizeof(uint16_t) <= p->len; i++)
+		str[i] = in[i];
+	str[i] = '\0';
+	p->pos += ((len + 1) * sizeof(uint16_t) + 3) & ~3;
+}
+
+/* Returns the handle of the first object in @p, or -1. */
+static signed long parcel_get_handle(struct parcel *p)
+{
+	struct flat_binder_object obj;
+
+	if (!p->noffs || p->offs[0] + sizeof(obj) > p->len)
+		return -1;
+	memcpy(&obj, p->data + p->offs[0], sizeof(obj));
+	if (obj.type != BINDER_TYPE_HANDLE)
+		return -1;
+	return obj.handle;
+}
+
+static void parcel_from_txn(struct parcel *p,
+			    const struct binder_transaction_data *txn)
+{
+	size_t i;
+
+	parcel_init(p);
+	p->len = txn->data_size < sizeof(p->data) ?
+		 txn->data_size : sizeof(p->data);
+	memcpy(p->data, txn->data.ptr.buffer, p->len);
+	for (i = 0; i < txn->offsets_size / sizeof(size_t) &&
+	     i < sizeof(p->offs) / sizeof(p->offs[0]); i++)
+		p->offs[p->noffs++] = ((const size_t *)txn->data.ptr.offsets)[i];
+}
+
+static void txn_from_parcel(struct binder_transaction_data *txn,
+			    struct parcel *p)
+{
+	txn->data_size = p->len;
+	txn->offsets_size = p->noffs * sizeof(size_t);
+	txn->data.ptr.buffer = p->data;
+	txn->data.ptr.offsets = p->offs;
+}
+
+/*
+ * Sends @msg to @handle and waits for the reply, which is copied into
+ * @reply (if non-NULL) before the kernel buffer is freed.  Handles in
+ * the reply are acquired before the free so they outlive the buffer.
+ */
+static int bench_binder_call(struct bench_binder *bb, size_t handle,
+			     uint32_t code, struct parcel *msg,
+			     struct parcel *reply)
+{
+	struct binder_transaction_data txn;
+	uint8_t wbuf[sizeof(uint32_t) + sizeof(txn)];
+	uint32_t rbuf[128];
+	uint32_t cmd = BC_TRANSACTION;
+	size_t wlen = sizeof(wbuf);
+
+	memset(&txn, 0, sizeof(txn));
+	txn.target.handle = handle;
+	txn.code = code;
+	txn_from_parcel(&txn, msg);
+	memcpy(wbuf, &cmd, sizeof(cmd));
+	memcpy(wbuf + sizeof(cmd), &txn, sizeof(txn));
+
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (bench_binder_write_read(bb, wbuf, wlen, rbuf,
+					    sizeof(rbuf), &consumed))
+			return -1;
+		wlen = 0;
+		while (off < consumed) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+			void *arg = (char *)rbuf + off + sizeof(uint32_t);
+
+			off += sizeof(uint32_t) + _IOC_SIZE(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_RELEASE:
+			case BR_DECREFS:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				if (bench_binder_ack_ref(bb, cmd, arg))
+					return -1;
+				break;
+			case BR_REPLY: {
+				struct binder_transaction_data *txn = arg;
+				struct {
+					uint32_t cmd;
+					const void *buffer;
+				} __attribute__((packed)) fb;
+				int ret = 0;
+				int h;
+
+				if (txn->flags & TF_STATUS_CODE)
+					ret = -1;
+				else if (reply) {
+					parcel_from_txn(reply, txn);
+					h = parcel_get_handle(reply);
+					if (h >= 0)
+						bench_binder_cmd(bb, BC_ACQUIRE,
+								 &h, sizeof(int));
+				}
+				fb.cmd = BC_FREE_BUFFER;
+				fb.buffer = txn->data.ptr.buffer;
+				if (bench_binder_write_read(bb, &fb, sizeof(fb),
+							    NULL, 0, NULL))
+					return -1;
+				return ret;
+			}
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return -1;
+			default:
+				fprintf(stderr, "unexpected return 0x%x\n", cmd);
+				return -1;
+			}
+		}
+	}
+}
+
+static int svcmgr_add(struct bench_binder *bb, const char *name, void *ptr)
+{
+	struct parcel msg;
+
+	parcel_init(&msg);
+	parcel_put_u32(&msg, 0);	/* strict mode policy */
+	parcel_put_str16(&msg, SVC_MGR_NAME);
+	parcel_put_str16(&msg, name);
+	parcel_put_obj(&msg, BINDER_TYPE_BINDER, ptr, 0);
+	parcel_put_u32(&msg, 0);	/* allow isolated */
+	return bench_binder_call(bb, SVC_MGR_HANDLE, SVC_MGR_ADD_SERVICE,
+				 &msg, NULL);
+}
+
+static signed long svcmgr_check(struct bench_binder *bb, const char *name)
+{
+	struct parcel msg, reply;
+
+	parcel_init(&msg);
+	parcel_put_u32(&msg, 0);
+	parcel_put_str16(&msg, SVC_MGR_NAME);
+	parcel_put_str16(&msg, name);
+	if (bench_binder_call(bb, SVC_MGR_HANDLE, SVC_MGR_CHECK_SERVICE,
+			      &msg, &reply))
+		return -1;
+	return parcel_get_handle(&reply);
+}
+
+/*
+ * Handler for incoming transactions; fills in @reply and returns 0, or
+ * returns non-zero to send a status-code error instead.
+ */
+typedef int (*bench_handler)(struct bench_binder *bb, struct parcel *msg,
+			     uint32_t code, struct parcel *reply);
+
+static void bench_binder_loop(struct bench_binder *bb, bench_handler func)
+{
+	struct parcel msg, reply;
+	uint32_t rbuf[128];
+	uint32_t enter = BC_ENTER_LOOPER;
+
+	if (bench_binder_write_read(bb, &enter, sizeof(enter), NULL, 0, NULL))
+		exit(1);
+
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (bench_binder_write_read(bb, NULL, 0, rbuf, sizeof(rbuf),
+					    &consumed))
+			exit(1);
+		while (off < consumed) {
+			uint32_t cmd = *(uint32_t *)((char *)rbuf + off);
+			void *arg = (char *)rbuf + off + sizeof(uint32_t);
+
+			off += sizeof(uint32_t) + _IOC_SIZE(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_RELEASE:
+			case BR_DECREFS:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				if (bench_binder_ack_ref(bb, cmd, arg))
+					exit(1);
+				break;
+			case BR_TRANSACTION: {
+				struct binder_transaction_data *txn = arg;
+				struct binder_transaction_data rtxn;
+				const void *buffer = txn->data.ptr.buffer;
+				uint8_t wbuf[2 * sizeof(uint32_t) +
+					     sizeof(buffer) + sizeof(rtxn)];
+				uint8_t *w = wbuf;
+				uint32_t status = EINVAL;
+				uint32_t cmd;
+
+				parcel_from_txn(&msg, txn);
+				parcel_init(&reply);
+				memset(&rtxn, 0, sizeof(rtxn));
+				if (func(bb, &msg, txn->code, &reply)) {
+					rtxn.flags = TF_STATUS_CODE;
+					rtxn.data_size = sizeof(status);
+					rtxn.data.ptr.buffer = &status;
+				} else
+					txn_from_parcel(&rtxn, &reply);
+
+				cmd = BC_FREE_BUFFER;
+				memcpy(w, &cmd, sizeof(cmd));
+				w += sizeof(cmd);
+				memcpy(w, &buffer, sizeof(buffer));
+				w += sizeof(buffer);
+				cmd = BC_REPLY;
+				memcpy(w, &cmd, sizeof(cmd));
+				w += sizeof(cmd);
+				memcpy(w, &rtxn, sizeof(rtxn));
+				if (bench_binder_write_read(bb, wbuf, sizeof(wbuf),
+							    NULL, 0, NULL))
+					exit(1);
+				break;
+			}
+			case BR_DEAD_BINDER: {
+				void *cookie = *(void **)arg;
+
+				bench_binder_cmd(bb, BC_DEAD_BINDER_DONE,
+						 &cookie, sizeof(cookie));
+				break;
+			}
+			default:
+				fprintf(stderr, "unexpected return 0x%x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+/* Echoes the payload back to the client. */
+static int bench_server_handler(struct bench_binder *bb, struct parcel *msg,
+				uint32_t code, struct parcel *reply)
+{
+	(void)bb;
+	if (code != BENCH_PING)
+		return -1;
+	parcel_put(reply, msg->data, msg->len);
+	return 0;
+}
+
+static struct {
+	char name[64];
+	uint32_t handle;
+} services[MAX_SERVICES];
+static int nr_services;
+
+/* Minimal context manager, used when servicemanager is not running. */
+static int bench_svcmgr_handler(struct bench_binder *bb, struct parcel *msg,
+				uint32_t code, struct parcel *reply)
+{
+	char name[64];
+	signed long handle;
+	int i;
+
+	parcel_get_u32(msg);
+	parcel_get_str16(msg, name, sizeof(name));
+	if (strcmp(name, SVC_MGR_NAME))
+		return -1;
+	parcel_get_str16(msg, name, sizeof(name));
+
+	for (i = 0; i < nr_services; i++)
+		if (!strcmp(services[i].name, name))
+			break;
+
+	switch (code) {
+	case SVC_MGR_CHECK_SERVICE:
+		if (i == nr_services)
+			parcel_put_u32(reply, 0);
+		else
+			parcel_put_obj(reply, BINDER_TYPE_HANDLE, NULL,
+				       services[i].handle);
+		return 0;
+	case SVC_MGR_ADD_SERVICE:
+		handle = parcel_get_handle(msg);
+		if (handle < 0)
+			return -1;
+		if (i == nr_services) {
+			if (nr_services == MAX_SERVICES)
+				return -1;
+			nr_services++;
+		} else {
+			bench_binder_cmd(bb, BC_RELEASE, &services[i].handle,
+					 sizeof(int));
+		}
+		snprintf(services[i].name, sizeof(services[i].name),
+			 "%s", name);
+		services[i].handle = handle;
+		bench_binder_cmd(bb, BC_ACQUIRE, &services[i].handle,
+				 sizeof(int));
+		parcel_put_u32(reply, 0);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Forks the built-in context manager.  Returns its pid, 0 if another
+ * context manager is already registered, or -1 on error.
+ */
+static pid_t bench_start_svcmgr(void)
+{
+	int pfd[2];
+	char ok = 0;
+	pid_t pid;
+
+	if (pipe(pfd))
+		return -1;
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		struct bench_binder bb;
+
+		close(pfd[0]);
+		if (bench_binder_open(&bb))
+			exit(1);
+		ok = !ioctl(bb.fd, BINDER_SET_CONTEXT_MGR, 0);
+		if (write(pfd[1], &ok, 1) != 1 || !ok)
+			exit(0);
+		close(pfd[1]);
+		bench_binder_loop(&bb, bench_svcmgr_handler);
+		exit(0);
+	}
+	close(pfd[1]);
+	if (read(pfd[0], &ok, 1) != 1)
+		ok = 0;
+	close(pfd[0]);
+	if (!ok) {
+		waitpid(pid, NULL, 0);
+		return 0;
+	}
+	return pid;
+}
+
+static void bench_service_name(char *buf, size_t size, int step, int idx)
+{
+	snprintf(buf, size, "binder_bench.%d.%d.%d", (int)getppid(), step, idx);
+}
+
+static void bench_server(int step, int idx)
+{
+	static int node;	/* address identifies our one binder node */
+	struct bench_binder bb;
+	char name[64];
+
+	if (bench_binder_open(&bb))
+		exit(1);
+	bench_service_name(name, sizeof(name), step, idx);
+	if (svcmgr_add(&bb, name, &node)) {
+		fprintf(stderr, "failed to publish %s\n", name);
+		exit(1);
+	}
+	bench_binder_loop(&bb, bench_server_handler);
+}
+
+static void bench_client(int step, int idx, int start_fd, int result_fd)
+{
+	struct bench_binder bb;
+	struct bench_result res;
+	struct parcel msg, reply;
+	signed long handle = -1;
+	char name[64];
+	uint64_t start;
+	char go;
+	int tries;
+
+	if (bench_binder_open(&bb))
+		exit(1);
+	bench_service_name(name, sizeof(name), step, idx);
+	for (tries = 0; tries < 500 && handle < 0; tries++) {
+		handle = svcmgr_check(&bb, name);
+		if (handle < 0)
+			usleep(10000);
+	}
+	if (handle < 0) {
+		fprintf(stderr, "service %s not found\n", name);
+		exit(1);
+	}
+
+	parcel_init(&msg);
+	memset(msg.data, 0xa5, payload);
+	msg.len = payload;
+
+	/* all clients of a step start together */
+	if (read(start_fd, &go, 1) != 1)
+		exit(1);
+
+	memset(&res, 0, sizeof(res));
+	start = now_ns();
+	for (res.done = 0; res.done < iterations; res.done++) {
+		if (bench_binder_call(&bb, handle, BENCH_PING, &msg, &reply))
+			break;
+	}
+	res.elapsed_ns = now_ns() - start;
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+	exit(res.done == iterations ? 0 : 1);
+}
+
+/* Returns the aggregate transaction rate for @pairs pairs, or < 0. */
+static double bench_step(int step, int pairs, double *mean_us)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int start_pipe[2], result_pipe[2];
+	uint64_t slowest = 0, total_ns = 0;
+	unsigned long total = 0;
+	int i, failed = 0;
+
+	if (pipe(start_pipe) || pipe(result_pipe)) {
+		perror("pipe");
+		return -1;
+	}
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (!servers[i])
+			bench_server(step, i);
+	}
+	for (i = 0; i < pairs; i++) {
+		clients[i] = fork();
+		if (!clients[i]) {
+			close(start_pipe[1]);
+			close(result_pipe[0]);
+			bench_client(step, i, start_pipe[0], result_pipe[1]);
+		}
+	}
+	close(start_pipe[0]);
+	close(result_pipe[1]);
+
+	for (i = 0; i < pairs; i++)
+		if (write(start_pipe[1], "g", 1) != 1)
+			failed = 1;
+	close(start_pipe[1]);
+
+	for (i = 0; i < pairs; i++) {
+		struct bench_result res;
+
+		if (read(result_pipe[0], &res, sizeof(res)) != sizeof(res)) {
+			failed = 1;
+			break;
+		}
+		if (res.done != iterations)
+			failed = 1;
+		if (res.elapsed_ns > slowest)
+			slowest = res.elapsed_ns;
+		total_ns += res.elapsed_ns;
+		total += res.done;
+	}
+	close(result_pipe[0]);
+
+	for (i = 0; i < pairs; i++) {
+		waitpid(clients[i], NULL, 0);
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	if (failed || !total || !slowest)
+		return -1;
+	*mean_us = (double)total_ns / total / 1000.0;
+	return (double)total * 1e9 / slowest;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p max_pairs] [-i iterations] [-s payload_bytes]\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	double base = 0;
+	pid_t svcmgr;
+	int pairs, step = 0, opt;
+
+	max_pairs = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "p:i:s:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_pairs < 1)
+		max_pairs = 1;
+	if (max_pairs > MAX_PAIRS)
+		max_pairs = MAX_PAIRS;
+	if (payload > MAX_PAYLOAD)
+		payload = MAX_PAYLOAD;
+	if (!iterations)
+		usage(argv[0]);
+
+	svcmgr = bench_start_svcmgr();
+	if (svcmgr < 0) {
+		perror("fork");
+		return 1;
+	}
+	printf("%s context manager, %lu iterations, %zu byte payload\n",
+	       svcmgr ? "built-in" : "system", iterations, payload);
+	printf("%6s %14s %10s %8s\n", "pairs", "txn/s", "mean us", "speedup");
+
+	for (pairs = 1; pairs <= max_pairs; pairs *= 2, step++) {
+		double mean_us = 0;
+		double rate = bench_step(step, pairs, &mean_us);
+
+		if (rate < 0) {
+			fprintf(stderr, "step with %d pairs failed\n", pairs);
+			break;
+		}
+		if (!base)
+			base = rate;
+		printf("%6d %14.0f %10.2f %8.2f\n", pairs, rate, mean_us,
+		       rate / base);
+		fflush(stdout);
+	}
+
+	if (svcmgr > 0) {
+		kill(svcmgr, SIGKILL);
+		waitpid(svcmgr, NULL, 0);
+	}
+	return 0;
+}